@@ -0,0 +1,77 @@
+#include <string.h>
+#include "mysql_user_store.h"
+#include "sql_async.h"
+#include "../http/user_loader.h"
+
+//同步执行时按连接缓存预处理语句，交给sql_async时登记为可合并的多行INSERT
+static const char *INSERT_USER_SQL = "INSERT INTO user(username, passwd) VALUES(?,?)";
+
+mysql_user_store::mysql_user_store(connection_pool *pool) : m_pool(pool), m_insert_stmt(-1)
+{
+}
+
+bool mysql_user_store::start()
+{
+    m_insert_stmt = sql_async::get_instance()->add_statement("INSERT INTO user(username, passwd) VALUES", "(?,?)", 2);
+    //由user_loader在后台流式读取，这里只是启动，服务器不必等待载入完成就可以开始监听
+    user_loader::get_instance()->start(m_pool);
+    return true;
+}
+
+void mysql_user_store::stop()
+{
+    user_loader::get_instance()->stop();
+}
+
+bool mysql_user_store::loaded()
+{
+    return user_loader::get_instance()->loaded();
+}
+
+int mysql_user_store::find(const char *name, const char *password, bool *match)
+{
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_pool, connection_pool::REQUEST_WAIT_MS);
+    //等不到数据库连接时不占用工作线程，由调用者返回503
+    if (!mysql)
+        return STORE_UNAVAILABLE;
+    return user_loader::get_instance()->query_user(mysql, name, password, match) ? STORE_OK : STORE_NOT_FOUND;
+}
+
+//在conn上同步插入一个用户，用户名、密码以参数传给预处理语句
+static bool insert_user(MYSQL *conn, const char *name, const char *password)
+{
+    MYSQL_STMT *stmt = connection_pool::GetInstance()->GetStatement(conn, INSERT_USER_SQL);
+    if (!stmt)
+        return false;
+
+    MYSQL_BIND bind[2];
+    unsigned long length[2] = {strlen(name), strlen(password)};
+    memset(bind, 0, sizeof(bind));
+    bind[0].buffer_type = MYSQL_TYPE_STRING;
+    bind[0].buffer = (void *)name;
+    bind[0].buffer_length = length[0];
+    bind[0].length = &length[0];
+    bind[1].buffer_type = MYSQL_TYPE_STRING;
+    bind[1].buffer = (void *)password;
+    bind[1].buffer_length = length[1];
+    bind[1].length = &length[1];
+    return !mysql_stmt_bind_param(stmt, bind) && !mysql_stmt_execute(stmt);
+}
+
+int mysql_user_store::insert(const char *name, const char *password, callback cb, void *arg)
+{
+    //交给非阻塞执行器，工作线程不等待数据库；并发的注册在执行器中合并成多行INSERT
+    if (sql_async::get_instance()->enabled())
+    {
+        const char *values[2] = {name, password};
+        sql_async::get_instance()->submit(m_insert_stmt, values, cb, arg);
+        return STORE_PENDING;
+    }
+
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_pool, connection_pool::REQUEST_WAIT_MS);
+    if (!mysql)
+        return STORE_UNAVAILABLE;
+    return insert_user(mysql, name, password) ? STORE_OK : STORE_FAILED;
+}
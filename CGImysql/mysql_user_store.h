@@ -0,0 +1,25 @@
+#ifndef MYSQL_USER_STORE_H
+#define MYSQL_USER_STORE_H
+//以MySQL服务器为后端的用户存储：已有用户由user_loader在后台流式载入，
+//单独查询和同步插入从连接池取连接，sql_async可用时注册交给它合并成多行INSERT。
+
+#include "user_store.h"
+#include "sql_connection_pool.h"
+
+class mysql_user_store : public user_store
+{
+public:
+    mysql_user_store(connection_pool *pool);
+
+    bool start();
+    void stop();
+    bool loaded();
+    int find(const char *name, const char *password, bool *match);
+    int insert(const char *name, const char *password, callback cb, void *arg);
+
+private:
+    connection_pool *m_pool;
+    int m_insert_stmt; //在sql_async中登记的INSERT语句编号
+};
+
+#endif
@@ -0,0 +1,586 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <mysql/errmsg.h>
+#include "sql_async.h"
+
+//MariaDB Connector/C在mysql.h中定义了MYSQL_WAIT_*，据此判断客户端库是否提供非阻塞接口
+#ifdef MYSQL_WAIT_READ
+#define SQL_ASYNC_SUPPORTED
+static int prepare_start(int *err, MYSQL_STMT *stmt, const std::string &sql)
+{
+    return mysql_stmt_prepare_start(err, stmt, sql.c_str(), sql.size());
+}
+static int prepare_cont(int *err, MYSQL_STMT *stmt, int status)
+{
+    return mysql_stmt_prepare_cont(err, stmt, status);
+}
+static int execute_start(int *err, MYSQL_STMT *stmt)
+{
+    return mysql_stmt_execute_start(err, stmt);
+}
+static int execute_cont(int *err, MYSQL_STMT *stmt, int status)
+{
+    return mysql_stmt_execute_cont(err, stmt, status);
+}
+static int connect_start(MYSQL **ret, MYSQL *conn, const std::string &url, const std::string &user,
+                         const std::string &password, const std::string &db_name, int port)
+{
+    //必须在建立连接之前打开非阻塞模式
+    mysql_options(conn, MYSQL_OPT_NONBLOCK, 0);
+    return mysql_real_connect_start(ret, conn, url.c_str(), user.c_str(), password.c_str(), db_name.c_str(), port,
+                                    NULL, 0);
+}
+static int connect_cont(MYSQL **ret, MYSQL *conn, int status)
+{
+    return mysql_real_connect_cont(ret, conn, status);
+}
+static int socket_of(MYSQL *conn)
+{
+    return mysql_get_socket(conn);
+}
+#else
+#define MYSQL_WAIT_READ 1
+#define MYSQL_WAIT_WRITE 2
+#define MYSQL_WAIT_EXCEPT 4
+#define MYSQL_WAIT_TIMEOUT 8
+static int prepare_start(int *err, MYSQL_STMT *stmt, const std::string &sql)
+{
+    *err = 1;
+    return 0;
+}
+static int prepare_cont(int *err, MYSQL_STMT *stmt, int status)
+{
+    *err = 1;
+    return 0;
+}
+static int execute_start(int *err, MYSQL_STMT *stmt)
+{
+    *err = 1;
+    return 0;
+}
+static int execute_cont(int *err, MYSQL_STMT *stmt, int status)
+{
+    *err = 1;
+    return 0;
+}
+static int connect_start(MYSQL **ret, MYSQL *conn, const std::string &url, const std::string &user,
+                         const std::string &password, const std::string &db_name, int port)
+{
+    *ret = NULL;
+    return 0;
+}
+static int connect_cont(MYSQL **ret, MYSQL *conn, int status)
+{
+    *ret = NULL;
+    return 0;
+}
+static int socket_of(MYSQL *conn)
+{
+    return -1;
+}
+#endif
+
+//连接已断开的错误，需要重连；其他错误（如语句本身有误）只让这批行失败
+static bool connection_lost(unsigned int code)
+{
+    return CR_SERVER_GONE_ERROR == code || CR_SERVER_LOST == code;
+}
+
+sql_async::sql_async() : m_epollfd(-1), m_wakefd(-1), m_port(0), m_enabled(false), m_close_log(0)
+{
+}
+
+sql_async::~sql_async()
+{
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        for (size_t j = 0; j < m_slots[i].cache.size(); ++j)
+        {
+            if (m_slots[i].cache[j])
+                mysql_stmt_close(m_slots[i].cache[j]);
+        }
+        if (m_slots[i].conn)
+            mysql_close(m_slots[i].conn);
+    }
+    if (m_wakefd != -1)
+        close(m_wakefd);
+}
+
+bool sql_async::init(const std::string &url, const std::string &user, const std::string &password,
+                     const std::string &db_name, int port, int conn_num, int close_log)
+{
+    m_close_log = close_log;
+#ifdef SQL_ASYNC_SUPPORTED
+    //重连时使用
+    m_url = url;
+    m_user = user;
+    m_password = password;
+    m_db_name = db_name;
+    m_port = port;
+    //工作线程提交后写eventfd唤醒主线程，由主线程开始执行
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == m_wakefd)
+    {
+        LOG_ERROR("eventfd failed, async SQL disabled");
+        return false;
+    }
+    m_slots.reserve(conn_num);
+    for (int i = 0; i < conn_num; ++i)
+    {
+        MYSQL *conn = mysql_init(NULL);
+        if (!conn)
+            break;
+        //必须在建立连接之前打开非阻塞模式；建立连接本身仍是阻塞的，只在启动时执行一次
+        mysql_options(conn, MYSQL_OPT_NONBLOCK, 0);
+        if (!mysql_real_connect(conn, url.c_str(), user.c_str(), password.c_str(), db_name.c_str(), port, NULL, 0))
+        {
+            LOG_ERROR("MySQL Error[errno=%u]: %s", mysql_errno(conn), mysql_error(conn));
+            mysql_close(conn);
+            break;
+        }
+        m_slots.push_back(slot());
+        slot &s = m_slots.back();
+        s.conn = conn;
+        s.fd = mysql_get_socket(conn);
+        s.busy = false;
+        s.waiting = false;
+        s.broken = false;
+        s.retry_at = 0;
+        s.status = 0;
+        s.deadline = 0;
+        s.phase = PHASE_PREPARE;
+        s.stmt = NULL;
+    }
+    m_enabled = !m_slots.empty();
+#endif
+    return m_enabled;
+}
+
+int sql_async::add_statement(const char *head, const char *row, int params)
+{
+    statement st;
+    st.head = head;
+    st.row = row;
+    st.params = params < MAX_PARAMS ? params : MAX_PARAMS;
+    m_statements.push_back(st);
+    return (int)m_statements.size() - 1;
+}
+
+void sql_async::attach(int epollfd)
+{
+    if (!m_enabled)
+        return;
+    m_epollfd = epollfd;
+    //eventfd按水平触发注册，主线程读空计数之前一直可读
+    epoll_event wake;
+    wake.data.u64 = (uint32_t)m_wakefd;
+    wake.events = EPOLLIN;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_wakefd, &wake);
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        //事件标识与客户连接相同，低32位为fd，代数为0
+        //先以不关注任何事件的方式加入，语句挂起时再按需要的事件修改
+        epoll_event event;
+        event.data.u64 = (uint32_t)m_slots[i].fd;
+        event.events = EPOLLONESHOT;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_slots[i].fd, &event);
+    }
+}
+
+bool sql_async::owns(int fd) const
+{
+    if (fd == m_wakefd)
+        return true;
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        if (m_slots[i].fd == fd)
+            return true;
+    }
+    return false;
+}
+
+sql_async::slot *sql_async::find_slot(int fd)
+{
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        if (m_slots[i].fd == fd)
+            return &m_slots[i];
+    }
+    return NULL;
+}
+
+void sql_async::submit(int stmt, const char *const *values, callback cb, void *arg)
+{
+    row r;
+    r.stmt = stmt;
+    for (int i = 0; i < m_statements[stmt].params; ++i)
+        r.values[i] = values[i];
+    r.cb = cb;
+    r.arg = arg;
+    r.alone = false;
+
+    //连接只由主线程操作：这里只排队，回调不会在工作线程返回SQL_REQUEST之前执行
+    m_lock.lock();
+    m_queue.push_back(r);
+    m_lock.unlock();
+    wake();
+}
+
+void sql_async::wake()
+{
+    uint64_t one = 1;
+    write(m_wakefd, &one, sizeof(one));
+}
+
+void sql_async::dispatch()
+{
+    bool alive = false;
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        slot *s = &m_slots[i];
+        if (!s->broken)
+            alive = true;
+        //忙的连接完成当前语句后自己领取排队的行，和其他排队的行合并执行
+        if (s->busy)
+            continue;
+        m_lock.lock();
+        bool more = take_batch_locked(s);
+        m_lock.unlock();
+        if (more)
+            advance(s, 0);
+    }
+    //所有连接都断开：排队的行不再等待重连，直接失败
+    if (!alive)
+        fail_queued();
+}
+
+void sql_async::fail_queued()
+{
+    std::list<row> failed;
+    m_lock.lock();
+    failed.swap(m_queue);
+    m_lock.unlock();
+    for (std::list<row>::iterator it = failed.begin(); it != failed.end(); ++it)
+        it->cb(it->arg, 1);
+}
+
+void sql_async::connect(slot *s, int status)
+{
+    MYSQL *ret = NULL;
+    if (0 == status)
+    {
+        //先关闭旧连接：客户端库随之让其上的语句失效，再关闭这些语句只释放内存，不访问网络
+        if (s->conn)
+            mysql_close(s->conn);
+        for (size_t i = 0; i < s->cache.size(); ++i)
+        {
+            if (s->cache[i])
+                mysql_stmt_close(s->cache[i]);
+            s->cache[i] = NULL;
+        }
+        s->stmt = NULL;
+        s->fd = -1;
+        s->busy = true;
+        s->broken = false;
+        s->phase = PHASE_CONNECT;
+        s->conn = mysql_init(NULL);
+        if (s->conn)
+        {
+            status = connect_start(&ret, s->conn, m_url, m_user, m_password, m_db_name, m_port);
+            s->fd = socket_of(s->conn);
+            if (status || ret)
+            {
+                //新连接的socket先以不关注任何事件的方式加入，由wait按需要的事件修改
+                epoll_event event;
+                event.data.u64 = (uint32_t)s->fd;
+                event.events = EPOLLONESHOT;
+                epoll_ctl(m_epollfd, EPOLL_CTL_ADD, s->fd, &event);
+            }
+        }
+    }
+    else
+    {
+        status = connect_cont(&ret, s->conn, status);
+    }
+    if (status)
+    {
+        wait(s, status);
+        return;
+    }
+
+    if (!ret)
+    {
+        if (s->conn)
+        {
+            LOG_ERROR("MySQL reconnect failed[errno=%u]: %s", mysql_errno(s->conn), mysql_error(s->conn));
+            mysql_close(s->conn);
+            s->conn = NULL;
+        }
+        s->fd = -1;
+        s->broken = true;
+        s->retry_at = time(NULL) + RECONNECT_SEC;
+        dispatch();
+        return;
+    }
+
+    LOG_INFO("MySQL async connection reconnected");
+    s->phase = PHASE_PREPARE;
+    m_lock.lock();
+    bool more = take_batch_locked(s);
+    m_lock.unlock();
+    if (more)
+        advance(s, 0);
+}
+
+bool sql_async::take_batch_locked(slot *s)
+{
+    s->batch.clear();
+    if (m_queue.empty())
+    {
+        s->busy = false;
+        return false;
+    }
+
+    row &first = m_queue.front();
+    int stmt = first.stmt;
+    bool alone = first.alone;
+    s->batch.push_back(first);
+    m_queue.pop_front();
+    //同一语句的行按提交顺序合并，拆出来单独重试的行不参与合并
+    std::list<row>::iterator it = m_queue.begin();
+    while (!alone && it != m_queue.end() && s->batch.size() < (size_t)MAX_BATCH_ROWS)
+    {
+        if (it->stmt == stmt && !it->alone)
+        {
+            s->batch.push_back(*it);
+            it = m_queue.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    s->busy = true;
+    return true;
+}
+
+int sql_async::begin(slot *s, int *err)
+{
+    int stmt = s->batch[0].stmt;
+    size_t index = stmt * MAX_BATCH_ROWS + s->batch.size() - 1;
+    if (s->cache.size() <= index)
+        s->cache.resize(m_statements.size() * MAX_BATCH_ROWS, NULL);
+    s->stmt = s->cache[index];
+    if (s->stmt)
+        return execute(s, err);
+
+    //该行数的语句在这个连接上第一次使用，先预处理
+    const statement &st = m_statements[stmt];
+    s->sql = st.head;
+    for (size_t i = 0; i < s->batch.size(); ++i)
+    {
+        if (i > 0)
+            s->sql += ',';
+        s->sql += st.row;
+    }
+    s->stmt = mysql_stmt_init(s->conn);
+    if (!s->stmt)
+    {
+        *err = 1;
+        return 0;
+    }
+    s->phase = PHASE_PREPARE;
+    return prepare_start(err, s->stmt, s->sql);
+}
+
+int sql_async::execute(slot *s, int *err)
+{
+    //预处理刚完成的语句放入缓存
+    int stmt = s->batch[0].stmt;
+    size_t index = stmt * MAX_BATCH_ROWS + s->batch.size() - 1;
+    s->cache[index] = s->stmt;
+
+    int params = m_statements[stmt].params;
+    size_t n = s->batch.size() * params;
+    s->binds.resize(n);
+    s->lengths.resize(n);
+    memset(&s->binds[0], 0, n * sizeof(MYSQL_BIND));
+    for (size_t i = 0; i < s->batch.size(); ++i)
+    {
+        for (int j = 0; j < params; ++j)
+        {
+            const std::string &value = s->batch[i].values[j];
+            size_t k = i * params + j;
+            s->lengths[k] = value.size();
+            s->binds[k].buffer_type = MYSQL_TYPE_STRING;
+            s->binds[k].buffer = (void *)value.c_str();
+            s->binds[k].buffer_length = value.size();
+            s->binds[k].length = &s->lengths[k];
+        }
+    }
+    s->phase = PHASE_EXECUTE;
+    if (mysql_stmt_bind_param(s->stmt, &s->binds[0]))
+    {
+        *err = 1;
+        return 0;
+    }
+    return execute_start(err, s->stmt);
+}
+
+void sql_async::advance(slot *s, int status)
+{
+    if (PHASE_CONNECT == s->phase)
+    {
+        connect(s, status);
+        return;
+    }
+    while (true)
+    {
+        int err = 0;
+        if (0 == status)
+            status = begin(s, &err);
+        else if (PHASE_PREPARE == s->phase)
+            status = prepare_cont(&err, s->stmt, status);
+        else
+            status = execute_cont(&err, s->stmt, status);
+
+        //预处理完成，接着执行
+        if (0 == status && !err && PHASE_PREPARE == s->phase)
+            status = execute(s, &err);
+        if (status)
+        {
+            wait(s, status);
+            return;
+        }
+
+        bool lost = false;
+        if (err)
+        {
+            unsigned int code = s->stmt ? mysql_stmt_errno(s->stmt) : mysql_errno(s->conn);
+            LOG_ERROR("SQL error[errno=%u]:%s", code, s->stmt ? mysql_stmt_error(s->stmt) : mysql_error(s->conn));
+            lost = connection_lost(code);
+            //预处理失败的语句不能再用
+            if (s->stmt && PHASE_PREPARE == s->phase)
+            {
+                mysql_stmt_close(s->stmt);
+                s->stmt = NULL;
+            }
+        }
+        finish_batch(s, err);
+
+        //连接断开时重连；拆开放回队列的行交给其他空闲的连接
+        if (lost)
+        {
+            wake();
+            connect(s, 0);
+            return;
+        }
+
+        m_lock.lock();
+        bool more = take_batch_locked(s);
+        m_lock.unlock();
+        if (!more)
+            return;
+    }
+}
+
+void sql_async::finish_batch(slot *s, int err)
+{
+    if (err && s->batch.size() > 1)
+    {
+        //多行语句失败，可能只是其中一行的问题：拆开放回队首，逐行重试
+        m_lock.lock();
+        for (size_t i = s->batch.size(); i-- > 0;)
+        {
+            s->batch[i].alone = true;
+            m_queue.push_front(s->batch[i]);
+        }
+        m_lock.unlock();
+    }
+    else
+    {
+        for (size_t i = 0; i < s->batch.size(); ++i)
+            s->batch[i].cb(s->batch[i].arg, err);
+    }
+    s->batch.clear();
+}
+
+void sql_async::wait(slot *s, int status)
+{
+    epoll_event event;
+    event.data.u64 = (uint32_t)s->fd;
+    event.events = EPOLLONESHOT;
+    if (status & MYSQL_WAIT_READ)
+        event.events |= EPOLLIN;
+    if (status & MYSQL_WAIT_WRITE)
+        event.events |= EPOLLOUT;
+    if (status & MYSQL_WAIT_EXCEPT)
+        event.events |= EPOLLPRI;
+
+    m_lock.lock();
+    s->status = status;
+    s->waiting = true;
+    s->deadline = 0;
+#ifdef SQL_ASYNC_SUPPORTED
+    if (status & MYSQL_WAIT_TIMEOUT)
+        s->deadline = time(NULL) + mysql_get_timeout_value(s->conn);
+#endif
+    m_lock.unlock();
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, s->fd, &event);
+}
+
+void sql_async::on_event(int fd, uint32_t events)
+{
+    if (fd == m_wakefd)
+    {
+        uint64_t count;
+        read(m_wakefd, &count, sizeof(count));
+        dispatch();
+        return;
+    }
+
+    slot *s = find_slot(fd);
+    if (!s)
+        return;
+
+    m_lock.lock();
+    bool waiting = s->waiting;
+    s->waiting = false;
+    m_lock.unlock();
+    //语句已因超时继续执行过，这是残留的事件
+    if (!waiting)
+        return;
+
+    int status = 0;
+    if (events & EPOLLIN)
+        status |= MYSQL_WAIT_READ;
+    if (events & EPOLLOUT)
+        status |= MYSQL_WAIT_WRITE;
+    if (events & EPOLLPRI)
+        status |= MYSQL_WAIT_EXCEPT;
+    //连接出错时把读写都交给客户端库，由它报告错误
+    if (events & (EPOLLERR | EPOLLHUP))
+        status |= MYSQL_WAIT_READ | MYSQL_WAIT_WRITE;
+    advance(s, status);
+}
+
+void sql_async::check_timeouts()
+{
+    time_t now = time(NULL);
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        slot *s = &m_slots[i];
+        m_lock.lock();
+        bool expired = s->waiting && s->deadline != 0 && s->deadline <= now;
+        if (expired)
+            s->waiting = false;
+        m_lock.unlock();
+        if (expired)
+            advance(s, MYSQL_WAIT_TIMEOUT);
+        //重连失败的连接到时间再试
+        else if (s->broken && s->retry_at <= now)
+            connect(s, 0);
+    }
+}
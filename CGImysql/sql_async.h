@@ -0,0 +1,143 @@
+#ifndef SQL_ASYNC_H
+#define SQL_ASYNC_H
+//以单例模式实现的非阻塞数据库执行器，基于MariaDB Connector/C的非阻塞接口（mysql_stmt_*_start/_cont）。
+//持有若干条设置了MYSQL_OPT_NONBLOCK的连接，连接的socket注册在主线程的epoll中：
+//工作线程提交一行数据后立即返回，不等待数据库；行由主线程开始执行，需要等待网络时挂起，收到socket事件后继续，完成后调用回调。
+//语句与回调都只在主线程中执行，回调不会在提交它的工作线程返回之前、在该线程中被调用。
+//语句以“语句头 + 每行的占位符”登记（如"INSERT INTO t(a, b) VALUES" + "(?,?)"），按行提交：
+//有空闲连接时立即执行；所有连接都在忙时新提交的行排队，连接空出后把排队的行合并成一条多行INSERT一次执行、一次提交。
+//每个连接按行数缓存预处理好的语句。多行语句执行失败时，这批行拆开逐行重试，每行得到各自的结果。
+//连接断开（客户端错误）后以非阻塞方式重连，重连失败的连接在定时器中隔RECONNECT_SEC秒再试；所有连接都断开时排队的行直接失败。
+//客户端库没有非阻塞接口（如MySQL自带的libmysqlclient）时init返回false，调用者改用连接池同步执行。
+
+#include <time.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <mysql/mysql.h>
+#include "../lock/locker.h"
+#include "../log/log.h"
+
+class sql_async
+{
+public:
+    static const int MAX_PARAMS = 4;    //每行的参数个数上限
+    static const int MAX_BATCH_ROWS = 32; //一条语句最多合并的行数
+    static const int RECONNECT_SEC = 5;   //重连失败后再次尝试的间隔
+
+    //一行完成时调用，err为0表示该行已提交；在主线程中执行，不能阻塞
+    typedef void (*callback)(void *arg, int err);
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static sql_async *get_instance()
+    {
+        static sql_async instance;
+        return &instance;
+    }
+
+    //建立conn_num条非阻塞连接，客户端库不支持或连接失败时返回false
+    bool init(const std::string &url, const std::string &user, const std::string &password, const std::string &db_name,
+              int port, int conn_num, int close_log);
+    bool enabled() const { return m_enabled; }
+
+    //登记一条可合并的语句，返回语句编号；head为语句头，row为一行的占位符，params为一行的参数个数
+    int add_statement(const char *head, const char *row, int params);
+
+    //把各连接的socket加入主线程的epoll，在创建epoll之后、处理请求之前调用
+    void attach(int epollfd);
+    //fd是否为本执行器的数据库连接或唤醒主线程的eventfd，主线程据此分发事件
+    bool owns(int fd) const;
+
+    //提交一行，values为该行的参数（字符串，个数为登记时的params）；只是排队并唤醒主线程，cb总在之后由主线程调用
+    void submit(int stmt, const char *const *values, callback cb, void *arg);
+
+    //主线程：数据库连接的socket或eventfd上有事件
+    void on_event(int fd, uint32_t events);
+    //主线程定时调用：处理客户端库要求的超时，重试断开的连接
+    void check_timeouts();
+
+private:
+    sql_async();
+    ~sql_async();
+
+    struct statement
+    {
+        std::string head;
+        std::string row;
+        int params;
+    };
+
+    struct row
+    {
+        int stmt;
+        std::string values[MAX_PARAMS];
+        callback cb;
+        void *arg;
+        bool alone; //合并执行失败后拆出来的行，单独执行
+    };
+
+    enum phase
+    {
+        PHASE_PREPARE = 0,
+        PHASE_EXECUTE,
+        PHASE_CONNECT //正在重连，或重连失败等待再试（broken）
+    };
+
+    struct slot
+    {
+        MYSQL *conn;
+        int fd;       //连接断开、重连失败时为-1
+        bool busy;    //正在执行语句或重连，不能领取新的行
+        bool waiting; //语句挂起，等待socket事件或超时
+        bool broken;  //重连失败，到retry_at再试
+        time_t retry_at;
+        int status;   //挂起时客户端库等待的事件，MYSQL_WAIT_*
+        time_t deadline;
+        int phase;
+        MYSQL_STMT *stmt;           //正在预处理或执行的语句
+        std::string sql;            //正在预处理的语句文本，预处理完成前必须保持有效
+        std::vector<row> batch;     //本次执行的行
+        std::vector<MYSQL_STMT *> cache; //预处理好的语句，下标为 语句编号*MAX_BATCH_ROWS + 行数-1
+        std::vector<MYSQL_BIND> binds;
+        std::vector<unsigned long> lengths;
+    };
+
+    slot *find_slot(int fd);
+    //唤醒主线程领取排队的行
+    void wake();
+    //主线程：把排队的行交给空闲的连接；所有连接都断开时让排队的行失败
+    void dispatch();
+    void fail_queued();
+    //断开的连接重新建立：status为0时关闭旧连接并开始连接，否则以该事件继续握手
+    void connect(slot *s, int status);
+    //从队列中取一批行交给s，没有时s变为空闲并返回false；调用者持有m_lock
+    bool take_batch_locked(slot *s);
+    //开始执行s上的一批行：取缓存的语句，没有时先预处理；返回值同mysql_*_start
+    int begin(slot *s, int *err);
+    //缓存预处理好的语句，绑定参数并开始执行
+    int execute(slot *s, int *err);
+    //推进s上的语句直到挂起或队列为空；status非0时表示以该事件继续挂起的语句
+    void advance(slot *s, int status);
+    //挂起：按客户端库要求的事件重新注册socket
+    void wait(slot *s, int status);
+    //一批行执行结束，回调各行或拆开重试
+    void finish_batch(slot *s, int err);
+
+private:
+    std::vector<slot> m_slots;
+    std::vector<statement> m_statements;
+    std::list<row> m_queue;
+    locker m_lock;
+    int m_epollfd;
+    int m_wakefd;
+    std::string m_url;
+    std::string m_user;
+    std::string m_password;
+    std::string m_db_name;
+    int m_port;
+    bool m_enabled;
+    int m_close_log;
+};
+
+#endif
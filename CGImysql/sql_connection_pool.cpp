@@ -4,16 +4,30 @@
 #include <string.h>
 #include <stdlib.h>
 #include <list>
+#include <vector>
 #include <pthread.h>
 #include <iostream>
 #include "sql_connection_pool.h"
+#include "../metrics/metrics.h"
 
 using namespace std;
 
+//本线程在m_Sticky中的槽位，未绑定时为-1
+static thread_local int t_sticky = -1;
+
 connection_pool::connection_pool()
 {
+	m_MaxConn = 0;
+	m_MinConn = 0;
 	m_CurConn = 0;
 	m_FreeConn = 0;
+	m_StickyCount = 0;
+	m_Waiters = 0;
+	for (int i = 0; i < MAX_STICKY; i++)
+	{
+		m_Sticky[i].conn = NULL;
+		m_Sticky[i].since = 0;
+	}
 }
 
 connection_pool *connection_pool::GetInstance()
@@ -27,74 +41,203 @@ void connection_pool::init(string url, string User, string PassWord, string DBNa
 {
 	//初始化数据库信息
 	m_url = url;
-	m_Port = Port;
+	m_Port = to_string(Port);
 	m_User = User;
 	m_PassWord = PassWord;
 	m_DatabaseName = DBName;
 	m_close_log = close_log;
+	m_MaxConn = MaxConn;
+	m_MinConn = MaxConn / 2 > 0 ? MaxConn / 2 : 1;
 
-	//创建MaxConn条数据库连接
-	for (int i = 0; i < MaxConn; i++)
+	//常驻的连接并行建立，启动时间不再随连接数线性增长；线程创建失败时在当前线程中建立
+	vector<pthread_t> tids;
+	for (int i = 0; i < m_MinConn; i++)
 	{
-		MYSQL* con = NULL;
-		MYSQL* ret = NULL;
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, ConnectWorker, this) == 0)
+			tids.push_back(tid);
+		else
+			ConnectWorker(this);
+	}
+	for (size_t i = 0; i < tids.size(); i++)
+		pthread_join(tids[i], NULL);
+
+	//一条都连不上说明数据库不可用，直接退出；部分失败的在需要时再建立
+	if (0 == m_FreeConn)
+	{
+		LOG_ERROR("MySQL Error: no connection to %s:%d", url.c_str(), Port);
+		exit(1);
+	}
+}
+
+void *connection_pool::ConnectWorker(void *arg)
+{
+	connection_pool *pool = (connection_pool *)arg;
+	MYSQL *con = pool->Connect();
+	if (con)
+	{
+		pool->lock.lock();
+		idle_conn idle = {con, time(NULL)};
+		pool->connList.push_back(idle);
+		++pool->m_FreeConn;
+		pool->lock.unlock();
+	}
+	return NULL;
+}
 
-		ret = mysql_init(con);
-		if (ret == NULL)
+MYSQL *connection_pool::Connect()
+{
+	MYSQL *con = mysql_init(NULL);
+	if (con == NULL)
+	{
+		// 如果mysql_init()返回空，那就打印该信息
+		LOG_ERROR("MySQL Error: mysql_init() returns NULL");
+		return NULL;
+	}
+
+	if (mysql_real_connect(con, m_url.c_str(), m_User.c_str(), m_PassWord.c_str(), m_DatabaseName.c_str(),
+						   atoi(m_Port.c_str()), NULL, 0) == NULL)
+	{
+		// 如果mysql_real_connect()返回空，那就使用mysql_errorh和mysql_errno打印具体的出错信息
+		LOG_ERROR("MySQL Error[errno=%u]: %s", mysql_errno(con), mysql_error(con));
+		mysql_close(con);
+		return NULL;
+	}
+	return con;
+}
+
+void connection_pool::CloseConnection(MYSQL *con)
+{
+	//连接关闭后地址可能被新连接复用，它名下缓存的语句必须一起删掉
+	lock.lock();
+	map<pair<MYSQL *, string>, MYSQL_STMT *>::iterator it = stmtCache.lower_bound(make_pair(con, string()));
+	while (it != stmtCache.end() && it->first.first == con)
+	{
+		mysql_stmt_close(it->second);
+		stmtCache.erase(it++);
+	}
+	lock.unlock();
+	mysql_close(con);
+}
+
+//当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数。
+//没有空闲连接时，连接数未到上限就新建一条，否则等待其他线程放回，超过timeout_ms返回NULL
+MYSQL *connection_pool::GetConnection(int timeout_ms)
+{
+	struct timespec deadline;
+	if (timeout_ms >= 0)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	//先取本线程留下的连接，不加锁
+	if (t_sticky >= 0)
+	{
+		MYSQL *con = m_Sticky[t_sticky].conn.exchange(NULL);
+		if (con)
+			return Revive(con, m_Sticky[t_sticky].since.load(memory_order_relaxed));
+	}
+
+	lock.lock();
+	while (true)
+	{
+		if (!connList.empty())
 		{
-          // 如果mysql_init()返回空，那就打印该信息
-			LOG_ERROR("MySQL Error: mysql_init() returns NULL");
-			exit(1);
-		} else {
-			con = ret;
+			/*读元素和弹出元素应该被视作为一个原子操作，若先读再加锁，再弹出元素，则可能出现以下情况：
+			A线程和B线程都读了队首的元素，但是B线程先获得锁，B弹出元素后再把锁给A，此时就出现了读两次，但只弹出了一次*/
+			idle_conn idle = connList.front();
+			connList.pop_front();
+			--m_FreeConn;
+			++m_CurConn;
+			lock.unlock();
+			return Revive(idle.conn, idle.since);
 		}
 
-		ret = mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(), DBName.c_str(), Port, NULL, 0);
-		if (ret == NULL)
+		if (m_CurConn + m_FreeConn < m_MaxConn)
 		{
-          // 如果mysql_real_connect()返回空，那就使用mysql_errorh和mysql_errno打印具体的出错信息
-			string err_info(mysql_error(con));
-			err_info = (string("MySQL Error[errno=")
-				+ std::to_string(mysql_errno(con)) + string("]: ") + err_info);
-			LOG_ERROR( err_info.c_str() );
-			exit(1);
-		} else {
-			con = ret;
+			//先占住名额再在锁外建立连接，连接失败（数据库不可用）时立即返回，不让请求一直等待
+			++m_CurConn;
+			lock.unlock();
+			MYSQL *con = Connect();
+			if (con)
+				return con;
+			lock.lock();
+			--m_CurConn;
+			lock.unlock();
+			m_cond.signal();
+			return NULL;
 		}
 
-		//更新连接池和空闲连接数量
-		connList.push_back(con);
-		++m_FreeConn;
-	}
+		//连接数已到上限：先取其他线程槽位中闲置的连接。先登记为等待者再查看槽位，
+		//与ReleaseConnection中先放入槽位再查看等待者配合，放入槽位的连接不会被漏掉
+		++m_Waiters;
+		time_t since;
+		MYSQL *con = StealSticky(&since);
+		if (con)
+		{
+			--m_Waiters;
+			lock.unlock();
+			return Revive(con, since);
+		}
 
-	//将信号量初始化为最大连接次数
-	reserve = sem(m_FreeConn);
-	m_MaxConn = m_FreeConn;
+		bool timeout = false;
+		if (timeout_ms < 0)
+			m_cond.wait(lock.get());
+		else
+			timeout = !m_cond.timewait(lock.get(), deadline);
+		--m_Waiters;
+		if (timeout && connList.empty())
+		{
+			lock.unlock();
+			return NULL;
+		}
+	}
 }
 
-//当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
-MYSQL *connection_pool::GetConnection()
+//空闲较久的连接可能已被服务器断开（wait_timeout），先ping，失败时换一条新连接
+MYSQL *connection_pool::Revive(MYSQL *con, time_t since)
 {
-	MYSQL *con = NULL;
-
-	if (0 == connList.size())//调用empt()而不是检查size()是否为0,empty()对所有的标准容器都是常数时间操作，而对一些list实现，size()耗费线性时间。
-		return NULL;
-	/*
-	当线程数量大于数据库连接数量时，使用信号量进行同步，每次取出一个数据库连接，信号量原子减1，
-	若连接池内没有连接了，则阻塞等待。*/
-	reserve.wait();
-	
+	if (time(NULL) - since < PING_IDLE_SEC || 0 == mysql_ping(con))
+		return con;
+	LOG_WARN("MySQL connection lost after %lds idle, reconnecting", (long)(time(NULL) - since));
+	CloseConnection(con);
+	con = Connect();
+	if (con)
+		return con;
 	lock.lock();
-	/*读元素和弹出元素应该被视作为一个原子操作，若先读再加锁，再弹出元素，则可能出现以下情况：
-	A线程和B线程都读了队首的元素，但是B线程先获得锁，B弹出元素后再把锁给A，此时就出现了读两次，但只弹出了一次*/
-	con = connList.front();
-	connList.pop_front();
+	--m_CurConn;
+	lock.unlock();
+	m_cond.signal();
+	return NULL;
+}
 
-	--m_FreeConn;
-	++m_CurConn;
+MYSQL *connection_pool::StealSticky(time_t *since)
+{
+	for (int i = 0; i < m_StickyCount; i++)
+	{
+		MYSQL *con = m_Sticky[i].conn.exchange(NULL);
+		if (con)
+		{
+			*since = m_Sticky[i].since.load(memory_order_relaxed);
+			return con;
+		}
+	}
+	return NULL;
+}
 
+void connection_pool::BindThread()
+{
+	lock.lock();
+	if (t_sticky < 0 && m_StickyCount < MAX_STICKY)
+		t_sticky = m_StickyCount++;
 	lock.unlock();
-	return con;
 }
 
 //释放当前使用的连接
@@ -103,32 +246,135 @@ bool connection_pool::ReleaseConnection(MYSQL *con)
 	if (NULL == con)
 		return false;
 
+	//绑定过的线程把连接留在自己的槽位中，下次直接取用，预处理语句缓存也保持在同一条连接上。
+	//Maintain也会把连接放回槽位，所以只在槽位为空时用比较交换放入，槽位已被占用时放回链表
+	MYSQL *empty = NULL;
+	if (t_sticky >= 0 && m_Sticky[t_sticky].conn.compare_exchange_strong(empty, con))
+	{
+		m_Sticky[t_sticky].since.store(time(NULL), memory_order_relaxed);
+		if (0 == m_Waiters.load())
+			return true;
+		//有线程在等待连接，改为放回链表并通知；已被等待者取走时直接返回
+		con = m_Sticky[t_sticky].conn.exchange(NULL);
+		if (NULL == con)
+			return true;
+	}
+
 	lock.lock();
 
-	connList.push_back(con);
+	//放在表头，常用的连接保持活跃，表尾的连接空闲得足够久后被Maintain关闭
+	idle_conn idle = {con, time(NULL)};
+	connList.push_front(idle);
 	++m_FreeConn;
 	--m_CurConn;
 
 	lock.unlock();
 
-	//释放连接原子加1
-	reserve.post();
+	//通知一个等待连接的线程
+	m_cond.signal();
 	return true;
 }
 
+void connection_pool::Maintain()
+{
+	vector<MYSQL *> idle;
+	time_t now = time(NULL);
+	lock.lock();
+	while (!connList.empty() && m_CurConn + m_FreeConn > m_MinConn && now - connList.back().since >= REAP_IDLE_SEC)
+	{
+		idle.push_back(connList.back().conn);
+		connList.pop_back();
+		--m_FreeConn;
+	}
+	int sticky = m_StickyCount;
+	lock.unlock();
+
+	//线程槽位中的连接同样按空闲时间回收，所属线程暂时不用数据库时不会一直占着
+	for (int i = 0; i < sticky; i++)
+	{
+		MYSQL *con = m_Sticky[i].conn.exchange(NULL);
+		if (NULL == con)
+			continue;
+		bool reap = false;
+		if (now - m_Sticky[i].since.load(memory_order_relaxed) >= REAP_IDLE_SEC)
+		{
+			lock.lock();
+			if (m_CurConn + m_FreeConn > m_MinConn)
+			{
+				--m_CurConn;
+				reap = true;
+			}
+			lock.unlock();
+		}
+		if (reap)
+			idle.push_back(con);
+		else
+		{
+			//放回原槽位；所属线程已放入了另一条连接时放回链表
+			MYSQL *empty = NULL;
+			if (!m_Sticky[i].conn.compare_exchange_strong(empty, con))
+				ReleaseConnection(con);
+		}
+	}
+
+	for (size_t i = 0; i < idle.size(); i++)
+		CloseConnection(idle[i]);
+	if (!idle.empty())
+	{
+		LOG_INFO("closed %d idle MySQL connections", (int)idle.size());
+	}
+}
+
+MYSQL_STMT *connection_pool::GetStatement(MYSQL *conn, const char *sql)
+{
+	pair<MYSQL *, string> key(conn, sql);
+	lock.lock();
+	map<pair<MYSQL *, string>, MYSQL_STMT *>::iterator it = stmtCache.find(key);
+	MYSQL_STMT *stmt = it == stmtCache.end() ? NULL : it->second;
+	lock.unlock();
+	if (stmt)
+		return stmt;
+
+	//连接同一时间只属于一个线程，在锁外预处理
+	stmt = mysql_stmt_init(conn);
+	if (!stmt)
+		return NULL;
+	if (mysql_stmt_prepare(stmt, sql, strlen(sql)))
+	{
+		LOG_ERROR("prepare error:%s", mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+	lock.lock();
+	stmtCache[key] = stmt;
+	lock.unlock();
+	return stmt;
+}
+
 //销毁数据库连接池
 //通过迭代器遍历连接池链表，关闭对应数据库连接，清空链表并重置空闲连接和现有连接数量。
 void connection_pool::DestroyPool()
 {
 
 	lock.lock();
+	for (int i = 0; i < m_StickyCount; i++)
+	{
+		MYSQL *con = m_Sticky[i].conn.exchange(NULL);
+		if (con)
+			connList.push_back(idle_conn{con, 0});
+	}
 	if (connList.size() > 0)//调用empt()而不是检查size()是否为0,empty()对所有的标准容器都是常数时间操作，而对一些list实现，size()耗费线性时间。
 	{
+		map<pair<MYSQL *, string>, MYSQL_STMT *>::iterator st;
+		for (st = stmtCache.begin(); st != stmtCache.end(); ++st)
+			mysql_stmt_close(st->second);
+		stmtCache.clear();
+
 		//通过迭代器遍历，关闭数据库连接
-		list<MYSQL *>::iterator it;
+		list<idle_conn>::iterator it;
 		for (it = connList.begin(); it != connList.end(); ++it)
 		{
-			MYSQL *con = *it;
+			MYSQL *con = it->conn;
 			mysql_close(con);
 		}
 		m_CurConn = 0;
@@ -151,8 +397,13 @@ connection_pool::~connection_pool()
 }
 
 //具体实现：不直接调用获取和释放连接的接口，将其封装起来，通过RAII机制进行获取和释放。
-connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool){
-	*SQL = connPool->GetConnection();
+connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool, int timeout_ms){
+	//取连接的等待时间，包括按需新建连接和ping空闲过久的连接
+	metrics *stats = metrics::get_instance();
+	uint64_t start = stats->enabled() ? metrics::now_us() : 0;
+	*SQL = connPool->GetConnection(timeout_ms);
+	if (stats->enabled())
+		stats->observe(metrics::HIST_DB_WAIT, metrics::now_us() - start);
 	
 	conRAII = *SQL;
 	poolRAII = connPool;
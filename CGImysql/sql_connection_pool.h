@@ -3,7 +3,10 @@
 //单例模式实现数据库连接池
 
 #include <stdio.h>
+#include <time.h>
 #include <list>
+#include <map>
+#include <atomic>
 #include <mysql/mysql.h>
 #include <error.h>
 #include <string.h>
@@ -17,27 +20,66 @@ using namespace std;
 class connection_pool
 {
 public:
-	MYSQL *GetConnection();				 //获取数据库连接
+	static const int PING_IDLE_SEC = 30;  //空闲超过该时间的连接，取出时先ping确认仍然可用
+	static const int REAP_IDLE_SEC = 60;  //超出最小连接数的连接，空闲超过该时间后关闭
+	static const int REQUEST_WAIT_MS = 500; //处理请求时等待空闲连接的时间，超时返回503
+	static const int MAX_STICKY = 64;	  //至多为多少个线程保留专属连接
+
+	MYSQL *GetConnection(int timeout_ms = -1); //获取数据库连接，timeout_ms内没有可用连接时返回NULL，小于0时一直等待
 	bool ReleaseConnection(MYSQL *conn); //释放连接
 	int GetFreeConn();					 //获取连接
+	int GetMaxConn() { return m_MaxConn; } //连接数上限
 	void DestroyPool();					 //销毁所有连接
+	//取conn上预处理好的sql语句，第一次使用时在该连接上预处理并缓存，销毁连接时一并关闭
+	MYSQL_STMT *GetStatement(MYSQL *conn, const char *sql);
+	//定时调用：关闭空闲过久的多余连接
+	void Maintain();
+	//工作线程启动时调用：此后该线程放回的连接留在自己的槽位中，下次取连接不经过连接池的锁
+	void BindThread();
 
 	//单例模式
 	static connection_pool *GetInstance();
 
-	//创建MaxConn条数据库连接并初始化单例对象connection_pool相应的成员变量
+	//初始化单例对象connection_pool相应的成员变量，并行建立一半的连接，其余在需要时再建立，至多MaxConn条
 	void init(string url, string User, string PassWord, string DataBaseName, int Port, int MaxConn, int close_log); 
 
 private:
 	connection_pool();
 	~connection_pool();
 
+	MYSQL *Connect();					 //新建一条连接，失败返回NULL
+	void CloseConnection(MYSQL *conn);	 //关闭连接以及它上面缓存的预处理语句
+	static void *ConnectWorker(void *arg);
+	//检查取出的连接，空闲较久时先ping，断开的换一条新连接；失败返回NULL并归还名额
+	MYSQL *Revive(MYSQL *conn, time_t since);
+	//从线程槽位中取走一条闲置的连接，调用者持有lock
+	MYSQL *StealSticky(time_t *since);
+
+	//空闲连接及其放回连接池的时间
+	struct idle_conn
+	{
+		MYSQL *conn;
+		time_t since;
+	};
+
 	int m_MaxConn;  //最大连接数
-	int m_CurConn;  //当前已使用的连接数
+	int m_MinConn;  //常驻的连接数，空闲时也不关闭
+	int m_CurConn;  //当前已使用的连接数（含正在建立的）
 	int m_FreeConn; //当前空闲的连接数
 	locker lock;
-	list<MYSQL *> connList;//连接池
-	sem reserve;
+	cond m_cond; //有连接放回或可以新建连接时通知等待者
+	list<idle_conn> connList;//连接池，最近放回的在前
+
+	//线程专属连接：槽位中的连接仍计入m_CurConn，只有所属线程放入，其他线程等不到连接时可以取走
+	struct sticky_slot
+	{
+		atomic<MYSQL *> conn;
+		atomic<time_t> since;
+	};
+	sticky_slot m_Sticky[MAX_STICKY];
+	int m_StickyCount;		 //已绑定的线程数
+	atomic<int> m_Waiters; //正在等待连接的线程数，大于0时线程不再把连接留给自己
+	map<pair<MYSQL *, string>, MYSQL_STMT *> stmtCache;//每个连接上预处理过的语句
 
 public:
 	string m_url;			 //主机地址
@@ -54,7 +96,8 @@ class connectionRAII{
 
 public:
 	//在获取连接时，通过有参构造对传入的参数进行修改。其中数据库连接本身是指针类型，所以参数需要通过双指针才能对其进行修改。
-	connectionRAII(MYSQL **con, connection_pool *connPool);
+	//timeout_ms内没有取到连接时*con为NULL，调用者需要检查
+	connectionRAII(MYSQL **con, connection_pool *connPool, int timeout_ms = -1);
 	~connectionRAII();
 	
 private:
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "sqlite_user_store.h"
+#include "../http/user_cache.h"
+
+//WAL模式下synchronous=NORMAL只在检查点时fsync：进程崩溃不丢数据，掉电可能丢失最后几次注册。
+//mmap_size让读取直接访问映射的数据库文件，不经过SQLite的页缓存
+static const char *SETUP_SQL =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "PRAGMA mmap_size=268435456;"
+    "CREATE TABLE IF NOT EXISTS user("
+    "id INTEGER PRIMARY KEY, username TEXT NOT NULL UNIQUE, passwd TEXT NOT NULL);";
+
+sqlite_user_store::sqlite_user_store(const char *path, int close_log)
+    : m_db(NULL), m_insert(NULL), m_find(NULL), m_close_log(close_log)
+{
+    snprintf(m_path, sizeof(m_path), "%s", path);
+}
+
+sqlite_user_store::~sqlite_user_store()
+{
+    stop();
+}
+
+bool sqlite_user_store::start()
+{
+    //连接由m_lock串行化，不需要SQLite再加一层互斥
+    if (sqlite3_open_v2(m_path, &m_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+    {
+        LOG_ERROR("SQLite Error: open %s: %s", m_path, m_db ? sqlite3_errmsg(m_db) : "out of memory");
+        stop();
+        return false;
+    }
+    //另一个进程正在写同一个文件时最多等待1秒
+    sqlite3_busy_timeout(m_db, 1000);
+
+    char *err = NULL;
+    if (sqlite3_exec(m_db, SETUP_SQL, NULL, NULL, &err) != SQLITE_OK ||
+        sqlite3_prepare_v2(m_db, "INSERT INTO user(username, passwd) VALUES(?,?)", -1, &m_insert, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(m_db, "SELECT passwd FROM user WHERE username = ?", -1, &m_find, NULL) != SQLITE_OK)
+    {
+        LOG_ERROR("SQLite Error: %s", err ? err : sqlite3_errmsg(m_db));
+        sqlite3_free(err);
+        stop();
+        return false;
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    long rows = load();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rows < 0)
+    {
+        LOG_ERROR("SQLite Error: SELECT: %s", sqlite3_errmsg(m_db));
+        stop();
+        return false;
+    }
+    LOG_INFO("loaded %ld users from %s in %.3fs", rows, m_path,
+             (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9);
+    return true;
+}
+
+long sqlite_user_store::load()
+{
+    user_cache *cache = user_cache::get_instance();
+    sqlite3_stmt *stmt = NULL;
+
+    //先按行数扩好user_cache，载入时不再扩容
+    if (sqlite3_prepare_v2(m_db, "SELECT COUNT(*) FROM user", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        cache->presize(sqlite3_column_int64(stmt, 0));
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(m_db, "SELECT username, passwd FROM user", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    long n = 0;
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+        const char *password = (const char *)sqlite3_column_text(stmt, 1);
+        if (name && password)
+        {
+            cache->put(name, password);
+            ++n;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return ret == SQLITE_DONE ? n : -1;
+}
+
+void sqlite_user_store::stop()
+{
+    m_lock.lock();
+    sqlite3_finalize(m_insert);
+    sqlite3_finalize(m_find);
+    m_insert = NULL;
+    m_find = NULL;
+    //关闭最后一个连接时SQLite做检查点，把WAL合并回数据库文件
+    sqlite3_close(m_db);
+    m_db = NULL;
+    m_lock.unlock();
+}
+
+int sqlite_user_store::find(const char *name, const char *password, bool *match)
+{
+    if (match)
+        *match = false;
+
+    m_lock.lock();
+    if (!m_find)
+    {
+        m_lock.unlock();
+        return STORE_UNAVAILABLE;
+    }
+    int found = STORE_NOT_FOUND;
+    sqlite3_bind_text(m_find, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(m_find) == SQLITE_ROW)
+    {
+        const char *stored = (const char *)sqlite3_column_text(m_find, 0);
+        if (stored)
+        {
+            found = STORE_OK;
+            user_cache::get_instance()->put(name, stored);
+            if (match && password)
+                *match = strcmp(stored, password) == 0;
+        }
+    }
+    sqlite3_reset(m_find);
+    sqlite3_clear_bindings(m_find);
+    m_lock.unlock();
+    return found;
+}
+
+int sqlite_user_store::insert(const char *name, const char *password, callback, void *)
+{
+    //本地文件上的插入只需几十微秒，直接同步执行，从不返回STORE_PENDING，也不调用回调
+    m_lock.lock();
+    if (!m_insert)
+    {
+        m_lock.unlock();
+        return STORE_UNAVAILABLE;
+    }
+    sqlite3_bind_text(m_insert, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(m_insert, 2, password, -1, SQLITE_STATIC);
+    int ret = sqlite3_step(m_insert);
+    //重名由UNIQUE约束拒绝，不算错误
+    if (ret != SQLITE_DONE && ret != SQLITE_CONSTRAINT)
+    {
+        LOG_ERROR("SQLite Error: INSERT: %s", sqlite3_errmsg(m_db));
+    }
+    sqlite3_reset(m_insert);
+    sqlite3_clear_bindings(m_insert);
+    m_lock.unlock();
+    return ret == SQLITE_DONE ? STORE_OK : STORE_FAILED;
+}
@@ -0,0 +1,37 @@
+#ifndef SQLITE_USER_STORE_H
+#define SQLITE_USER_STORE_H
+//以嵌入式SQLite为后端的用户存储：用户表存放在本地文件中，不需要MySQL服务器，也没有网络往返。
+//数据库使用WAL模式，读取通过mmap访问文件；启动时同步读出整张表放入user_cache，之后查询都在缓存中完成，
+//注册时在同一条连接上执行预处理好的INSERT，语句执行由互斥锁串行化（SQLite本身同一时间也只允许一个写者）。
+
+#include <sqlite3.h>
+#include "user_store.h"
+#include "../lock/locker.h"
+#include "../log/log.h"
+
+class sqlite_user_store : public user_store
+{
+public:
+    sqlite_user_store(const char *path, int close_log);
+    ~sqlite_user_store();
+
+    bool start();
+    void stop();
+    bool loaded() { return true; }
+    int find(const char *name, const char *password, bool *match);
+    int insert(const char *name, const char *password, callback cb, void *arg);
+
+private:
+    //把整张表读入user_cache，返回行数，出错返回-1
+    long load();
+
+private:
+    char m_path[256];
+    sqlite3 *m_db;
+    sqlite3_stmt *m_insert;
+    sqlite3_stmt *m_find;
+    locker m_lock; //保护连接和预处理语句
+    int m_close_log;
+};
+
+#endif
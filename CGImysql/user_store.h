@@ -0,0 +1,41 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+//用户名、密码的存储接口：登录、注册只通过它访问持久化的用户表，不关心后端是MySQL服务器还是本地的SQLite文件。
+//用户查询的主路径仍是user_cache，存储只负责把已有用户载入缓存、缓存载入完成前的单独查询和注册时的插入。
+//mysql_user_store：连接池 + user_loader后台载入 + sql_async合并插入；
+//sqlite_user_store：嵌入式SQLite（WAL模式，读取走mmap），没有网络往返，单机部署或没有数据库服务器的机器上压测时使用。
+
+class user_store
+{
+public:
+    //查询、插入的结果
+    enum result
+    {
+        STORE_OK,          //用户存在或插入成功
+        STORE_NOT_FOUND,   //用户不存在
+        STORE_FAILED,      //插入失败（重名或数据库出错）
+        STORE_UNAVAILABLE, //存储暂时不可用（等不到数据库连接），返回503
+        STORE_PENDING      //已异步提交，完成后调用回调
+    };
+
+    //异步插入完成时调用，err为0表示插入成功
+    typedef void (*callback)(void *arg, int err);
+
+    virtual ~user_store() {}
+
+    //开始把已有用户载入user_cache，可以在后台进行；存储无法使用时返回false
+    virtual bool start() = 0;
+    //服务器退出时调用，之后不再访问数据库
+    virtual void stop() = 0;
+    //已有用户是否已全部载入user_cache，载入完成前缓存未命中的用户需要调用find
+    virtual bool loaded() = 0;
+
+    //按用户名查询一个用户，找到时放入user_cache，返回STORE_OK、STORE_NOT_FOUND或STORE_UNAVAILABLE；
+    //match非NULL时返回密码是否一致
+    virtual int find(const char *name, const char *password, bool *match) = 0;
+    //插入一个用户，同步完成时返回STORE_OK、STORE_FAILED或STORE_UNAVAILABLE，不调用cb（同步执行的后端总是如此）；
+    //返回STORE_PENDING时完成后在主线程中调用cb(arg, err)，不会在insert返回之前调用；name和password在回调之前必须保持有效
+    virtual int insert(const char *name, const char *password, callback cb, void *arg) = 0;
+};
+
+#endif
@@ -7,6 +7,53 @@ Config::Config(){
     //日志写入方式，默认同步
     LOGWrite = 0;
 
+    //异步日志缓冲区满时丢弃日志并计数，默认不阻塞
+    log_block = 0;
+
+    //日志每隔1000毫秒或积压64KB刷新一次；ERROR日志默认同样按此刷新，主线程写ERROR日志时不等待磁盘
+    log_flush_ms = 1000;
+    log_flush_kb = 64;
+    log_sync_error = 0;
+
+    //日志级别下限,默认为0,记录全部级别
+    log_level = 0;
+
+    //热点日志采样间隔,默认为1,不采样
+    log_sample = 1;
+
+    //日志格式,默认文本
+    log_format = 0;
+
+    //访问日志,默认关闭
+    access_log = 0;
+
+    //日志文件切分大小,默认为0,不按大小切分
+    log_rotate_mb = 0;
+
+    //压缩已切分的日志文件,默认不压缩
+    log_gzip = 0;
+
+    //每个日志保留的已切分文件个数,默认为0,全部保留
+    log_keep = 0;
+
+    //用户表快照,默认不使用
+    user_snapshot = 0;
+
+    //用户存储,默认MySQL
+    user_store = 0;
+
+    //登录会话有效期(秒),默认0,不启用会话
+    session_ttl = 0;
+
+    //运行指标的URL,默认为空,不启用
+    metrics_path = "";
+
+    //请求追踪,默认为0,不追踪
+    trace_sample = 0;
+
+    //看门狗阈值(毫秒),默认为0,不启用
+    watchdog_ms = 0;
+
     //触发组合模式,默认listenfd LT + connfd LT
     TRIGMode = 0;
 
@@ -30,12 +77,18 @@ Config::Config(){
 
     //并发模型,默认是proactor
     actor_model = 0;
+
+    //fd占用率达到90%时开始淘汰空闲连接，0表示不淘汰
+    evict_fd_pct = 90;
+
+    //内存高水位,默认为0,不检测
+    evict_mem_mb = 0;
 }
 
 // 将终端输入的参数赋值给Config的对象中
 void Config::parse_arg(int argc, char*argv[]){
     int opt;
-    const char *str = "p:l:m:o:s:t:c:a:"; 
+    const char *str = "p:l:B:F:Z:E:v:S:f:A:R:z:K:U:D:T:P:x:W:m:o:s:t:c:a:e:M:"; 
     while ((opt = getopt(argc, argv, str)) != -1)
     {
         switch (opt)
@@ -50,6 +103,91 @@ void Config::parse_arg(int argc, char*argv[]){
             LOGWrite = atoi(optarg);
             break;
         }
+        case 'B':
+        {
+            log_block = atoi(optarg);
+            break;
+        }
+        case 'F':
+        {
+            log_flush_ms = atoi(optarg);
+            break;
+        }
+        case 'Z':
+        {
+            log_flush_kb = atoi(optarg);
+            break;
+        }
+        case 'E':
+        {
+            log_sync_error = atoi(optarg);
+            break;
+        }
+        case 'v':
+        {
+            log_level = atoi(optarg);
+            break;
+        }
+        case 'S':
+        {
+            log_sample = atoi(optarg);
+            break;
+        }
+        case 'f':
+        {
+            log_format = atoi(optarg);
+            break;
+        }
+        case 'A':
+        {
+            access_log = atoi(optarg);
+            break;
+        }
+        case 'R':
+        {
+            log_rotate_mb = atoi(optarg);
+            break;
+        }
+        case 'z':
+        {
+            log_gzip = atoi(optarg);
+            break;
+        }
+        case 'K':
+        {
+            log_keep = atoi(optarg);
+            break;
+        }
+        case 'U':
+        {
+            user_snapshot = atoi(optarg);
+            break;
+        }
+        case 'D':
+        {
+            user_store = atoi(optarg);
+            break;
+        }
+        case 'T':
+        {
+            session_ttl = atoi(optarg);
+            break;
+        }
+        case 'P':
+        {
+            metrics_path = optarg;
+            break;
+        }
+        case 'x':
+        {
+            trace_sample = atoi(optarg);
+            break;
+        }
+        case 'W':
+        {
+            watchdog_ms = atoi(optarg);
+            break;
+        }
         case 'm':
         {
             TRIGMode = atoi(optarg);
@@ -80,6 +218,16 @@ void Config::parse_arg(int argc, char*argv[]){
             actor_model = atoi(optarg);
             break;
         }
+        case 'e':
+        {
+            evict_fd_pct = atoi(optarg);
+            break;
+        }
+        case 'M':
+        {
+            evict_mem_mb = atoi(optarg);
+            break;
+        }
         default:
             break;
         }
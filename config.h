@@ -19,6 +19,57 @@ public:
     //日志写入方式
     int LOGWrite;
 
+    //异步日志缓冲区满时的处理策略
+    int log_block;
+
+    //日志刷新间隔（毫秒）
+    int log_flush_ms;
+
+    //日志积压多少KB后刷新
+    int log_flush_kb;
+
+    //ERROR日志是否立即刷新
+    int log_sync_error;
+
+    //运行时日志级别下限
+    int log_level;
+
+    //热点日志采样间隔
+    int log_sample;
+
+    //日志格式，文本或二进制
+    int log_format;
+
+    //是否记录访问日志
+    int access_log;
+
+    //日志文件切分大小，MB
+    int log_rotate_mb;
+
+    //是否压缩已切分的日志文件
+    int log_gzip;
+
+    //每个日志保留的已切分文件个数
+    int log_keep;
+
+    //是否使用用户表快照
+    int user_snapshot;
+
+    //用户存储后端
+    int user_store;
+
+    //登录会话有效期
+    int session_ttl;
+
+    //运行指标的URL
+    string metrics_path;
+
+    //请求追踪采样间隔
+    int trace_sample;
+
+    //看门狗阈值
+    int watchdog_ms;
+
     //触发组合模式
     int TRIGMode;
 
@@ -42,6 +93,12 @@ public:
 
     //并发模型选择
     int actor_model;
+
+    //空闲连接淘汰：fd占用率高水位（百分比）
+    int evict_fd_pct;
+
+    //空闲连接淘汰：内存高水位（MB）
+    int evict_mem_mb;
 };
 
 #endif
\ No newline at end of file
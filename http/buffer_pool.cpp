@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include "buffer_pool.h"
+
+buffer_pool::buffer_pool() : m_in_use(0), m_cached(0)
+{
+    for (int i = 0; i < CLASS_COUNT; ++i)
+        m_free[i] = NULL;
+}
+
+buffer_pool::~buffer_pool()
+{
+    for (int i = 0; i < CLASS_COUNT; ++i)
+    {
+        free_node *node = m_free[i];
+        while (node)
+        {
+            free_node *next = node->next;
+            ::free(node);
+            node = next;
+        }
+        m_free[i] = NULL;
+    }
+}
+
+//返回 size 所属的等级，超过最大等级返回 -1
+int buffer_pool::class_index(size_t size)
+{
+    int shift = MIN_SHIFT;
+    while (shift <= MAX_SHIFT && ((size_t)1 << shift) < size)
+        ++shift;
+    return shift > MAX_SHIFT ? -1 : shift - MIN_SHIFT;
+}
+
+size_t buffer_pool::capacity(size_t size)
+{
+    int idx = class_index(size);
+    if (idx < 0)
+        return size;
+    return (size_t)1 << (idx + MIN_SHIFT);
+}
+
+char *buffer_pool::alloc(size_t size)
+{
+    int idx = class_index(size);
+    if (idx < 0)
+    {
+        m_in_use.fetch_add(size, std::memory_order_relaxed);
+        return (char *)malloc(size);
+    }
+
+    size_t cap = (size_t)1 << (idx + MIN_SHIFT);
+    free_node *node = NULL;
+
+    m_lock[idx].lock();
+    node = m_free[idx];
+    if (node)
+        m_free[idx] = node->next;
+    m_lock[idx].unlock();
+
+    if (node)
+        m_cached.fetch_sub(cap, std::memory_order_relaxed);
+    else
+        node = (free_node *)malloc(cap);
+
+    if (node)
+        m_in_use.fetch_add(cap, std::memory_order_relaxed);
+    return (char *)node;
+}
+
+void buffer_pool::free(char *buf, size_t size)
+{
+    if (!buf)
+        return;
+
+    int idx = class_index(size);
+    if (idx < 0)
+    {
+        m_in_use.fetch_sub(size, std::memory_order_relaxed);
+        ::free(buf);
+        return;
+    }
+
+    size_t cap = (size_t)1 << (idx + MIN_SHIFT);
+    free_node *node = (free_node *)buf;
+
+    m_lock[idx].lock();
+    node->next = m_free[idx];
+    m_free[idx] = node;
+    m_lock[idx].unlock();
+
+    m_in_use.fetch_sub(cap, std::memory_order_relaxed);
+    m_cached.fetch_add(cap, std::memory_order_relaxed);
+}
@@ -0,0 +1,56 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+//以单例模式实现的分级缓冲池：按2的幂划分若干尺寸等级，每个等级维护一条空闲链表，
+//释放的缓冲区挂回对应等级的链表，下次申请时直接复用，避免频繁 malloc/free。
+//超过最大等级的申请直接走 malloc/free，不进入缓冲池。
+
+#include <stddef.h>
+#include <atomic>
+#include "../lock/locker.h"
+
+class buffer_pool
+{
+public:
+    static const int MIN_SHIFT = 8;     //最小等级 256 字节
+    static const int MAX_SHIFT = 16;    //最大等级 64K 字节
+    static const int CLASS_COUNT = MAX_SHIFT - MIN_SHIFT + 1;
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static buffer_pool *get_instance()
+    {
+        static buffer_pool instance;
+        return &instance;
+    }
+
+    //返回 size 向上取整后的实际容量，申请与释放时都以该容量为准
+    static size_t capacity(size_t size);
+
+    //申请至少 size 字节的缓冲区，实际可用容量为 capacity(size)
+    char *alloc(size_t size);
+    //归还缓冲区，size 必须与申请时传入的值落在同一等级
+    void free(char *buf, size_t size);
+
+    //当前借出的字节数（按等级容量统计），用于内存水位判断
+    size_t bytes_in_use() const { return m_in_use.load(std::memory_order_relaxed); }
+    //缓冲池中缓存的空闲字节数
+    size_t bytes_cached() const { return m_cached.load(std::memory_order_relaxed); }
+
+private:
+    buffer_pool();
+    ~buffer_pool();
+
+    static int class_index(size_t size);
+
+    //空闲链表节点直接复用缓冲区本身的前8个字节
+    struct free_node
+    {
+        free_node *next;
+    };
+
+    free_node *m_free[CLASS_COUNT];
+    locker m_lock[CLASS_COUNT];
+    std::atomic<size_t> m_in_use;
+    std::atomic<size_t> m_cached;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+//按文件描述符下标访问的分段连接表：
+//目录只是一个指针数组，按 RLIMIT_NOFILE 一次性分配；每段包含 SEGMENT_SIZE 个槽位，第一次访问到该段时才分配。
+//段一旦分配就不再移动或释放，所以槽位地址在整个运行期间保持不变，可以放心地把指针交给工作线程和定时器。
+//目录与段的分配只在主线程中进行（accept 与事件分发都在主线程），因此不需要加锁。
+
+#include <stdlib.h>
+#include <exception>
+
+template <typename T>
+class conn_table
+{
+public:
+    static const int SEGMENT_SHIFT = 12;
+    static const int SEGMENT_SIZE = 1 << SEGMENT_SHIFT; //每段4096个槽位
+
+public:
+    conn_table() : m_segments(NULL), m_segment_count(0), m_capacity(0), m_allocated(0) {}
+    ~conn_table()
+    {
+        for (int i = 0; i < m_segment_count; ++i)
+            delete[] m_segments[i];
+        delete[] m_segments;
+    }
+
+    //按最大描述符数分配段目录
+    void init(int capacity)
+    {
+        if (capacity <= 0)
+            throw std::exception();
+        m_capacity = capacity;
+        m_segment_count = (capacity + SEGMENT_SIZE - 1) >> SEGMENT_SHIFT;
+        m_segments = new T *[m_segment_count];
+        for (int i = 0; i < m_segment_count; ++i)
+            m_segments[i] = NULL;
+    }
+
+    //返回 fd 对应的槽位，所在段尚未分配时先分配
+    T &operator[](int fd)
+    {
+        int seg = fd >> SEGMENT_SHIFT;
+        if (!m_segments[seg])
+        {
+            m_segments[seg] = new T[SEGMENT_SIZE];
+            ++m_allocated;
+        }
+        return m_segments[seg][fd & (SEGMENT_SIZE - 1)];
+    }
+
+    T *operator+(int fd) { return &(*this)[fd]; }
+
+    //不分配内存的查找，段不存在时返回NULL
+    T *find(int fd) const
+    {
+        if (fd < 0 || fd >= m_capacity)
+            return NULL;
+        T *seg = m_segments[fd >> SEGMENT_SHIFT];
+        return seg ? &seg[fd & (SEGMENT_SIZE - 1)] : NULL;
+    }
+
+    int capacity() const { return m_capacity; }
+    //已分配的段数，用于统计连接表占用的内存
+    int allocated_segments() const { return m_allocated; }
+
+private:
+    T **m_segments;
+    int m_segment_count;
+    int m_capacity;
+    int m_allocated;
+};
+
+#endif
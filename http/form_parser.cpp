@@ -0,0 +1,423 @@
+#include <string.h>
+#include <strings.h>
+#include "form_parser.h"
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+multipart_parser::multipart_parser()
+    : m_state(FAILED), m_delimiter_len(0), m_matched(0), m_dashes(0), m_crlf(0), m_head_len(0), m_on_begin(NULL),
+      m_on_data(NULL), m_on_end(NULL), m_arg(NULL)
+{
+}
+
+bool multipart_parser::init(const char *boundary, size_t len, begin_callback on_begin, data_callback on_data,
+                            end_callback on_end, void *arg)
+{
+    if (0 == len || len > (size_t)MAX_BOUNDARY)
+        return false;
+    memcpy(m_delimiter, "\r\n--", 4);
+    memcpy(m_delimiter + 4, boundary, len);
+    m_delimiter_len = len + 4;
+    //第一个分隔符可以出现在请求体开头，前面没有CRLF：当作已经匹配了CRLF
+    m_matched = 2;
+    m_state = PREAMBLE;
+    m_on_begin = on_begin;
+    m_on_data = on_data;
+    m_on_end = on_end;
+    m_arg = arg;
+    return true;
+}
+
+const char *multipart_parser::find_boundary(const char *content_type, size_t *len)
+{
+    const char *p = strcasestr(content_type, "boundary=");
+    if (!p)
+        return NULL;
+    p += 9;
+    if (*p == '"')
+    {
+        const char *q = strchr(++p, '"');
+        if (!q)
+            return NULL;
+        *len = q - p;
+    }
+    else
+    {
+        *len = strcspn(p, "; \t\r\n");
+    }
+    return *len ? p : NULL;
+}
+
+size_t multipart_parser::match_delimiter(const char *data, size_t i, size_t end, bool emit)
+{
+    size_t run = i;             //本块中尚未交出的数据的起点
+    size_t carried = m_matched; //上一块末尾已匹配上的分隔符字节，不在本块中
+    while (i < end)
+    {
+        if (0 == m_matched)
+        {
+            //分隔符以'\r'开头，其余字节不含'\r'：直接跳到下一个'\r'，中间的都是数据
+            const char *cr = (const char *)memchr(data + i, '\r', end - i);
+            if (!cr)
+            {
+                i = end;
+                break;
+            }
+            i = cr - data;
+        }
+
+        if (data[i] == m_delimiter[m_matched])
+        {
+            ++i;
+            if (++m_matched == m_delimiter_len)
+            {
+                //分隔符之前的数据属于当前部分
+                size_t start = i - (m_matched - carried);
+                m_matched = 0;
+                m_dashes = 0;
+                m_crlf = 0;
+                m_state = DELIMITER_END;
+                if (emit && ((start > run && !m_on_data(m_arg, data + run, start - run)) || !m_on_end(m_arg)))
+                    m_state = FAILED;
+                return i;
+            }
+        }
+        else
+        {
+            //匹配中断，已匹配的字节是普通数据：上一块中的那部分从分隔符中取出交给调用者，本块中的留在run里。
+            //当前字节可能是新一轮匹配的开始，不前进
+            if (carried && emit && !m_on_data(m_arg, m_delimiter, carried))
+            {
+                m_state = FAILED;
+                return end;
+            }
+            carried = 0;
+            m_matched = 0;
+        }
+    }
+
+    //块结束：末尾匹配到一半的分隔符留到下一块再决定
+    size_t stop = end - (m_matched - carried);
+    if (emit && stop > run && !m_on_data(m_arg, data + run, stop - run))
+        m_state = FAILED;
+    return end;
+}
+
+bool multipart_parser::feed(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && m_state != DONE && m_state != FAILED)
+    {
+        switch (m_state)
+        {
+        case PREAMBLE:
+        case DATA:
+        {
+            i = match_delimiter(data, i, len, m_state == DATA);
+            break;
+        }
+        case DELIMITER_END:
+        {
+            //"--"表示最后一个分隔符；否则允许行尾空白，随后必须是CRLF
+            char c = data[i++];
+            if (c == '-' && 0 == m_crlf)
+            {
+                if (++m_dashes == 2)
+                    m_state = DONE;
+            }
+            else if (m_dashes || m_crlf || !(c == ' ' || c == '\t' || c == '\r'))
+            {
+                if (c == '\n' && 1 == m_crlf)
+                {
+                    //分隔符行的CRLF也算作头部结束标志"\r\n\r\n"的前一半，没有头部的部分也能识别
+                    m_state = HEADERS;
+                    m_crlf = 2;
+                    m_head_len = 0;
+                }
+                else
+                    m_state = FAILED;
+            }
+            else if (c == '\r')
+            {
+                m_crlf = 1;
+            }
+            break;
+        }
+        case HEADERS:
+        {
+            size_t start = i;
+            while (i < len && m_crlf < 4)
+            {
+                char c = data[i++];
+                if (c == "\r\n\r\n"[m_crlf])
+                    ++m_crlf;
+                else
+                    m_crlf = c == '\r' ? 1 : 0;
+            }
+            //头部完整地在本块中时直接在块上解析，否则拷贝下来
+            if (4 == m_crlf && 0 == m_head_len)
+            {
+                if (!parse_headers(data + start, i - start - 2))
+                    m_state = FAILED;
+                break;
+            }
+            if (m_head_len + (i - start) > (size_t)MAX_HEADERS)
+            {
+                m_state = FAILED;
+                break;
+            }
+            memcpy(m_head + m_head_len, data + start, i - start);
+            m_head_len += i - start;
+            if (4 == m_crlf && !parse_headers(m_head, m_head_len - 2))
+                m_state = FAILED;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return m_state != FAILED;
+}
+
+//从Content-Disposition中取出name和filename参数，然后开始一个部分
+bool multipart_parser::parse_headers(const char *text, size_t len)
+{
+    const char *name = NULL, *filename = NULL;
+    size_t name_len = 0, filename_len = 0;
+    const char *end = text + len;
+    for (const char *line = text; line < end;)
+    {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+        if (eol - line > 20 && strncasecmp(line, "Content-Disposition:", 20) == 0)
+        {
+            //form-data; name="user"; filename="a.txt"
+            const char *p = line + 20;
+            while (p < eol)
+            {
+                p += strspn(p, "; \t");
+                if (p >= eol)
+                    break;
+                const char **value = NULL;
+                size_t *value_len = NULL;
+                if (eol - p > 5 && strncasecmp(p, "name=", 5) == 0)
+                {
+                    value = &name;
+                    value_len = &name_len;
+                    p += 5;
+                }
+                else if (eol - p > 9 && strncasecmp(p, "filename=", 9) == 0)
+                {
+                    value = &filename;
+                    value_len = &filename_len;
+                    p += 9;
+                }
+
+                const char *v = p, *v_end;
+                if (*p == '"')
+                {
+                    v = p + 1;
+                    v_end = (const char *)memchr(v, '"', eol - v);
+                    if (!v_end)
+                        return false;
+                    p = v_end + 1;
+                }
+                else
+                {
+                    v_end = v;
+                    while (v_end < eol && *v_end != ';' && *v_end != '\r')
+                        ++v_end;
+                    p = v_end;
+                }
+                if (value)
+                {
+                    *value = v;
+                    *value_len = v_end - v;
+                }
+                //跳到下一个参数
+                while (p < eol && *p != ';')
+                    ++p;
+            }
+        }
+        line = eol + 1;
+    }
+
+    m_state = DATA;
+    m_matched = 0;
+    return m_on_begin(m_arg, name, name_len, filename, filename_len);
+}
+
+size_t form_parser::url_decode(char *s, size_t len)
+{
+    char *src = s, *dst = s, *end = s + len;
+    const char *pct = (const char *)memchr(s, '%', len);
+    const char *plus = (const char *)memchr(s, '+', len);
+    while (src < end)
+    {
+        //两种特殊字符各自记住下一次出现的位置，越过之后才重新查找
+        if (pct && pct < src)
+            pct = (const char *)memchr(src, '%', end - src);
+        if (plus && plus < src)
+            plus = (const char *)memchr(src, '+', end - src);
+        const char *next = !pct ? plus : (!plus ? pct : (pct < plus ? pct : plus));
+        if (!next)
+            next = end;
+
+        //普通字符整段移动，还没有遇到需要解码的字符时源和目的相同，不必移动
+        size_t run = next - src;
+        if (dst != src)
+            memmove(dst, src, run);
+        dst += run;
+        src += run;
+        if (src == end)
+            break;
+
+        int hi, lo;
+        if (*src == '+')
+        {
+            *dst++ = ' ';
+            ++src;
+        }
+        else if (end - src >= 3 && (hi = hex_value(src[1])) >= 0 && (lo = hex_value(src[2])) >= 0)
+        {
+            *dst++ = (char)(hi << 4 | lo);
+            src += 3;
+        }
+        else
+        {
+            *dst++ = *src++;
+        }
+    }
+    return dst - s;
+}
+
+bool form_parser::parse(char *body, size_t len, const char *content_type)
+{
+    if (content_type && strncasecmp(content_type, "multipart/form-data", 19) == 0)
+    {
+        size_t boundary_len;
+        const char *boundary = multipart_parser::find_boundary(content_type, &boundary_len);
+        return boundary && parse_multipart(body, len, boundary, boundary_len);
+    }
+    return parse_urlencoded(body, len);
+}
+
+bool form_parser::parse_urlencoded(char *body, size_t len)
+{
+    char *p = body, *end = body + len;
+    while (p < end)
+    {
+        char *amp = (char *)memchr(p, '&', end - p);
+        if (!amp)
+            amp = end;
+        //跳过空的字段（如"a=1&&b=2"）
+        if (amp > p)
+        {
+            if (m_count == MAX_FIELDS)
+                return false;
+            char *eq = (char *)memchr(p, '=', amp - p);
+            form_field &f = m_fields[m_count++];
+            f.name = p;
+            f.name_len = url_decode(p, (eq ? eq : amp) - p);
+            if (eq)
+            {
+                f.value = eq + 1;
+                f.value_len = url_decode(eq + 1, amp - eq - 1);
+            }
+            else
+            {
+                f.value = p + f.name_len;
+                f.value_len = 0;
+            }
+            f.filename = NULL;
+            f.filename_len = 0;
+        }
+        p = amp + 1;
+    }
+    terminate();
+    return true;
+}
+
+bool form_parser::parse_multipart(char *body, size_t len, const char *boundary, size_t boundary_len)
+{
+    multipart_parser parser;
+    if (!parser.init(boundary, boundary_len, on_begin, on_data, on_end, this))
+        return false;
+    //整个请求体一次输入，各部分的头部和数据都在body中，字段直接指向它们
+    if (!parser.feed(body, len) || !parser.done())
+        return false;
+    terminate();
+    return true;
+}
+
+bool form_parser::on_begin(void *arg, const char *name, size_t name_len, const char *filename, size_t filename_len)
+{
+    form_parser *form = (form_parser *)arg;
+    if (form->m_count == MAX_FIELDS)
+        return false;
+    form_field &f = form->m_fields[form->m_count++];
+    f.name = name;
+    f.name_len = name_len;
+    f.value = NULL;
+    f.value_len = 0;
+    f.filename = filename;
+    f.filename_len = filename_len;
+    return true;
+}
+
+bool form_parser::on_data(void *arg, const char *data, size_t len)
+{
+    form_field &f = ((form_parser *)arg)->m_fields[((form_parser *)arg)->m_count - 1];
+    if (!f.value)
+        f.value = data;
+    //一次输入整个请求体时，一个部分的数据是连续的
+    else if (f.value + f.value_len != data)
+        return false;
+    f.value_len += len;
+    return true;
+}
+
+bool form_parser::on_end(void *arg)
+{
+    form_field &f = ((form_parser *)arg)->m_fields[((form_parser *)arg)->m_count - 1];
+    if (!f.value)
+        f.value = "";
+    return true;
+}
+
+void form_parser::terminate()
+{
+    //解码后的名字和值只会变短，结尾之后的字节（'='、'&'、引号或分隔符的'\r'）已不再需要；
+    //已经是'\0'的不写，空值指向的常量字符串不会被改动
+    for (int i = 0; i < m_count; ++i)
+    {
+        form_field &f = m_fields[i];
+        if (f.name && f.name[f.name_len])
+            ((char *)f.name)[f.name_len] = '\0';
+        if (f.value[f.value_len])
+            ((char *)f.value)[f.value_len] = '\0';
+        if (f.filename && f.filename[f.filename_len])
+            ((char *)f.filename)[f.filename_len] = '\0';
+    }
+}
+
+const form_field *form_parser::get(const char *name) const
+{
+    size_t len = strlen(name);
+    for (int i = 0; i < m_count; ++i)
+    {
+        if (m_fields[i].name && m_fields[i].name_len == len && memcmp(m_fields[i].name, name, len) == 0)
+            return &m_fields[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,109 @@
+#ifndef FORM_PARSER_H
+#define FORM_PARSER_H
+//请求体表单解析，不分配内存、不拷贝数据：字段的名字和值都直接指向请求体。
+//application/x-www-form-urlencoded：在原缓冲区中解码%XX和+，解码后只会变短，所以可以原地进行；
+//用memchr（glibc中按向量指令实现）跳到下一个需要解码的字符，中间的普通字符整段移动。
+//multipart/form-data：multipart_parser按块输入、流式解析，只保存分隔符的匹配进度和跨块的部分头，
+//每个部分的数据以回调交给调用者，可以边收边写入文件而不在内存中缓存整个请求体。
+
+#include <stddef.h>
+
+//请求体中的一个字段
+struct form_field
+{
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+    const char *filename; //multipart中文件部分的文件名，其他字段为NULL
+    size_t filename_len;
+};
+
+//multipart/form-data的流式解析器
+class multipart_parser
+{
+public:
+    static const int MAX_BOUNDARY = 70;  //RFC 2046规定的分隔符长度上限
+    static const int MAX_HEADERS = 1024; //一个部分的头部总长度上限
+
+    //一个部分开始：名字、文件名在回调期间有效；返回false时停止解析
+    typedef bool (*begin_callback)(void *arg, const char *name, size_t name_len, const char *filename,
+                                   size_t filename_len);
+    //部分的数据，一个部分可能分多次给出；data指向输入的块（或分隔符前缀），只在回调期间有效
+    typedef bool (*data_callback)(void *arg, const char *data, size_t len);
+    typedef bool (*end_callback)(void *arg);
+
+    multipart_parser();
+    //boundary为Content-Type中的分隔符，超过MAX_BOUNDARY时返回false
+    bool init(const char *boundary, size_t len, begin_callback on_begin, data_callback on_data, end_callback on_end,
+              void *arg);
+    //输入一块数据，格式错误或回调要求停止时返回false
+    bool feed(const char *data, size_t len);
+    //是否已读到结束分隔符
+    bool done() const { return m_state == DONE; }
+
+    //从Content-Type中取出boundary参数，没有时返回NULL
+    static const char *find_boundary(const char *content_type, size_t *len);
+
+private:
+    enum state
+    {
+        PREAMBLE, //第一个分隔符之前的内容，丢弃
+        DELIMITER_END, //分隔符之后：--表示结束，CRLF之后是部分头
+        HEADERS,
+        DATA,
+        DONE,
+        FAILED
+    };
+
+    //在data[i, end)中匹配分隔符，返回处理到的位置；匹配完整时m_state置为DELIMITER_END
+    size_t match_delimiter(const char *data, size_t i, size_t end, bool emit);
+    bool parse_headers(const char *text, size_t len);
+
+private:
+    state m_state;
+    char m_delimiter[MAX_BOUNDARY + 4]; //"\r\n--" + boundary
+    size_t m_delimiter_len;
+    size_t m_matched;  //已匹配的分隔符字节数
+    int m_dashes;      //分隔符之后读到的'-'个数
+    int m_crlf;        //部分头中连续匹配的"\r\n\r\n"字节数
+    char m_head[MAX_HEADERS]; //跨块的部分头拷贝到这里
+    size_t m_head_len;
+    begin_callback m_on_begin;
+    data_callback m_on_data;
+    end_callback m_on_end;
+    void *m_arg;
+};
+
+//整个请求体已在缓冲区中时使用：解析出各字段，解析后名字和值都以'\0'结尾，可以直接当作C字符串
+class form_parser
+{
+public:
+    static const int MAX_FIELDS = 16;
+
+    form_parser() : m_count(0) {}
+    //content_type为NULL或不是multipart时按urlencoded解析；body[len]必须可写。格式错误返回false
+    bool parse(char *body, size_t len, const char *content_type);
+    bool parse_urlencoded(char *body, size_t len);
+    bool parse_multipart(char *body, size_t len, const char *boundary, size_t boundary_len);
+
+    //按名字取字段，没有时返回NULL
+    const form_field *get(const char *name) const;
+    int count() const { return m_count; }
+
+    //原地解码%XX和+，返回解码后的长度；%后不是两位十六进制数时原样保留
+    static size_t url_decode(char *s, size_t len);
+
+private:
+    static bool on_begin(void *arg, const char *name, size_t name_len, const char *filename, size_t filename_len);
+    static bool on_data(void *arg, const char *data, size_t len);
+    static bool on_end(void *arg);
+    //给各字段的名字和值写入结尾的'\0'
+    void terminate();
+
+private:
+    form_field m_fields[MAX_FIELDS];
+    int m_count;
+};
+
+#endif
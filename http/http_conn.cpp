@@ -1,6 +1,10 @@
 #include "http_conn.h"
+#include "buffer_pool.h"
+#include "../log/access_log.h"
+#include "user_cache.h"
+#include "session_store.h"
+#include "form_parser.h"
 
-#include <mysql/mysql.h>
 #include <fstream>
 
 //定义http响应的一些状态信息
@@ -13,38 +17,28 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the request file.\n";
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form = "The server is too busy to serve the request, please try again later.\n";
 
-locker m_lock;
-map<string, string> users;//存储每对用户名和密码，key是用户名，value 是密码
+//与METHOD枚举顺序一致，用于访问日志
+static const char *method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATH"};
 
-//将数据库中的用户名和密码载入到服务器的map中来
-void http_conn::initmysql_result(connection_pool *connPool)
+static uint64_t monotonic_us()
 {
-    //先从连接池中取一个连接
-    MYSQL *mysql = NULL;
-    connectionRAII mysqlcon(&mysql, connPool);
-
-    //在user表中检索username，passwd数据，浏览器端输入
-    if (mysql_query(mysql, "SELECT username,passwd FROM user"))
-    {
-        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
-    }
-
-    //从表中检索完整的结果集
-    MYSQL_RES *result = mysql_store_result(mysql);
-
-    //返回结果集中的列数
-    int num_fields = mysql_num_fields(result);
-
-    //返回所有字段结构的数组
-    MYSQL_FIELD *fields = mysql_fetch_fields(result);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    //从结果集中获取下一行，将对应的用户名和密码，存入map中
-    while (MYSQL_ROW row = mysql_fetch_row(result))
+//将数据库中的用户名和密码载入到服务器的用户缓存中来
+//由用户存储负责载入（MySQL在后台流式读取），这里只是启动，服务器不必等待载入完成就可以开始监听
+void http_conn::initmysql_result(user_store *store)
+{
+    m_store = store;
+    if (!m_store->start())
     {
-        string temp1(row[0]);
-        string temp2(row[1]);
-        users[temp1] = temp2;
+        LOG_ERROR("%s", "user store init failure");
+        exit(1);
     }
 }
 
@@ -63,10 +57,11 @@ int setnonblocking(int fd)
 }
 
 //将内核事件表注册读事件，ET模式，选择开启EPOLLONESHOT
-void addfd(int epollfd, int fd, bool one_shot, int TRIGMode)
+//gen为连接的代数，和fd一起作为事件的标识
+void addfd(int epollfd, int fd, bool one_shot, int TRIGMode, unsigned int gen)
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = http_conn::make_token(fd, gen);
 
     if (1 == TRIGMode)
         event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
@@ -87,10 +82,10 @@ void removefd(int epollfd, int fd)
 }
 
 //将事件重置为EPOLLONESHOT
-void modfd(int epollfd, int fd, int ev, int TRIGMode)
+void modfd(int epollfd, int fd, int ev, int TRIGMode, unsigned int gen)
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = http_conn::make_token(fd, gen);
 
     if (1 == TRIGMode)
         event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
@@ -102,6 +97,13 @@ void modfd(int epollfd, int fd, int ev, int TRIGMode)
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+user_store *http_conn::m_store = NULL;
+char *http_conn::doc_root = NULL;
+int http_conn::m_TRIGMode = 0;
+int http_conn::m_close_log = 0;
+
+//连接槽只保留常驻的小字段，读缓冲区、响应分片在请求处理期间才从缓冲池借用，空闲的长连接不占用这些内存
+static_assert(sizeof(http_conn) <= 256, "idle http_conn slot should stay within 256 bytes");
 
 //关闭连接，关闭一个连接，客户总量减一
 void http_conn::close_conn(bool real_close)
@@ -112,57 +114,113 @@ void http_conn::close_conn(bool real_close)
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count--;
+        release();
     }
 }
 
+//归还请求处理期间借用的读缓冲区、响应分片，并取消文件映射
+void http_conn::release()
+{
+    release_read_buf();
+    m_response.init();
+    unmap();
+}
+
 //初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in &addr, char *root, int TRIGMode,
-                     int close_log, string user, string passwd, string sqlname)
+void http_conn::init(int sockfd, const sockaddr_in &addr, char *root, int TRIGMode, int close_log)
 {
     m_sockfd = sockfd;
     m_address = addr;
 
-    addfd(m_epollfd, sockfd, true, m_TRIGMode);
-    m_user_count++;
-
     //当浏览器出现连接重置时，可能是网站根目录出错或http响应格式出错或者访问的文件中内容完全为空
+    //以下三项对所有连接都相同，存放在静态成员中，不占用每个连接槽的空间
     doc_root = root;
     m_TRIGMode = TRIGMode;
     m_close_log = close_log;
 
-    strcpy(sql_user, user.c_str());
-    strcpy(sql_passwd, passwd.c_str());
-    strcpy(sql_name, sqlname.c_str());
+    //新连接复用了该槽位，代数加一，旧连接残留的事件将被主线程丢弃
+    ++m_gen;
+    //新连接从空闲开始；同时推进事件计数，上一个连接的工作线程迟到的空闲标记不会生效
+    unsigned int v = m_activity.load(std::memory_order_relaxed);
+    while (!m_activity.compare_exchange_weak(v, (v | 1) + 2, std::memory_order_relaxed))
+        ;
+    if (!(v & 1))
+        metrics::get_instance()->inc(metrics::CONN_IDLE);
+    addfd(m_epollfd, sockfd, true, m_TRIGMode, m_gen);
+    m_user_count++;
 
+    //上一个连接关闭时已归还借用的内存，定时器不会关闭工作线程仍持有的连接
+    m_requests = 0;
     init();
+    if (m_traced)
+    {
+        uint64_t now = request_tracer::now_ns();
+        request_tracer::get_instance()->record(request_tracer::STAGE_ACCEPT, trace_key(), now, now);
+    }
 }
 
 //初始化新接受的连接
 //check_state默认为分析请求行状态
 void http_conn::init()
 {
-    mysql = NULL;
-    bytes_to_send = 0;
-    bytes_have_send = 0;
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
+    m_new_session = false;
+    m_route = metrics::ROUTE_OTHER;
+    //每个请求开始前决定是否追踪，同一请求的各阶段可能在不同线程中执行，都以该标志为准
+    m_traced = request_tracer::get_instance()->sample();
+    m_session = 0;
     m_method = GET;
     m_url = 0;
+    m_target = 0;
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
+    m_content_type = 0;
+    m_referer = 0;
+    m_user_agent = 0;
+    m_status = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
-    m_write_idx = 0;
     cgi = 0;
     m_state = 0;
     timer_flag = 0;
     improv = 0;
+    m_close_pending = 0;
 
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-    memset(m_real_file, '\0', FILENAME_LEN);
+    //一次请求处理完毕，把借用的缓冲区还给缓冲池
+    release_read_buf();
+    m_response.init();
+}
+
+//连接回到空闲状态。空闲标记必须在注册读事件之后：先标记的话，主线程可能在注册之前就淘汰连接、关闭甚至复用该fd，
+//工作线程随后注册的就是已关闭或属于新连接的fd。注册之后主线程随时可能收到新请求并调用set_busy，
+//这时事件计数已被推进，下面的比较交换失败，连接保持忙碌；注册之后也不再访问除m_activity以外的成员
+void http_conn::wait_next_request()
+{
+    unsigned int busy = m_activity.load(std::memory_order_relaxed);
+    init();
+    modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode, m_gen);
+    if (m_activity.compare_exchange_strong(busy, busy | 1, std::memory_order_release))
+        metrics::get_instance()->inc(metrics::CONN_IDLE);
+}
+
+//从缓冲池借用读缓冲区，只在连接上有数据到达时才分配
+bool http_conn::acquire_read_buf()
+{
+    if (!m_read_buf)
+        m_read_buf = buffer_pool::get_instance()->alloc(READ_BUFFER_SIZE);
+    return m_read_buf != NULL;
+}
+
+void http_conn::release_read_buf()
+{
+    if (m_read_buf)
+    {
+        buffer_pool::get_instance()->free(m_read_buf, READ_BUFFER_SIZE);
+        m_read_buf = NULL;
+    }
 }
 
 //从状态机，用于分析buffer中的数据，将每行数据末尾的\r\n置为\0\0，并更新从状态机在buffer中读取的位置m_checked_idx，以此来驱动主状态机解析。
@@ -215,16 +273,28 @@ http_conn::LINE_STATUS http_conn::parse_line()
 //非阻塞ET工作模式下，需要一次性将数据读完
 bool http_conn::read_once()
 {
-    if (m_read_idx >= READ_BUFFER_SIZE)
+    //最后一个字节留给parse_content写入'\0'
+    if (m_read_idx >= READ_BUFFER_SIZE - 1)
+    {
+        return false;
+    }
+    if (!acquire_read_buf())
     {
         return false;
     }
+    //新请求的第一次读取，记下开始时间供访问日志、指标和追踪计算耗时
+    if (0 == m_read_idx && (access_log::get_instance()->enabled() || metrics::get_instance()->enabled() || m_traced))
+    {
+        m_req_start = monotonic_us();
+    }
+    //在记下请求开始时间之后才开始，读取阶段落在整个请求之内
+    trace_scope scope(m_traced, trace_key(), request_tracer::STAGE_READ);
     int bytes_read = 0;
 
     //LT读取数据
     if (0 == m_TRIGMode)
     {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - 1 - m_read_idx, 0);
         m_read_idx += bytes_read;
 
         if (bytes_read <= 0)
@@ -239,7 +309,7 @@ bool http_conn::read_once()
     {
         while (true)
         {
-            bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+            bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - 1 - m_read_idx, 0);
             if (bytes_read == -1)
             {
                 if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -293,15 +363,18 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     m_url += strspn(m_url, " \t");//返回 str1 中第一个不在字符串 str2 中出现的字符下标。
     
     //使用与判断请求方式的相同逻辑，判断HTTP版本号
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version)
+    char *version = strpbrk(m_url, " \t");
+    if (!version)
         return BAD_REQUEST;
-    *m_version++ = '\0';
-    m_version += strspn(m_version, " \t");
+    *version++ = '\0';
+    version += strspn(version, " \t");
+    m_version = version;
 
     //仅支持HTTP/1.1
     if (strcasecmp(m_version, "HTTP/1.1") != 0)
         return BAD_REQUEST;
+    //访问日志记录的版本号使用常量，不依赖读缓冲区中的原文
+    m_version = "HTTP/1.1";
 
     //对请求资源前7个字符进行判断
     //这里主要是有些报文的请求资源中会带有http://，这里需要对这种情况进行单独处理
@@ -320,9 +393,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     //一般情况下，不会带有上述两种符号，直接是单独的/或/后面带访问资源
     if (!m_url || m_url[0] != '/')
         return BAD_REQUEST;
+    //m_url保持客户端请求的路径，供访问日志记录；实际发送的页面记在m_target中
+    m_target = m_url;
     //当url为/时，显示欢迎界面
     if (strlen(m_url) == 1)
-        strcat(m_url, "judge.html");//将请求报文的url放在了http_conn对象的m_url
+        m_target = "/judge.html";
 
     //请求行处理完毕，将主状态机转移处理请求头
     m_check_state = CHECK_STATE_HEADER;
@@ -372,6 +447,14 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         text += 15;
         text += strspn(text, " \t");
         m_content_length = atol(text);
+        if (m_content_length < 0)
+            return BAD_REQUEST;
+    }
+    else if (strncasecmp(text, "Content-Type:", 13) == 0)
+    {
+        text += 13;
+        text += strspn(text, " \t");
+        m_content_type = text;
     }
     //解析请求头部HOST字段
     else if (strncasecmp(text, "Host:", 5) == 0)
@@ -380,6 +463,37 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         text += strspn(text, " \t");
         m_host = text;
     }
+    //启用会话时校验Cookie中的令牌，有效的会话号留给do_request使用
+    else if (strncasecmp(text, "Cookie:", 7) == 0)
+    {
+        session_store *sessions = session_store::get_instance();
+        if (sessions->enabled())
+        {
+            //Cookie: a=1; sid=令牌; b=2
+            for (char *c = text + 7; *c; c += strcspn(c, ";"))
+            {
+                c += strspn(c, "; \t");
+                if (strncmp(c, "sid=", 4) == 0)
+                {
+                    m_session = sessions->check(c + 4, strcspn(c + 4, "; \t"));
+                    break;
+                }
+            }
+        }
+    }
+    //以下两个字段只在访问日志中使用
+    else if (strncasecmp(text, "Referer:", 8) == 0)
+    {
+        text += 8;
+        text += strspn(text, " \t");
+        m_referer = text;
+    }
+    else if (strncasecmp(text, "User-Agent:", 11) == 0)
+    {
+        text += 11;
+        text += strspn(text, " \t");
+        m_user_agent = text;
+    }
     else
     {
         LOG_INFO("oop!unknow header: %s", text);
@@ -429,7 +543,7 @@ http_conn::HTTP_CODE http_conn::process_read()
         text = get_line();
         //m_checked_idx表示从状态机当前正在m_read_buf中解析的位置
         m_start_line = m_checked_idx;
-        LOG_INFO("%s", text);
+        LOG_INFO_SAMPLED("%s", text);
 
         //主状态机的三种状态转移逻辑
         switch (m_check_state)
@@ -452,6 +566,7 @@ http_conn::HTTP_CODE http_conn::process_read()
             //完整解析GET请求后，跳转到报文响应函数
             else if (ret == GET_REQUEST)
             {
+                trace_scope scope(m_traced, trace_key(), request_tracer::STAGE_HANDLE);
                 return do_request();
             }
             break;
@@ -463,7 +578,10 @@ http_conn::HTTP_CODE http_conn::process_read()
 
             //完整解析POST请求后，跳转到报文响应函数
             if (ret == GET_REQUEST)
+            {
+                trace_scope scope(m_traced, trace_key(), request_tracer::STAGE_HANDLE);
                 return do_request();
+            }
             
             //解析完消息体即完成报文解析，避免再次进入循环，更新line_status为LINE_OPEN
             line_status = LINE_OPEN;
@@ -500,93 +618,181 @@ m_url为请求报文中解析出的请求资源，以/开头，也就是/xxx，
     POST请求，跳转到fans.html，即关注页面
 服务器根据 m_url 再设置真正的访问页面，此种方法不仅可以减少需要传输的字节；还可以为浏览器需要访问的资源进行加密，即使请求报文或响应报文（更底层的说法是：数据流或数据报）中途被人抓走了，也不知道用户想要访问什么资源
 */
-//该函数将网站根目录和url文件拼接，然后通过stat判断该文件属性。另外，为了提高访问速度，通过mmap进行映射，将普通文件映射到内存逻辑地址。
+//等待注册语句执行期间保存的用户名、密码，语句完成后在回调中写入用户缓存
+struct register_task
+{
+    http_conn *conn;
+    unsigned int gen;
+    char name[100];
+    char password[100];
+};
+
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    //将 m_real_file 赋值为网站根目录
-    strcpy(m_real_file, doc_root);//假设根目录为"/home/qgy/github/ini_tinywebserver/root"
-    int len = strlen(doc_root);
-    //printf("m_url:%s\n", m_url);
     //找到m_url中/的位置，进而判断/后第一个字符
     const char *p = strrchr(m_url, '/');//返回 str 中最后一次出现字符 c 的位置。如果未找到该值，则函数返回一个空指针。
 
+    //运行指标，由process_write生成正文
+    metrics *stats = metrics::get_instance();
+    if (stats->enabled() && 0 == strcmp(m_url, stats->path()))
+    {
+        m_route = metrics::ROUTE_METRICS;
+        return METRICS_REQUEST;
+    }
+    m_route = metrics::ROUTE_STATIC;
+
     //处理cgi，实现登录和注册校验
     if (cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3'))// m_url 为 /2CGISQL.cgi 或 /3CGISQL.cgi 时
     {
-
-        //根据标志判断是登录检测还是注册检测
-        char flag = m_url[1];
-
-        // 例如：/2CGISQL.cgi 中的 2 只是区分注册还是登录的标志，真正用到的 url 是 /CGISQL.cgi
-        //所以，下面5行代码利用 m_url_real 从 /2CGISQL.cgi 中把 /CGISQL.cgi 提取出来，然后将其拼接到 m_real_file 后面
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/");
-        strcat(m_url_real, m_url + 2);
-        strncpy(m_real_file + len, m_url_real, FILENAME_LEN - len - 1);// 此时的 m_real_file 才是绝对路径，在此之前只是个目录
-        free(m_url_real);// 有malloc，必须用 free 释放
-
-        //将用户名和密码提取出来
-        //user=123&passwd=123
-        char name[100], password[100];
-        int i;
-        //以&为分隔符，前面的为用户名
-        for (i = 5; m_string[i] != '&'; ++i)
-            name[i - 5] = m_string[i];
-        name[i - 5] = '\0';
-
-        //以&为分隔符，后面的是密码
-        int j = 0;
-        for (i = i + 10; m_string[i] != '\0'; ++i, ++j)
-            password[j] = m_string[i];
-        password[j] = '\0';
+        m_route = *(p + 1) == '2' ? metrics::ROUTE_LOGIN : metrics::ROUTE_REGISTER;
+        //将用户名和密码提取出来：user=123&password=123，或multipart/form-data表单。
+        //在消息体中原地解码，字段直接指向读缓冲区
+        form_parser form;
+        if (!form.parse(m_string, m_content_length, m_content_type))
+            return BAD_REQUEST;
+        const form_field *user = form.get("user");
+        const form_field *pass = form.get("password");
+        //缺少字段、超长或含'\0'（%00）的用户名、密码直接拒绝，后面都按C字符串使用
+        if (!user || !pass || 0 == user->value_len || user->value_len >= 100 || pass->value_len >= 100 ||
+            memchr(user->value, '\0', user->value_len) || memchr(pass->value, '\0', pass->value_len))
+            return BAD_REQUEST;
+        const char *name = user->value;
+        const char *password = pass->value;
 
         if (*(p + 1) == '3')
         {
             //如果是注册，先检测数据库中是否有重名的
             //若没有重名的，则增加数据
-            char *sql_insert = (char *)malloc(sizeof(char) * 200);
-            strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
-
-            //判断map中能否找到重复的用户名
-            if (users.find(name) == users.end())//没有重名
+            //先在用户缓存中占住用户名，同名的并发注册只有一个能成功；插入数据库时不再持有任何全局锁
+            user_cache *cache = user_cache::get_instance();
+            bool taken = !cache->reserve(name);
+            //用户表尚未载入完时，缓存中没有不代表数据库中没有，再单独查一次
+            if (!taken && !m_store->loaded())
+            {
+                int ret = m_store->find(name, NULL, NULL);
+                //等不到数据库连接时不占用工作线程，直接返回503
+                if (user_store::STORE_UNAVAILABLE == ret)
+                {
+                    cache->cancel(name);
+                    return SERVICE_UNAVAILABLE;
+                }
+                taken = user_store::STORE_OK == ret;
+            }
+
+            if (taken)//有重名
+            {
+                m_target = "/registerError.html";
+            }
+            else
             {
-                //向数据库中插入数据时，需要通过锁来同步数据
-                m_lock.lock();
-                int res = mysql_query(mysql, sql_insert);//查询成功，返回0.如果出现错误，返回非0值。
-                users.insert(pair<string, string>(name, password));
-                m_lock.unlock();
-
-                if (!res)//注册成功跳转到log.html，即登录页面；
-                    strcpy(m_url, "/log.html");
+                //存储可以异步插入时（sql_async），工作线程不等待数据库，并发的注册合并成多行INSERT。
+                //连接的读写事件保持未注册，直到回调中生成好响应
+                register_task *task = new register_task;
+                task->conn = this;
+                task->gen = m_gen;
+                strcpy(task->name, name);
+                strcpy(task->password, password);
+                int ret = m_store->insert(task->name, task->password, on_register_done, task);
+                if (user_store::STORE_PENDING == ret)
+                    return SQL_REQUEST;
+                delete task;
+
+                if (user_store::STORE_UNAVAILABLE == ret)
+                {
+                    cache->cancel(name);
+                    return SERVICE_UNAVAILABLE;
+                }
+                if (user_store::STORE_OK == ret)//注册成功跳转到log.html，即登录页面；
+                {
+                    cache->commit(name, password);
+                    m_target = "/log.html";
+                }
                 else//注册失败跳转到registerError.html，即注册失败页面。
-                    strcpy(m_url, "/registerError.html");
+                {
+                    cache->cancel(name);
+                    m_target = "/registerError.html";
+                }
             }
-            else//有重名
-                strcpy(m_url, "/registerError.html");
         }
         //如果是登录，直接判断
         //若浏览器端输入的用户名和密码在表中可以查找到，返回1，否则返回0
         else if (*(p + 1) == '2')
         {
-            if (users.find(name) != users.end() && users[name] == password)
-                strcpy(m_url, "/welcome.html");
+            //登录总是校验密码，会话只用于访问需要登录的页面
+            session_store *sessions = session_store::get_instance();
+            bool match = user_cache::get_instance()->check(name, password);
+            //用户表尚未载入完时，缓存未命中的用户到数据库中单独查询
+            if (!match && !m_store->loaded())
+            {
+                if (user_store::STORE_UNAVAILABLE == m_store->find(name, password, &match))
+                    return SERVICE_UNAVAILABLE;
+            }
+            //校验通过后新建会话，响应中下发令牌
+            if (match && sessions->enabled())
+            {
+                m_session = sessions->create(name);
+                m_new_session = m_session != 0;
+            }
+            if (match)
+                m_target = "/welcome.html";
             else
-                strcpy(m_url, "/logError.html");
+                m_target = "/logError.html";
         }
     }
+    //启用会话时，图片、视频、关注页面只对已登录的请求开放，没有有效会话时转到登录页面
+    else if ((*(p + 1) == '5' || *(p + 1) == '6' || *(p + 1) == '7') && !m_session &&
+             session_store::get_instance()->enabled())
+    {
+        m_target = "/log.html";
+    }
+
+    return map_file();
+}
+
+void http_conn::on_register_done(void *arg, int err)
+{
+    register_task *task = (register_task *)arg;
+    if (!err)
+        user_cache::get_instance()->commit(task->name, task->password);
+    else
+        user_cache::get_instance()->cancel(task->name);
+    task->conn->resume(task->gen, err ? "/registerError.html" : "/log.html");
+    delete task;
+}
+
+void http_conn::resume(unsigned int gen, const char *url)
+{
+    if (gen != m_gen || -1 == m_sockfd)
+        return;
+    m_target = url;
+    //响应交给写事件发送；生成失败时由write按m_close_pending关闭连接
+    trace_scope scope(m_traced, trace_key(), request_tracer::STAGE_RESPOND);
+    if (!process_write(map_file()))
+        m_close_pending = 1;
+    modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode, m_gen);
+}
+
+//该函数将网站根目录和url文件拼接，然后通过stat判断该文件属性。另外，为了提高访问速度，通过mmap进行映射，将普通文件映射到内存逻辑地址。
+http_conn::HTTP_CODE http_conn::map_file()
+{
+    //服务器主机上存储待读取文件的绝对路径，只在本函数中使用，放在栈上而不是连接槽中
+    char real_file[FILENAME_LEN];
+    memset(real_file, '\0', FILENAME_LEN);
+    //请求资源文件的属性，后续只需要文件大小
+    struct stat file_stat;
+
+    //将 real_file 赋值为网站根目录
+    strcpy(real_file, doc_root);//假设根目录为"/home/qgy/github/ini_tinywebserver/root"
+    int len = strlen(doc_root);
+    const char *p = strrchr(m_target, '/');
 
     //如果请求资源为/0，表示跳转注册界面
     if (*(p + 1) == '0')
     {
         char *m_url_real = (char *)malloc(sizeof(char) * 200);//!!
         strcpy(m_url_real, "/register.html");
-        //将网站目录和/register.html进行拼接，更新到m_real_file中
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+        //将网站目录和/register.html进行拼接，更新到real_file中
+        strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
         free(m_url_real);//!!
     }
@@ -595,8 +801,8 @@ http_conn::HTTP_CODE http_conn::do_request()
     {
         char *m_url_real = (char *)malloc(sizeof(char) * 200);
         strcpy(m_url_real, "/log.html");
-        //将网站目录和/log.html进行拼接，更新到m_real_file中
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+        //将网站目录和/log.html进行拼接，更新到real_file中
+        strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
         free(m_url_real);
     }
@@ -605,7 +811,7 @@ http_conn::HTTP_CODE http_conn::do_request()
     {
         char *m_url_real = (char *)malloc(sizeof(char) * 200);
         strcpy(m_url_real, "/picture.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+        strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
         free(m_url_real);
     }
@@ -614,7 +820,7 @@ http_conn::HTTP_CODE http_conn::do_request()
     {
         char *m_url_real = (char *)malloc(sizeof(char) * 200);
         strcpy(m_url_real, "/video.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+        strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
         free(m_url_real);
     }
@@ -623,13 +829,13 @@ http_conn::HTTP_CODE http_conn::do_request()
     {
         char *m_url_real = (char *)malloc(sizeof(char) * 200);
         strcpy(m_url_real, "/fans.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+        strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
         free(m_url_real);
     }
     //如果以上情况均不符合，则发送url实际请求的文件
     else
-        strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+        strncpy(real_file + len, m_target, FILENAME_LEN - len - 1);
 
     /*
     int stat(const char *pathname, struct stat *statbuf)函数用于取得指定文件的文件属性，并将文件属性存储在结构体stat里，这里仅对其中用到的成员进行介绍
@@ -639,20 +845,21 @@ http_conn::HTTP_CODE http_conn::do_request()
        off_t     st_size;        文件大小，字节数
     };
     */
-   //通过stat获取请求资源文件信息，成功则将信息更新到m_file_stat结构体。失败返回NO_RESOURCE状态，表示资源不存在
-    if (stat(m_real_file, &m_file_stat) < 0)
+   //通过stat获取请求资源文件信息，成功则将信息更新到file_stat结构体。失败返回NO_RESOURCE状态，表示资源不存在
+    if (stat(real_file, &file_stat) < 0)
         return NO_RESOURCE;
 
     //判断文件的权限，是否可读，不可读则返回FORBIDDEN_REQUEST状态
-    if (!(m_file_stat.st_mode & S_IROTH))
+    if (!(file_stat.st_mode & S_IROTH))
         return FORBIDDEN_REQUEST;
     //判断文件类型，如果是目录，则返回BAD_REQUEST，表示请求报文有误
-    if (S_ISDIR(m_file_stat.st_mode))
+    if (S_ISDIR(file_stat.st_mode))
         return BAD_REQUEST;
 
     //以只读方式获取文件描述符，通过mmap将该文件映射到内存中
-    int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);//将文件 fd 映射到内存，提高文件的访问速度。
+    m_file_size = file_stat.st_size;
+    int fd = open(real_file, O_RDONLY);
+    m_file_address = (char *)mmap(0, m_file_size, PROT_READ, MAP_PRIVATE, fd, 0);//将文件 fd 映射到内存，提高文件的访问速度。
     //避免文件描述符的浪费和占用
     close(fd);
     //表示请求文件存在，且可以访问
@@ -662,105 +869,88 @@ void http_conn::unmap()
 {
     if (m_file_address)
     {
-        munmap(m_file_address, m_file_stat.st_size);
+        munmap(m_file_address, m_file_size);
         m_file_address = 0;
     }
 }
 
 /*
-服务器子线程调用process_write完成响应报文（要发送的响应报文已经存在于http对象的成员变量m_iov[]中了），随后注册epollout事件。
-服务器主线程检测写事件（注意：在本项目中，用的是 proactor 事件处理模式，所以该函数是由主线程调用），并调用http_conn::write函数将响应报文发送给浏览器端。
+服务器子线程调用process_write完成响应报文（要发送的响应报文已经存在于http对象的成员变量m_response中了），随后直接在子线程中调用write尝试发送。
+只有发送缓冲区满时才注册epollout事件，由服务器主线程检测写事件（proactor模式下由主线程调用，reactor模式下交给工作线程），再次调用http_conn::write函数发送剩余数据。
 
 write 函数具体逻辑如下：
 
-1、在生成响应报文时初始化byte_to_send，包括头部信息和文件数据大小。通过writev函数循环发送响应报文数据，根据返回值更新byte_have_send和iovec结构体
-的指针和长度，并判断响应报文整体是否发送成功。
-    若writev单次发送成功，更新byte_to_send和byte_have_send的大小，若响应报文整体发送成功,则取消mmap映射,并判断是否是长连接：
+1、在生成响应报文时由m_response记录剩余字节数。通过m_response.write()循环调用writev发送响应报文数据，它会根据返回值推进iovec游标，
+无论结束点落在报头、文件还是其他任意一段中，下一次都能从正确的位置继续发送。
+    若writev单次发送成功，判断响应报文整体是否发送成功,若是则取消mmap映射,并判断是否是长连接：
         若是长连接，则重置http类实例，注册读事件，不关闭连接;
         若是短连接，则直接关闭连接
 2、若writev单次发送不成功，判断是否是写缓冲区满了。
     若不是因为缓冲区满了而失败，取消mmap映射，关闭连接；
-    若eagain则是缓冲区满了，更新iovec结构体的指针和长度，并注册写事件，等待下一次写事件触发（当写缓冲区从不可写变为可写，触发epollout），因此在此期间无法立即接收到
+    若eagain则是缓冲区满了，注册写事件，等待下一次写事件触发（当写缓冲区从不可写变为可写，触发epollout），因此在此期间无法立即接收到
     同一用户的下一请求，但可以保证连接的完整性。
 */
 bool http_conn::write()
 {
-    int temp = 0;
+    //工作线程已经发送完毕但需要关闭连接，交由主线程（Reactor下为主线程根据timer_flag）关闭
+    if (m_close_pending)
+        return false;
+    trace_scope scope(m_traced, trace_key(), request_tracer::STAGE_WRITE);
 
     //若要发送的数据长度为0，则表示响应报文为空，但一般不会出现这种情况
-    if (bytes_to_send == 0)
+    if (m_response.bytes_to_send() == 0)
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
-        init();
+        wait_next_request();
         return true;
     }
 
     while (1)
     {
-        /*
-        writev函数将多块分散的内存数据一并写入文件描述符中，有时也将这该函数称为聚集写。
-
-        #include <sys/uio.h>
-        ssize_t writev(int filedes, const struct iovec *iov, int iovcnt);
-            filedes表示文件描述符；
-            iov为前述io向量机制结构体iovec；
-            iovcnt为结构体的个数
-        若成功则返回已写的字节数，若出错则返回-1。writev以顺序iov[0]，iov[1]至iov[iovcnt-1]从缓
-        冲区中聚集输出数据。writev返回输出的字节总数，通常，它应等于所有缓冲区长度之和。
-        
-        特别注意： 循环调用writev时，需要重新处理iovec中的指针和长度，writev函数不会对这两个成员做任何处理。writev的返回值为已写的字节数。
-        我们需要通过遍历iovec来计算新的基址，另外写入数据的“结束点”可能位于一个iovec的中间某个位置，因此需要调整临界iovec的io_base和io_len。
-        */
-        //将响应报文的状态行、消息头、空行和响应正文发送给浏览器端
-        temp = writev(m_sockfd, m_iv, m_iv_count);
-
-        //发送失败（一个字节都没发出去），temp为发送的字节数
+        //将响应报文的各段一并发送给浏览器端，部分发送时m_response内部负责调整iovec的指针和长度
+        ssize_t temp = m_response.write(m_sockfd);
+
+        //发送失败（一个字节都没发出去）
         if (temp < 0)
         {
             //判断缓冲区是否满了
             if (errno == EAGAIN)//缓冲区已满
             {
                 //重新注册写事件
-                modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
+                modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode, m_gen);
                 return true;
             }
             //如果发送失败，但不是缓冲区问题，取消映射
             unmap();
             return false;
         }
-
-        //更新已发送字节
-        bytes_have_send += temp;
-        //更新剩余发送字节
-        bytes_to_send -= temp;
-
-        //第一个iovec头部信息的数据已发送完，发送第二个iovec数据
-        if (bytes_have_send >= m_iv[0].iov_len)
-        {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);//(bytes_have_send - m_write_idx)为指针在m_iov[1]中的偏移量：若此时刚好发完m_iov[0]，则 bytes_have_send 与 m_write_idx 相等，偏移量为0；若m_iov[1]以发送了部分数据，则 bytes_have_send - m_write_idx 表示的是从m_iov[1]中已经发送的字节数
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        //第一个iovec头部信息的数据还未发送完，继续发送第一个iovec头部信息的数据
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - bytes_have_send;
-        }
+        metrics::get_instance()->inc(metrics::BYTES_SENT, temp);
 
         //判断条件，数据已全部发送完
-        if (bytes_to_send <= 0)
+        if (m_response.bytes_to_send() == 0)
         {
+            //响应发送完毕，请求行和头部仍在读缓冲区中，此时记录访问日志和请求指标；
+            //log_access会推进请求序号，先记录整个请求的追踪，本次发送与整个请求同时结束
+            if (m_traced)
+            {
+                uint64_t now = request_tracer::now_ns();
+                scope.finish(now);
+                request_tracer::get_instance()->record(request_tracer::STAGE_REQUEST, trace_key(), m_req_start * 1000,
+                                                       now);
+            }
+            log_access();
+            metrics *stats = metrics::get_instance();
+            if (stats->enabled())
+                stats->request(m_route, m_status, monotonic_us() - m_req_start);
+
             //取消mmap映射
             unmap();
-            //在epoll树上重置EPOLLONESHOT事件
-            modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
 
             //浏览器的请求为长连接
             if (m_linger)
             {
-                //重新初始化HTTP对象
-                init();
+                //重新初始化HTTP对象，再在epoll树上重置EPOLLONESHOT事件
+                //顺序不能颠倒：write可能在工作线程中执行，注册读事件后主线程随时可能开始读取该连接
+                wait_next_request();
                 return true;
             }
             else
@@ -772,46 +962,49 @@ bool http_conn::write()
 }
 
 /*
-根据do_request的返回状态，服务器子线程调用process_write向m_write_buf中写入响应报文。
+根据do_request的返回状态，服务器子线程调用process_write向m_response中写入响应报文。
     add_status_line函数，添加状态行：http/1.1 状态码 状态消息;
     add_headers函数添加消息报头，内部调用add_content_length和add_linger函数:
         content-length记录响应报文长度，用于浏览器端判断服务器是否发送完数据;
         connection记录连接状态，用于告诉浏览器端保持长连接.
     add_blank_line添加空行.
-上述涉及的5个函数，均是内部调用add_response函数更新m_write_idx指针和缓冲区m_write_buf中的内容。
+上述涉及的5个函数，均是内部调用add_response函数向m_response追加文本段，当前分片写满时会自动从缓冲池再借一块。
 */
 bool http_conn::add_response(const char *format, ...)
 {
-    //如果写入内容超出m_write_buf大小则报错
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
-        return false;
-
     //定义可变参数列表
     va_list arg_list;
     //将变量arg_list初始化为传入参数
     va_start(arg_list, format);
-    //将数据format从可变参数列表写入缓冲区写，返回写入数据的长度
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    //如果写入的数据长度超过缓冲区剩余空间，则报错
-    if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx))
-    {
-        va_end(arg_list);
-        return false;
-    }
-
-    //更新m_write_idx位置
-    m_write_idx += len;
+    //将数据format从可变参数列表写入响应报文，返回写入内容的首地址
+    const char *text = m_response.vappend(format, arg_list);
     //清空可变参列表
     va_end(arg_list);
 
-    LOG_INFO("request:%s", m_write_buf);
+    //超过文本段总长度上限或缓冲池分配失败则报错
+    if (!text)
+        return false;
+
+    LOG_INFO_SAMPLED("request:%s", text);
 
     return true;
 }
 
+//记录一条访问日志，复用序号为该连接上此前已完成的请求数
+void http_conn::log_access()
+{
+    unsigned int reuse = m_requests++;
+    access_log *log = access_log::get_instance();
+    if (!log->enabled())
+        return;
+    log->write(m_address, method_names[m_method], m_url, m_version, m_status, m_response.bytes_have_send(),
+               m_referer, m_user_agent, monotonic_us() - m_req_start, reuse);
+}
+
 //添加状态行
 bool http_conn::add_status_line(int status, const char *title)
 {
+    m_status = status;
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
@@ -846,7 +1039,7 @@ bool http_conn::add_blank_line()
     return add_response("%s", "\r\n");
 }
 
-//请求出错时，调用此函数直接将错误信息（响应正文）一并写入 m_write_buf 
+//请求出错时，调用此函数直接将错误信息（响应正文）一并写入 m_response 的文本段
 bool http_conn::add_content(const char *content)
 {
     return add_response("%s", content);
@@ -854,11 +1047,12 @@ bool http_conn::add_content(const char *content)
 
 /*
 响应报文分为两种:
-若请求的文件存在，通过io向量机制iovec，声明两个iovec，第一个指向m_write_buf（m_write_buf 里是响应报文的状态行、消息报头、空行），
-    第二个指向mmap的地址m_file_address（响应正文）。然后用 writev 函数将这两个地址的内容同时输出，这样可以避免把这两部分内容拼接到一起再发送。
-若请求出错，这时候只申请一个iovec，指向m_write_buf（此时将响应正文（就是错误信息）写入m_write_buf 中，然后一并发送）。
+若请求的文件存在，状态行、消息报头、空行作为文本段写入m_response，mmap的地址m_file_address（响应正文）作为引用段挂在后面，
+    然后用 writev 函数将各段的内容同时输出，这样可以避免把这几部分内容拼接到一起再发送。
+若请求出错，响应正文（就是错误信息）同样作为文本段写入m_response，然后一并发送。
+段的个数不受限制，需要更多报头或多块正文时继续追加即可。
 */
-//响应报文写成功：此函数只是将响应报文的内容写入到了 m_iv[0]、m_iv[1] （若请求出错，只写入到了m_iv[0]）中；且将响应报文的总字节数存入到了成员变量 bytes_to_send 中
+//响应报文写成功：此函数只是将响应报文的各段按顺序追加到了 m_response 中，总字节数由 m_response 记录
 //对于含有请求资源的响应报文和错误信息的响应报文都是如此，若响应报文写失败：函数直接return false；并关闭当前套接字的连接；写成功的话，注册epollout事件，等待服务器主线程检测写事件并执行write函数
 bool http_conn::process_write(HTTP_CODE ret)
 {
@@ -875,6 +1069,16 @@ bool http_conn::process_write(HTTP_CODE ret)
                 return false;
             break;
         }
+        //数据库连接池耗尽或数据库不可用，503，客户端稍后重试
+        case SERVICE_UNAVAILABLE:
+        {
+            add_status_line(503, error_503_title);
+            add_response("Retry-After: 1\r\n");
+            add_headers(strlen(error_503_form));
+            if (!add_content(error_503_form))
+                return false;
+            break;
+        }
         //报文语法有误，404
         case BAD_REQUEST:
         {
@@ -893,24 +1097,38 @@ bool http_conn::process_write(HTTP_CODE ret)
                 return false;
             break;
         }
+        //运行指标，200，正文为Prometheus文本格式
+        case METRICS_REQUEST:
+        {
+            //正文先生成到线程自己的缓冲区中，得到长度后再写报头，随后整段拷贝进文本段
+            static thread_local std::string body;
+            body.clear();
+            metrics::get_instance()->render(body, m_user_count);
+            add_status_line(200, ok_200_title);
+            add_response("Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+            if (!add_headers(body.size()) || !m_response.append(body.data(), body.size()))
+                return false;
+            break;
+        }
         //文件存在，200
         case FILE_REQUEST:
         {
             add_status_line(200, ok_200_title);
+            //登录成功新建了会话，下发令牌
+            if (m_new_session)
+            {
+                char token[session_store::TOKEN_LEN + 1];
+                if (session_store::get_instance()->token(m_session, token))
+                    add_response("Set-Cookie: sid=%s; Path=/; Max-Age=%d; HttpOnly\r\n", token,
+                                 session_store::get_instance()->ttl());
+            }
             //如果请求的资源存在
-            if (m_file_stat.st_size != 0)
+            if (m_file_size != 0)
             {
-                add_headers(m_file_stat.st_size);
-                //第一个iovec指针指向响应报文缓冲区，长度指向m_write_idx
-                m_iv[0].iov_base = m_write_buf;
-                m_iv[0].iov_len = m_write_idx;
-                //第二个iovec指针指向mmap返回的文件指针，长度指向文件大小
-                m_iv[1].iov_base = m_file_address;
-                m_iv[1].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
-                //发送的全部数据为响应报文头部信息和文件大小
-                bytes_to_send = m_write_idx + m_file_stat.st_size;
-                return true;
+                if (!add_headers(m_file_size))
+                    return false;
+                //报头之后追加引用段，指向mmap返回的文件指针，长度为文件大小
+                return m_response.add_ref(m_file_address, m_file_size);
             }
             else
             {
@@ -925,33 +1143,53 @@ bool http_conn::process_write(HTTP_CODE ret)
             return false;
     }
 
-    //除FILE_REQUEST状态外，其余状态都只申请一个iovec，指向响应报文缓冲区
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    //除FILE_REQUEST状态外，其余状态的响应报文都只有文本段
     return true;
 }
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
+    HTTP_CODE read_ret;
+    {
+        trace_scope scope(m_traced, trace_key(), request_tracer::STAGE_PARSE);
+        read_ret = process_read();
+    }
 
     //NO_REQUEST，表示请求不完整，需要继续接收请求数据
     if (read_ret == NO_REQUEST)
     {
         //注册并监听读事件
-        modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
+        modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode, m_gen);
         return;
     }
 
+    //注册请求等待数据库，响应在语句完成后的回调中生成
+    if (read_ret == SQL_REQUEST)
+        return;
+
     //调用process_write完成报文响应
-    bool write_ret = process_write(read_ret);
+    bool write_ret;
+    {
+        trace_scope scope(m_traced, trace_key(), request_tracer::STAGE_RESPOND);
+        write_ret = process_write(read_ret);
+    }
     //响应报文写入失败，直接断开当前套接字的连接
     if (!write_ret)
     {
         close_conn();
+        return;
     }
 
-    //注册并监听写事件。服务器主线程检测写事件，并调用http_conn::write函数将响应报文发送给浏览器端。
-    modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
+    /*
+    大多数情况下socket发送缓冲区是空的，没必要先注册EPOLLOUT、等主线程epoll_wait返回后再切回线程池发送。
+    这里直接在工作线程中尝试发送：
+        全部发送完且为长连接，write内部已重置对象并注册读事件，本次请求到此结束；
+        发送缓冲区满(EAGAIN)，write内部已注册写事件，剩余数据仍由主线程检测写事件后继续发送；
+        需要关闭连接（短连接或发送出错），工作线程不能操作定时器链表，于是标记m_close_pending并注册写事件，
+        由主线程在dealwithwrite中按原有流程关闭连接、删除定时器。
+    */
+    if (!write())
+    {
+        m_close_pending = 1;
+        modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode, m_gen);
+    }
 }
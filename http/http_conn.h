@@ -19,20 +19,26 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <stdint.h>
 #include <map>
+#include <atomic>
 
 #include "../lock/locker.h"
 #include "../CGImysql/sql_connection_pool.h"
+#include "../CGImysql/user_store.h"
 #include "../timer/lst_timer.h"
 #include "../log/log.h"
+#include "../metrics/metrics.h"
+#include "../trace/request_tracer.h"
+#include "http_response.h"
+#include "conn_table.h"
 
 // 一个 http_conn 对象就是一个客户连接
 class http_conn
 {
 public:
-    static const int FILENAME_LEN = 200;//设置读取文件的名称m_real_file大小
-    static const int READ_BUFFER_SIZE = 2048;//设置读缓冲区m_read_buf大小
-    static const int WRITE_BUFFER_SIZE = 1024;//设置写缓冲区m_write_buf大小
+    static const int FILENAME_LEN = 200;//设置读取文件的名称real_file大小
+    static const int READ_BUFFER_SIZE = 2048;//设置读缓冲区m_read_buf大小，从缓冲池按此大小借用
     //报文的请求方法，本项目只用到GET和POST
     enum METHOD
     {
@@ -63,7 +69,10 @@ public:
         FORBIDDEN_REQUEST, //请求资源禁止访问，没有读取权限
         FILE_REQUEST, //请求资源可以正常访问
         INTERNAL_ERROR, //服务器内部错误，该结果在主状态机逻辑switch的default下，一般不会触发
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        SERVICE_UNAVAILABLE, //等不到数据库连接，返回503
+        SQL_REQUEST, //请求已交给用户存储异步执行（sql_async），语句完成后由回调继续生成响应
+        METRICS_REQUEST //请求运行指标，响应正文由metrics生成
     };
     //从状态机的状态
     enum LINE_STATUS
@@ -74,13 +83,21 @@ public:
     };
 
 public:
-    http_conn() {}
+    http_conn() : m_gen(0), m_activity(1), m_holders(0), m_read_buf(NULL), m_file_address(NULL) {}
     ~http_conn() {}
 
 public:
     //初始化套接字地址，函数内部会调用私有方法init
-    void init(int sockfd, const sockaddr_in &addr, char *, int, int, string user, string passwd, string sqlname);
+    void init(int sockfd, const sockaddr_in &addr, char *, int, int);
     void close_conn(bool real_close = true);//关闭 http 连接，关闭一个连接，客户总量减一
+    //归还借用的缓冲区并取消文件映射，只能由当前持有该连接的线程调用
+    void release();
+    //fd已由主线程关闭（cb_func），归还借用的内存；之后close_conn、resume不再操作该fd
+    void on_closed()
+    {
+        m_sockfd = -1;
+        release();
+    }
     void process();
     bool read_once();//循环读取客户数据，直到无数据可读或对方关闭连接,非阻塞ET工作模式下，需要一次性将数据读完
     //响应报文写入函数
@@ -89,18 +106,63 @@ public:
     {
         return &m_address;
     }
-    //同步线程初始化数据库读取表
-    void initmysql_result(connection_pool *connPool);
+    //连接的代数：同一个fd每接受一次新连接加一，和fd一起放在epoll_event.data.u64中，用于识别已被回收的fd上的过期事件
+    unsigned int get_gen() const
+    {
+        return m_gen;
+    }
+    static uint64_t make_token(int fd, unsigned int gen)
+    {
+        return ((uint64_t)gen << 32) | (uint32_t)fd;
+    }
+    //设置登录、注册使用的用户存储，并开始把已有用户载入用户缓存
+    void initmysql_result(user_store *store);
+    //本次请求是否被采样追踪，以及追踪记录中标识该请求的fd、代数和请求序号
+    bool traced() const
+    {
+        return m_traced;
+    }
+    request_tracer::key trace_key() const
+    {
+        request_tracer::key k = {m_sockfd, m_gen, m_requests};
+        return k;
+    }
     int timer_flag;
     int improv;
+    int m_close_pending;//工作线程发送完响应后需要关闭连接，等待主线程处理
+
+    //主线程开始处理该连接上的事件前调用，连接不再空闲，同时推进事件计数
+    void set_busy()
+    {
+        unsigned int v = m_activity.load(std::memory_order_relaxed);
+        while (!m_activity.compare_exchange_weak(v, (v | 1) + 1, std::memory_order_relaxed))
+            ;
+        if (v & 1)
+            metrics::get_instance()->inc(metrics::CONN_BUSY);
+    }
+    //交给工作线程前由线程池调用，工作线程处理完后调用unhold；有工作线程持有时定时器不关闭该连接
+    void hold() { m_holders.fetch_add(1, std::memory_order_relaxed); }
+    void unhold() { m_holders.fetch_sub(1, std::memory_order_release); }
+    bool held() const { return m_holders.load(std::memory_order_acquire) != 0; }
+    //资源紧张时由主线程调用：只有空闲连接（处于读状态且没有未处理完的请求数据）才能被淘汰
+    bool try_evict()
+    {
+        unsigned int v = m_activity.load(std::memory_order_acquire);
+        if (!(v & 1) || !m_activity.compare_exchange_strong(v, v + 1, std::memory_order_acquire))
+            return false;
+        metrics::get_instance()->inc(metrics::CONN_BUSY);
+        return true;
+    }
 
 
 private:
     //这个版本的 init() 初始化对象的 private 变量
     void init();
+    //一次请求处理完毕后重置对象、注册读事件，再标记连接空闲
+    void wait_next_request();
     //从m_read_buf读取，并处理请求报文
     HTTP_CODE process_read();
-    //向m_write_buf写入响应报文数据
+    //向m_response写入响应报文数据
     bool process_write(HTTP_CODE ret);
     //解析http请求行
     HTTP_CODE parse_request_line(char *text);
@@ -110,14 +172,22 @@ private:
     HTTP_CODE parse_content(char *text);
     //生成响应报文
     HTTP_CODE do_request();
+    //按m_target映射要发送的文件
+    HTTP_CODE map_file();
+    //注册语句完成后的回调，以及继续生成响应：连接在等待期间已关闭或被复用（代数不同）时什么也不做
+    static void on_register_done(void *arg, int err);
+    void resume(unsigned int gen, const char *url);
     //get_line用于将指针向后偏移，指向第一个未处理的字符
     char *get_line() { return m_read_buf + m_start_line; };
     //从状态机读取一行，分析是请求报文的哪一部分
     LINE_STATUS parse_line();
 
     void unmap();
+    //读缓冲区的借用与归还
+    bool acquire_read_buf();
+    void release_read_buf();
 
-    //根据响应报文格式，生成对应8个部分，以下函数均由do_request调用
+    //根据响应报文格式，生成对应8个部分，以下函数均由do_request调用，内容追加到m_response中
     bool add_response(const char *format, ...);
     bool add_content(const char *content);
     bool add_status_line(int status, const char *title);
@@ -126,52 +196,55 @@ private:
     bool add_content_length(int content_length);
     bool add_linger();
     bool add_blank_line();
+    void log_access();
 
 public:
     static int m_epollfd;//监听所有 http_conn 连接的epollfd
     static int m_user_count;
-    MYSQL *mysql;
+    static user_store *m_store;//用户存储，所有连接共用
     int m_state;  //读为0, 写为1
 
 private:
     int m_sockfd;
+    unsigned int m_gen;
+    std::atomic<unsigned int> m_activity;//最低位为1表示连接空闲，其余位为主线程处理该连接事件的计数
     sockaddr_in m_address;
-    char m_read_buf[READ_BUFFER_SIZE];//存储读取的请求报文数据，即本线程的读缓冲区
+    std::atomic<unsigned char> m_holders;//持有该连接的工作线程数（含排队中的任务）
+    char *m_read_buf;//存储读取的请求报文数据，有数据到达时从缓冲池借用，请求处理完毕连接空闲时归还
     int m_read_idx;//缓冲区中m_read_buf中数据的最后一个字节的下一个位置，作为m_check_idx循环解析字符的终止位置
     int m_checked_idx;//指向 m_read_buf 中正在解析的字节，遇到m_read_idx时结束本次循环
     int m_start_line;//m_read_buf 中已经解析的字符个数
-    char m_write_buf[WRITE_BUFFER_SIZE];//存储发出的响应报文数据，即本线程的写缓冲区
-    int m_write_idx;//指示m_write_buf（响应报文的状态行、消息报头、空行）中已写的长度，此变量与要发送的文件（响应报文的响应正文）无关。只有在响应正文为错误信息时，才将整个响应报文写入m_write_buf
+    http_response m_response;//响应报文构造器：状态行、消息报头等文本段存放在缓冲池分片中，文件等响应正文以引用段挂在后面，按顺序组成iovec
 
     CHECK_STATE m_check_state;//主状态机的状态
     METHOD m_method;//请求方法
 
-    char m_real_file[FILENAME_LEN]; //服务器主机上存储待读取文件的绝对路径
-
     /*以下为解析请求报文中对应的6个变量*/
-    char *m_url;
-    char *m_version;
+    char *m_url;//客户端请求的路径，指向读缓冲区
+    const char *m_target;//实际发送的页面：默认为m_url，登录、注册等按结果改为对应的页面
+    const char *m_version;
     char *m_host;
     int m_content_length; //消息体字节数
     bool m_linger;//是否为长连接
+    bool m_new_session;//本次登录新建了会话，响应中下发Cookie
+    unsigned char m_route;//请求的路由（metrics::route），用于按路由统计请求数和耗时
+    bool m_traced;//本次请求是否被采样追踪各阶段耗时
     char *m_string; //存储请求报文的消息体
-
-    char *m_file_address;//将服务器主机上的待读取文件（该文件的绝对地址为 m_real_file）映射到起始地址为 m_file_address 的内存中
-    struct stat m_file_stat;//存储 m_real_file （服务器主机中存放的被请求访问的文件）的属性
-    struct iovec m_iv[2];//io向量机制iovec
-    int m_iv_count;
+    char *m_content_type;//Content-Type字段，决定消息体按哪种表单格式解析
+    char *m_referer;   //Referer字段，仅用于访问日志
+    char *m_user_agent;//User-Agent字段，仅用于访问日志
+    int m_status;      //响应状态码
+    unsigned int m_requests;//该连接上已完成的请求数，新连接时清零
+    uint64_t m_req_start;   //本次请求第一个字节到达的时间，单调时钟，微秒
+
+    char *m_file_address;//将服务器主机上的待读取文件映射到起始地址为 m_file_address 的内存中
+    off_t m_file_size;//被请求访问的文件的大小
     int cgi;        //是否启用的POST
-    int bytes_to_send;//剩余发送字节数
-    int bytes_have_send;//已发送字节数
-    char *doc_root; //网站根目录在服务器主机上的绝对路径，例如"/home/qgy/github/ini_tinywebserver/root"，其中"/home/qgy/github/ini_tinywebserver"就是程序当前的工作目录
-
-    map<string, string> m_users;
-    int m_TRIGMode;
-    int m_close_log;
+    uint32_t m_session;//请求携带的有效会话号或本次登录新建的会话号，没有时为0
+    static char *doc_root; //网站根目录在服务器主机上的绝对路径，例如"/home/qgy/github/ini_tinywebserver/root"，其中"/home/qgy/github/ini_tinywebserver"就是程序当前的工作目录
 
-    char sql_user[100];
-    char sql_passwd[100];
-    char sql_name[100];
+    static int m_TRIGMode;
+    static int m_close_log;
 };
 
 #endif
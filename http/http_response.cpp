@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "http_response.h"
+#include "buffer_pool.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+http_response::http_response()
+    : m_head(NULL), m_tail(NULL), m_iov(NULL), m_iv_count(0), m_iv_cap(0), m_iv_pos(0),
+      m_text_size(0), m_bytes_to_send(0), m_bytes_have_send(0)
+{
+}
+
+http_response::~http_response()
+{
+    init();
+}
+
+void http_response::init()
+{
+    buffer_pool *pool = buffer_pool::get_instance();
+    while (m_head)
+    {
+        slice *next = m_head->next;
+        pool->free((char *)m_head, sizeof(slice) + m_head->cap);
+        m_head = next;
+    }
+    m_tail = NULL;
+
+    if (m_iov)
+    {
+        pool->free((char *)m_iov, m_iv_cap * sizeof(struct iovec));
+        m_iov = NULL;
+    }
+    m_iv_count = 0;
+    m_iv_cap = 0;
+    m_iv_pos = 0;
+    m_text_size = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+}
+
+//借一块至少能容纳 need 字节的新分片，挂到链表尾部
+bool http_response::new_slice(size_t need)
+{
+    size_t size = sizeof(slice) + need;
+    if (size < (size_t)SLICE_SIZE)
+        size = SLICE_SIZE;
+    size = buffer_pool::capacity(size);
+
+    slice *s = (slice *)buffer_pool::get_instance()->alloc(size);
+    if (!s)
+        return false;
+    s->next = NULL;
+    s->cap = size - sizeof(slice);
+    s->len = 0;
+
+    if (m_tail)
+        m_tail->next = s;
+    else
+        m_head = s;
+    m_tail = s;
+    return true;
+}
+
+//追加一个 iovec，容量不足时从缓冲池借一块两倍大小的数组
+bool http_response::push_iov(char *base, size_t len)
+{
+    if (m_iv_count == m_iv_cap)
+    {
+        int new_cap = m_iv_cap ? m_iv_cap * 2 : MIN_IOV;
+        buffer_pool *pool = buffer_pool::get_instance();
+        struct iovec *iov = (struct iovec *)pool->alloc(new_cap * sizeof(struct iovec));
+        if (!iov)
+            return false;
+        if (m_iov)
+        {
+            memcpy(iov, m_iov, m_iv_count * sizeof(struct iovec));
+            pool->free((char *)m_iov, m_iv_cap * sizeof(struct iovec));
+        }
+        m_iov = iov;
+        m_iv_cap = new_cap;
+    }
+    m_iov[m_iv_count].iov_base = base;
+    m_iov[m_iv_count].iov_len = len;
+    ++m_iv_count;
+    return true;
+}
+
+//文本写入尾分片后更新长度；若与上一个 iovec 首尾相接则直接合并，否则新开一个 iovec
+bool http_response::commit_text(char *dst, size_t len)
+{
+    m_tail->len += len;
+    m_text_size += len;
+    m_bytes_to_send += len;
+
+    if (m_iv_count > 0)
+    {
+        struct iovec *last = &m_iov[m_iv_count - 1];
+        if ((char *)last->iov_base + last->iov_len == dst)
+        {
+            last->iov_len += len;
+            return true;
+        }
+    }
+    return push_iov(dst, len);
+}
+
+const char *http_response::vappend(const char *format, va_list args)
+{
+    size_t room = m_tail ? m_tail->cap - m_tail->len : 0;
+    char *dst = m_tail ? slice_data(m_tail) + m_tail->len : NULL;
+
+    //先尝试写入当前尾分片，args 之后可能还要用，所以这里用副本
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(dst, room, format, copy);
+    va_end(copy);
+    if (len < 0)
+        return NULL;
+
+    //尾分片放不下，借一块新分片重新格式化
+    if ((size_t)len >= room)
+    {
+        if (m_text_size + len > (size_t)MAX_TEXT_SIZE)
+            return NULL;
+        if (!new_slice(len + 1))
+            return NULL;
+        dst = slice_data(m_tail);
+        vsnprintf(dst, m_tail->cap, format, args);
+    }
+
+    if (!commit_text(dst, len))
+        return NULL;
+    return dst;
+}
+
+bool http_response::append(const char *data, size_t len)
+{
+    if (m_text_size + len > (size_t)MAX_TEXT_SIZE)
+        return false;
+    if (!m_tail || m_tail->cap - m_tail->len < len)
+    {
+        if (!new_slice(len))
+            return false;
+    }
+    char *dst = slice_data(m_tail) + m_tail->len;
+    memcpy(dst, data, len);
+    return commit_text(dst, len);
+}
+
+bool http_response::add_ref(const char *base, size_t len)
+{
+    if (len == 0)
+        return true;
+    if (!push_iov((char *)base, len))
+        return false;
+    m_bytes_to_send += len;
+    return true;
+}
+
+/*
+writev 可能只发送了一部分数据，结束点可能落在任意一个 iovec 的中间。
+每次发送后从 m_iv_pos 开始跳过已发完的 iovec，并调整临界 iovec 的 iov_base 和 iov_len，
+下一次 writev 直接从 m_iov + m_iv_pos 开始即可，不需要再区分是报头还是文件。
+*/
+ssize_t http_response::write(int fd)
+{
+    int count = m_iv_count - m_iv_pos;
+    if (count > IOV_MAX)
+        count = IOV_MAX;
+
+    ssize_t ret = writev(fd, m_iov + m_iv_pos, count);
+    if (ret <= 0)
+        return ret;
+
+    m_bytes_have_send += ret;
+    m_bytes_to_send -= ret;
+
+    size_t left = ret;
+    while (left > 0 && m_iv_pos < m_iv_count)
+    {
+        struct iovec *iv = &m_iov[m_iv_pos];
+        if (left >= iv->iov_len)
+        {
+            left -= iv->iov_len;
+            iv->iov_len = 0;
+            ++m_iv_pos;
+        }
+        else
+        {
+            iv->iov_base = (char *)iv->iov_base + left;
+            iv->iov_len -= left;
+            left = 0;
+        }
+    }
+    return ret;
+}
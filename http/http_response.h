@@ -0,0 +1,68 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+//响应报文构造器：把响应拆成若干段，用一个可增长的 iovec 数组串起来，交给 writev 一次聚集发送。
+//段分两种：
+//  文本段：状态行、消息报头、错误页面等，格式化写入从 buffer_pool 借来的分片，分片写满后自动再借一块；
+//  引用段：mmap 的文件、缓存的报文体等，只记录地址和长度，不做拷贝，由调用者保证发送完成前内存有效。
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+class http_response
+{
+public:
+    static const int SLICE_SIZE = 1024;     //文本分片的默认大小（含分片头）
+    static const int MAX_TEXT_SIZE = 65536; //单个响应中文本段的总长度上限
+    static const int MIN_IOV = 8;           //iovec 数组的初始容量
+
+public:
+    http_response();
+    ~http_response();
+
+    //归还所有分片和 iovec 数组，准备构造下一个响应
+    void init();
+
+    //格式化写入一段文本，成功返回写入内容的首地址（以'\0'结尾），失败返回NULL
+    const char *vappend(const char *format, va_list args);
+    //原样拷贝一段数据到文本分片
+    bool append(const char *data, size_t len);
+    //追加一个零拷贝引用段
+    bool add_ref(const char *base, size_t len);
+
+    //调用一次 writev 发送剩余数据，并推进 iovec 游标；返回值与 writev 相同
+    ssize_t write(int fd);
+
+    size_t bytes_to_send() const { return m_bytes_to_send; }
+    size_t bytes_have_send() const { return m_bytes_have_send; }
+    int segment_count() const { return m_iv_count; }
+
+private:
+    //分片头，紧接着就是数据区
+    struct slice
+    {
+        slice *next;
+        size_t cap; //数据区容量
+        size_t len; //数据区已用长度
+    };
+
+    static char *slice_data(slice *s) { return (char *)(s + 1); }
+
+    bool new_slice(size_t need);
+    bool push_iov(char *base, size_t len);
+    bool commit_text(char *dst, size_t len);
+
+private:
+    slice *m_head;          //文本分片链表
+    slice *m_tail;
+    struct iovec *m_iov;    //各段按顺序组成的 iovec 数组
+    int m_iv_count;         //iovec 数组中已用的个数
+    int m_iv_cap;           //iovec 数组容量
+    int m_iv_pos;           //第一个尚未发送完的 iovec 下标
+    size_t m_text_size;     //文本段总长度
+    size_t m_bytes_to_send; //剩余发送字节数
+    size_t m_bytes_have_send;//已发送字节数
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include "session_store.h"
+
+static const char HEX[] = "0123456789abcdef";
+
+static void to_hex(const unsigned char *data, int len, char *out)
+{
+    for (int i = 0; i < len; ++i)
+    {
+        out[2 * i] = HEX[data[i] >> 4];
+        out[2 * i + 1] = HEX[data[i] & 0xf];
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+//解析len个十六进制字符为len/2个字节，含非法字符时返回false
+static bool from_hex(const char *in, int len, unsigned char *out)
+{
+    for (int i = 0; i < len; i += 2)
+    {
+        int hi = hex_value(in[i]), lo = hex_value(in[i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        out[i / 2] = (unsigned char)(hi << 4 | lo);
+    }
+    return true;
+}
+
+session_store::session_store() : m_ttl(0)
+{
+    memset(m_key, 0, sizeof(m_key));
+}
+
+bool session_store::init(int ttl)
+{
+    m_ttl = ttl > 0 ? ttl : 0;
+    if (!enabled())
+        return true;
+    //密钥取不到足够的随机数时不启用会话，否则令牌可以被伪造
+    if (RAND_bytes(m_key, KEY_LEN) != 1)
+    {
+        m_ttl = 0;
+        return false;
+    }
+    return true;
+}
+
+void session_store::sign(uint32_t id, uint64_t nonce, unsigned char *mac)
+{
+    unsigned char data[12];
+    memcpy(data, &id, 4);
+    memcpy(data + 4, &nonce, 8);
+    unsigned char full[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    HMAC(EVP_sha256(), m_key, KEY_LEN, data, sizeof(data), full, &len);
+    memcpy(mac, full, MAC_LEN);
+}
+
+uint32_t session_store::create(const char *name)
+{
+    session s;
+    s.expires = time(NULL) + m_ttl;
+    s.name = name;
+    while (true)
+    {
+        uint32_t id;
+        if (RAND_bytes((unsigned char *)&id, sizeof(id)) != 1 ||
+            RAND_bytes((unsigned char *)&s.nonce, sizeof(s.nonce)) != 1)
+            return 0;
+        //0表示没有会话；会话号重复时重新取
+        if (0 == id)
+            continue;
+        shard &sh = shard_of(id);
+        sh.lock.lock();
+        bool inserted = sh.sessions.emplace(id, s).second;
+        sh.lock.unlock();
+        if (inserted)
+            return id;
+    }
+}
+
+bool session_store::token(uint32_t id, char *buf)
+{
+    shard &sh = shard_of(id);
+    sh.lock.lock();
+    std::unordered_map<uint32_t, session>::iterator it = sh.sessions.find(id);
+    bool found = it != sh.sessions.end();
+    uint64_t nonce = found ? it->second.nonce : 0;
+    sh.lock.unlock();
+    if (!found)
+        return false;
+
+    unsigned char raw[12 + MAC_LEN];
+    raw[0] = id >> 24;
+    raw[1] = id >> 16;
+    raw[2] = id >> 8;
+    raw[3] = id;
+    memcpy(raw + 4, &nonce, 8);
+    sign(id, nonce, raw + 12);
+    to_hex(raw, sizeof(raw), buf);
+    buf[TOKEN_LEN] = '\0';
+    return true;
+}
+
+uint32_t session_store::check(const char *token, size_t len)
+{
+    unsigned char raw[12 + MAC_LEN];
+    if (!enabled() || len != (size_t)TOKEN_LEN || !from_hex(token, TOKEN_LEN, raw))
+        return 0;
+    uint32_t id = (uint32_t)raw[0] << 24 | (uint32_t)raw[1] << 16 | (uint32_t)raw[2] << 8 | raw[3];
+    uint64_t nonce;
+    memcpy(&nonce, raw + 4, 8);
+
+    //先验签，伪造或篡改过的令牌不查表
+    unsigned char mac[MAC_LEN];
+    sign(id, nonce, mac);
+    if (CRYPTO_memcmp(mac, raw + 12, MAC_LEN) != 0)
+        return 0;
+
+    shard &sh = shard_of(id);
+    sh.lock.lock();
+    std::unordered_map<uint32_t, session>::iterator it = sh.sessions.find(id);
+    bool valid = it != sh.sessions.end() && it->second.nonce == nonce && it->second.expires > time(NULL);
+    sh.lock.unlock();
+    return valid ? id : 0;
+}
+
+int session_store::expire()
+{
+    if (!enabled())
+        return 0;
+    time_t now = time(NULL);
+    int n = 0;
+    for (int i = 0; i < SHARD_COUNT; ++i)
+    {
+        shard &sh = m_shards[i];
+        sh.lock.lock();
+        std::unordered_map<uint32_t, session>::iterator it = sh.sessions.begin();
+        while (it != sh.sessions.end())
+        {
+            if (it->second.expires <= now)
+            {
+                it = sh.sessions.erase(it);
+                ++n;
+            }
+            else
+                ++it;
+        }
+        sh.lock.unlock();
+    }
+    return n;
+}
@@ -0,0 +1,71 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+//以单例模式实现的登录会话：登录成功后通过Set-Cookie下发令牌，之后的请求凭令牌识别用户，不必再次提交用户名、密码。
+//令牌为“会话号 + 随机数 + HMAC-SHA256(服务器密钥, 会话号 + 随机数)”的十六进制串。
+//校验时先算HMAC，伪造的令牌不必查表即可拒绝；再按会话号在分片哈希表中查找一次，比对随机数和过期时间。
+//会话号可能在会话过期后被复用，随机数保证旧令牌不会认到新会话上。
+//服务器密钥在启动时随机生成，会话只保存在内存中，重启后需要重新登录。过期的会话由定时器定期清理。
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include "../lock/locker.h"
+
+class session_store
+{
+public:
+    static const int SHARD_COUNT = 16;
+    static const int KEY_LEN = 32;
+    static const int MAC_LEN = 16;                    //令牌中保留的HMAC字节数
+    static const int TOKEN_LEN = 8 + 16 + 2 * MAC_LEN; //会话号、随机数、HMAC的十六进制长度之和
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static session_store *get_instance()
+    {
+        static session_store instance;
+        return &instance;
+    }
+
+    //ttl为会话有效期（秒），为0时不启用会话
+    bool init(int ttl);
+    bool enabled() const { return m_ttl > 0; }
+    int ttl() const { return m_ttl; }
+
+    //为name新建会话，返回会话号（非0）
+    uint32_t create(const char *name);
+    //把会话号对应的令牌写入buf（至少TOKEN_LEN + 1字节），会话不存在时返回false
+    bool token(uint32_t id, char *buf);
+    //校验令牌，有效时返回会话号，否则返回0
+    uint32_t check(const char *token, size_t len);
+
+    //定时器调用：删除已过期的会话，返回删除的个数
+    int expire();
+
+private:
+    session_store();
+    ~session_store() {}
+
+    struct session
+    {
+        uint64_t nonce;
+        time_t expires;
+        std::string name;
+    };
+
+    struct shard
+    {
+        locker lock;
+        std::unordered_map<uint32_t, session> sessions;
+    };
+
+    shard &shard_of(uint32_t id) { return m_shards[id % SHARD_COUNT]; }
+    void sign(uint32_t id, uint64_t nonce, unsigned char *mac);
+
+private:
+    int m_ttl;
+    unsigned char m_key[KEY_LEN];
+    shard m_shards[SHARD_COUNT];
+};
+
+#endif
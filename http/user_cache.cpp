@@ -0,0 +1,358 @@
+#include <string.h>
+#include "user_cache.h"
+
+static const size_t INITIAL_SLOTS = 1024; //每个分片初始的槽位数，2的幂
+static const size_t ARENA_CHUNK = 64 * 1024;
+
+user_cache::user_cache()
+{
+    for (int i = 0; i < SHARD_COUNT; ++i)
+    {
+        shard &s = m_shards[i];
+        table *t = new table;
+        t->mask = INITIAL_SLOTS - 1;
+        t->used = 0;
+        t->slots = new slot[INITIAL_SLOTS];
+        for (size_t j = 0; j < INITIAL_SLOTS; ++j)
+        {
+            t->slots[j].hash.store(0, std::memory_order_relaxed);
+            t->slots[j].item.store(NULL, std::memory_order_relaxed);
+        }
+        s.current.store(t, std::memory_order_release);
+        s.arena = NULL;
+        s.arena_left = 0;
+        s.arena_bytes = 0;
+        s.active.store(0, std::memory_order_relaxed);
+    }
+}
+
+user_cache::~user_cache()
+{
+    for (int i = 0; i < SHARD_COUNT; ++i)
+    {
+        shard &s = m_shards[i];
+        s.retired.push_back(s.current.load());
+        for (size_t j = 0; j < s.retired.size(); ++j)
+        {
+            delete[] s.retired[j]->slots;
+            delete s.retired[j];
+        }
+        for (size_t j = 0; j < s.chunks.size(); ++j)
+            delete[] s.chunks[j];
+    }
+}
+
+//FNV-1a，再做一次混合，让低位（槽位下标）和高位（分片号）都足够分散
+uint64_t user_cache::hash_name(const char *name, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+//槽位中保存的哈希值取中间31位（避开分片号），最高位置1，保证非0；低位同时用作槽位下标
+uint32_t user_cache::slot_hash(uint64_t h)
+{
+    return (uint32_t)(h >> 27) | 0x80000000u;
+}
+
+char *user_cache::arena_alloc(shard &s, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    if (size > s.arena_left)
+    {
+        size_t chunk = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        s.arena = new char[chunk];
+        s.arena_left = chunk;
+        s.arena_bytes += chunk;
+        s.chunks.push_back(s.arena);
+    }
+    char *p = s.arena;
+    s.arena += size;
+    s.arena_left -= size;
+    return p;
+}
+
+const char *user_cache::arena_copy(shard &s, const char *str, size_t len)
+{
+    char *p = arena_alloc(s, len + 1);
+    memcpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+
+user_cache::entry *user_cache::find(const table *t, uint32_t tag, const char *name, size_t len)
+{
+    size_t i = tag & t->mask;
+    while (true)
+    {
+        uint32_t h = t->slots[i].hash.load(std::memory_order_acquire);
+        if (0 == h)
+            return NULL;
+        if (h == tag)
+        {
+            entry *e = t->slots[i].item.load(std::memory_order_relaxed);
+            if (e->name_len == len && memcmp(e->name, name, len) == 0)
+                return e;
+        }
+        i = (i + 1) & t->mask;
+    }
+}
+
+//装载率超过70%时容量翻倍：把条目指针搬到新表后一次性发布，旧表留给可能仍在读它的线程
+void user_cache::grow_locked(shard &s)
+{
+    table *old = s.current.load(std::memory_order_relaxed);
+    size_t size = (old->mask + 1) * 2;
+    table *t = new table;
+    t->mask = size - 1;
+    t->used = old->used;
+    t->slots = new slot[size];
+    for (size_t j = 0; j < size; ++j)
+    {
+        t->slots[j].hash.store(0, std::memory_order_relaxed);
+        t->slots[j].item.store(NULL, std::memory_order_relaxed);
+    }
+
+    for (size_t j = 0; j <= old->mask; ++j)
+    {
+        uint32_t h = old->slots[j].hash.load(std::memory_order_relaxed);
+        if (0 == h)
+            continue;
+        size_t i = h & t->mask;
+        while (t->slots[i].hash.load(std::memory_order_relaxed) != 0)
+            i = (i + 1) & t->mask;
+        t->slots[i].item.store(old->slots[j].item.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        t->slots[i].hash.store(h, std::memory_order_relaxed);
+    }
+
+    s.current.store(t, std::memory_order_release);
+    s.retired.push_back(old);
+}
+
+//找到或新建条目，新建的条目状态为RESERVED
+user_cache::entry *user_cache::insert_locked(shard &s, uint64_t h, const char *name, size_t len, bool *created)
+{
+    uint32_t tag = slot_hash(h);
+    table *t = s.current.load(std::memory_order_relaxed);
+    entry *e = find(t, tag, name, len);
+    if (e)
+    {
+        *created = false;
+        return e;
+    }
+
+    if ((t->used + 1) * 10 > (t->mask + 1) * 7)
+    {
+        grow_locked(s);
+        t = s.current.load(std::memory_order_relaxed);
+    }
+
+    e = (entry *)arena_alloc(s, sizeof(entry));
+    e->name = arena_copy(s, name, len);
+    e->name_len = len;
+    e->state.store(STATE_RESERVED, std::memory_order_relaxed);
+    e->password.store(NULL, std::memory_order_relaxed);
+
+    //先写条目指针，再以release发布哈希值，读者看到哈希值时条目已经完整
+    size_t i = tag & t->mask;
+    while (t->slots[i].hash.load(std::memory_order_relaxed) != 0)
+        i = (i + 1) & t->mask;
+    t->slots[i].item.store(e, std::memory_order_relaxed);
+    t->slots[i].hash.store(tag, std::memory_order_release);
+    ++t->used;
+    *created = true;
+    return e;
+}
+
+void user_cache::presize(size_t users)
+{
+    size_t per_shard = users / SHARD_COUNT + 1;
+    for (int i = 0; i < SHARD_COUNT; ++i)
+    {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        while ((s.current.load(std::memory_order_relaxed)->mask + 1) * 7 < per_shard * 10)
+            grow_locked(s);
+        s.lock.unlock();
+    }
+}
+
+void user_cache::put(const char *name, const char *password)
+{
+    size_t len = strlen(name);
+    uint64_t h = hash_name(name, len);
+    shard &s = shard_of(h);
+
+    s.lock.lock();
+    bool created;
+    entry *e = insert_locked(s, h, name, len, &created);
+    e->password.store(arena_copy(s, password, strlen(password)), std::memory_order_release);
+    //快照中已有的用户只是被覆盖，不重复计数
+    if (e->state.load(std::memory_order_relaxed) != STATE_ACTIVE && !m_base.find(slot_hash(h), name, len))
+        s.active.fetch_add(1, std::memory_order_relaxed);
+    e->state.store(STATE_ACTIVE, std::memory_order_release);
+    s.lock.unlock();
+}
+
+bool user_cache::check(const char *name, const char *password) const
+{
+    size_t len = strlen(name);
+    uint64_t h = hash_name(name, len);
+    const table *t = shard_of(h).current.load(std::memory_order_acquire);
+    uint32_t tag = slot_hash(h);
+    entry *e = find(t, tag, name, len);
+    const char *stored;
+    if (e && e->state.load(std::memory_order_acquire) == STATE_ACTIVE)
+        stored = e->password.load(std::memory_order_acquire);
+    else if (e && e->state.load(std::memory_order_relaxed) == STATE_RESERVED)
+        return false;
+    else
+        stored = m_base.find(tag, name, len);
+    return stored && strcmp(stored, password) == 0;
+}
+
+bool user_cache::contains(const char *name) const
+{
+    size_t len = strlen(name);
+    uint64_t h = hash_name(name, len);
+    const table *t = shard_of(h).current.load(std::memory_order_acquire);
+    uint32_t tag = slot_hash(h);
+    entry *e = find(t, tag, name, len);
+    if (e && e->state.load(std::memory_order_acquire) != STATE_REMOVED)
+        return true;
+    return m_base.find(tag, name, len) != NULL;
+}
+
+bool user_cache::reserve(const char *name)
+{
+    size_t len = strlen(name);
+    uint64_t h = hash_name(name, len);
+    shard &s = shard_of(h);
+    //快照只读，不需要持锁查找
+    if (m_base.find(slot_hash(h), name, len))
+        return false;
+
+    s.lock.lock();
+    bool created;
+    entry *e = insert_locked(s, h, name, len, &created);
+    bool ok = created;
+    //之前注册失败撤销过的名字可以再次占用
+    if (!created && e->state.load(std::memory_order_relaxed) == STATE_REMOVED)
+    {
+        e->state.store(STATE_RESERVED, std::memory_order_release);
+        ok = true;
+    }
+    s.lock.unlock();
+    return ok;
+}
+
+void user_cache::commit(const char *name, const char *password)
+{
+    size_t len = strlen(name);
+    uint64_t h = hash_name(name, len);
+    shard &s = shard_of(h);
+
+    s.lock.lock();
+    entry *e = find(s.current.load(std::memory_order_relaxed), slot_hash(h), name, len);
+    if (e && e->state.load(std::memory_order_relaxed) == STATE_RESERVED)
+    {
+        e->password.store(arena_copy(s, password, strlen(password)), std::memory_order_release);
+        e->state.store(STATE_ACTIVE, std::memory_order_release);
+        s.active.fetch_add(1, std::memory_order_relaxed);
+    }
+    s.lock.unlock();
+}
+
+void user_cache::cancel(const char *name)
+{
+    size_t len = strlen(name);
+    uint64_t h = hash_name(name, len);
+    shard &s = shard_of(h);
+
+    s.lock.lock();
+    entry *e = find(s.current.load(std::memory_order_relaxed), slot_hash(h), name, len);
+    if (e && e->state.load(std::memory_order_relaxed) == STATE_RESERVED)
+        e->state.store(STATE_REMOVED, std::memory_order_release);
+    s.lock.unlock();
+}
+
+bool user_cache::attach_snapshot(const char *path, const char *db_name)
+{
+    return m_base.open(path, db_name);
+}
+
+void user_cache::detach_snapshot()
+{
+    m_base.close();
+}
+
+bool user_cache::save_snapshot(const char *path, const char *db_name, long long max_id)
+{
+    //条目和字符串在分片内存区中不会释放，快照一直映射着，收集指针后不必持锁写文件
+    std::vector<user_snapshot::record> records;
+    records.reserve(size());
+    for (int i = 0; i < SHARD_COUNT; ++i)
+    {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        const table *t = s.current.load(std::memory_order_relaxed);
+        for (size_t j = 0; j <= t->mask; ++j)
+        {
+            uint32_t tag = t->slots[j].hash.load(std::memory_order_relaxed);
+            if (0 == tag)
+                continue;
+            entry *e = t->slots[j].item.load(std::memory_order_relaxed);
+            if (e->state.load(std::memory_order_relaxed) != STATE_ACTIVE)
+                continue;
+            user_snapshot::record r = {tag, e->name, e->name_len, e->password.load(std::memory_order_relaxed)};
+            records.push_back(r);
+        }
+        s.lock.unlock();
+    }
+
+    //快照中被分片覆盖的用户以分片为准
+    for (uint64_t i = 0; i < m_base.slot_count(); ++i)
+    {
+        user_snapshot::record r;
+        if (!m_base.at(i, &r))
+            continue;
+        const table *t = shard_of(hash_name(r.name, r.name_len)).current.load(std::memory_order_acquire);
+        entry *e = find(t, r.tag, r.name, r.name_len);
+        if (!e || e->state.load(std::memory_order_acquire) != STATE_ACTIVE)
+            records.push_back(r);
+    }
+
+    return user_snapshot::write(path, db_name, max_id, records.empty() ? NULL : &records[0], records.size());
+}
+
+size_t user_cache::size() const
+{
+    size_t total = m_base.count();
+    for (int i = 0; i < SHARD_COUNT; ++i)
+        total += m_shards[i].active.load(std::memory_order_relaxed);
+    return total;
+}
+
+size_t user_cache::memory_bytes() const
+{
+    size_t total = 0;
+    for (int i = 0; i < SHARD_COUNT; ++i)
+    {
+        shard &s = const_cast<shard &>(m_shards[i]);
+        s.lock.lock();
+        total += s.arena_bytes;
+        total += (s.current.load(std::memory_order_relaxed)->mask + 1) * sizeof(slot);
+        for (size_t j = 0; j < s.retired.size(); ++j)
+            total += (s.retired[j]->mask + 1) * sizeof(slot);
+        s.lock.unlock();
+    }
+    return total;
+}
@@ -0,0 +1,126 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+//以单例模式实现的用户名、密码缓存，替代原来的全局 map<string,string> users。
+//按用户名的哈希值分成 SHARD_COUNT 个分片，每个分片是一张开放寻址（线性探测）的哈希表，写入时只锁本分片；
+//查找不加锁：槽位中的哈希值和条目指针都是原子变量，写者先填好条目再发布哈希值，
+//扩容时换上新表，旧表和所有字符串、条目都不释放（留在分片的内存区中），正在读旧表的线程不会访问到已释放的内存。
+//可以挂上一个只读的快照（user_snapshot）作为底层：分片中没有的用户再到快照中查找，分片中的条目优先。
+//注册时先原子地占住用户名（RESERVED），数据库插入成功后再写入密码，失败则撤销，避免两个请求同时注册同一个名字。
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "../lock/locker.h"
+#include "user_snapshot.h"
+
+class user_cache
+{
+public:
+    static const int SHARD_BITS = 6;
+    static const int SHARD_COUNT = 1 << SHARD_BITS;
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static user_cache *get_instance()
+    {
+        static user_cache instance;
+        return &instance;
+    }
+
+    //批量载入前按预计的用户数一次扩好各分片，避免载入过程中反复扩容
+    void presize(size_t users);
+    //载入已存在的用户，同名时以后来的为准
+    void put(const char *name, const char *password);
+
+    //登录校验：用户存在且密码一致时返回true
+    bool check(const char *name, const char *password) const;
+    //用户名是否已被使用（含正在注册中的）
+    bool contains(const char *name) const;
+
+    //注册第一步：占住用户名，已被使用时返回false
+    bool reserve(const char *name);
+    //注册成功，写入密码，之后才能登录
+    void commit(const char *name, const char *password);
+    //注册失败，释放占住的用户名
+    void cancel(const char *name);
+
+    //映射快照文件作为底层，只能在开始处理请求之前调用
+    bool attach_snapshot(const char *path, const char *db_name);
+    void detach_snapshot();
+    //快照覆盖到的最大id，没有快照时为0
+    long long snapshot_max_id() const { return m_base.max_id(); }
+    //把分片与快照中的全部用户写成新快照，max_id为数据库中已全部载入的最大id
+    bool save_snapshot(const char *path, const char *db_name, long long max_id);
+
+    //已有的用户数（不含注册中的）
+    size_t size() const;
+    //所有分片占用的内存，含已换下的旧表
+    size_t memory_bytes() const;
+
+private:
+    user_cache();
+    ~user_cache();
+
+    enum entry_state
+    {
+        STATE_RESERVED = 0,
+        STATE_ACTIVE,
+        STATE_REMOVED
+    };
+
+    //条目一旦发布，name不再改变；state与password可能被写者修改，读者按state（acquire）再读password
+    struct entry
+    {
+        const char *name;
+        uint32_t name_len;
+        std::atomic<int> state;
+        std::atomic<const char *> password;
+    };
+
+    //槽位：hash为0表示空槽，读者先比较哈希值，相同时再访问条目
+    struct slot
+    {
+        std::atomic<uint32_t> hash;
+        std::atomic<entry *> item;
+    };
+
+    struct table
+    {
+        size_t mask;
+        size_t used;  //已占用的槽位数，只由持锁的写者读写
+        slot *slots;
+    };
+
+    struct shard
+    {
+        std::atomic<table *> current;
+        std::vector<table *> retired; //扩容换下的旧表
+        locker lock;
+        //只增不减的内存区，存放条目和字符串，按块申请，析构时一并释放
+        std::vector<char *> chunks;
+        char *arena;
+        size_t arena_left;
+        size_t arena_bytes;
+        std::atomic<size_t> active;
+        char pad[64];
+    };
+
+    static uint64_t hash_name(const char *name, size_t len);
+    static uint32_t slot_hash(uint64_t h);
+    shard &shard_of(uint64_t h) { return m_shards[h >> (64 - SHARD_BITS)]; }
+    const shard &shard_of(uint64_t h) const { return m_shards[h >> (64 - SHARD_BITS)]; }
+
+    //以下函数调用者持有分片的锁
+    char *arena_alloc(shard &s, size_t size);
+    const char *arena_copy(shard &s, const char *str, size_t len);
+    entry *insert_locked(shard &s, uint64_t h, const char *name, size_t len, bool *created);
+    void grow_locked(shard &s);
+
+    static entry *find(const table *t, uint32_t tag, const char *name, size_t len);
+
+private:
+    shard m_shards[SHARD_COUNT];
+    user_snapshot m_base;
+};
+
+#endif
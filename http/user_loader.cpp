@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "user_loader.h"
+#include "user_cache.h"
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+user_loader::user_loader()
+    : m_pool(NULL), m_ranged(false), m_min_id(0), m_max_id(0), m_chunks(0), m_next_chunk(0), m_running(0),
+      m_rows(0), m_loaded(false), m_stop(false), m_failed(false), m_thread_count(0), m_high_water(0), m_saved_users(0),
+      m_start_us(0), m_close_log(0)
+{
+    m_snapshot_path[0] = '\0';
+    m_db_name[0] = '\0';
+}
+
+void user_loader::set_snapshot(const char *path, const char *db_name)
+{
+    snprintf(m_snapshot_path, sizeof(m_snapshot_path), "%s", path);
+    snprintf(m_db_name, sizeof(m_db_name), "%s", db_name);
+}
+
+bool user_loader::start(connection_pool *pool, int threads)
+{
+    m_pool = pool;
+    m_close_log = pool->m_close_log;
+    m_start_us = now_us();
+    if (threads <= 0)
+        threads = pool->GetMaxConn() / 2;
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    //有快照时先映射快照，数据库中只需读取高水位之后的行。
+    //上次扫描时可能有事务已经分到了比高水位小的id却还没有提交，这些行不在快照中，
+    //所以在高水位之下留出一段重新读取；已在快照中的行再放入缓存一次不影响结果
+    user_cache *cache = user_cache::get_instance();
+    long long snapshot_max = 0;
+    long long after = 0;
+    if (m_snapshot_path[0] && cache->attach_snapshot(m_snapshot_path, m_db_name))
+    {
+        snapshot_max = cache->snapshot_max_id();
+        after = snapshot_max > RESCAN_WINDOW ? snapshot_max - RESCAN_WINDOW : 0;
+        LOG_INFO("mapped user snapshot %s: %zu users up to id %lld", m_snapshot_path, cache->size(), snapshot_max);
+    }
+
+    //先取id范围和行数：按范围切分区间，并按行数预先扩好user_cache
+    {
+        MYSQL *mysql = NULL;
+        connectionRAII mysqlcon(&mysql, pool);
+        //取不到连接时不载入，缓存未命中的用户继续按用户名单独查询
+        if (!mysql)
+        {
+            LOG_ERROR("no MySQL connection, user table not loaded");
+            m_failed.store(true);
+            return false;
+        }
+        long long count = 0, table_max = 0;
+        int ret = query_range(mysql, after, &count, &table_max);
+        //表中最大id比快照的高水位还小，说明表被清空或重建过，快照作废
+        if (ret == 0 && snapshot_max > 0 && table_max < snapshot_max)
+        {
+            LOG_WARN("user snapshot is newer than the user table, reloading all users");
+            cache->detach_snapshot();
+            snapshot_max = 0;
+            after = 0;
+            ret = query_range(mysql, after, &count, &table_max);
+        }
+
+        if (ret == 0)
+        {
+            m_ranged = true;
+            m_high_water = snapshot_max;
+            //要读取的范围内没有行（空表），不需要载入
+            if (0 == count)
+            {
+                m_saved_users = cache->size();
+                m_loaded.store(true, std::memory_order_release);
+                return true;
+            }
+            cache->presize(count);
+        }
+        else
+        {
+            LOG_WARN("user table has no id column, loading with a single scan: %s", mysql_error(mysql));
+            //没有id就无法只补读新行，快照也不能用
+            cache->detach_snapshot();
+            threads = 1;
+        }
+    }
+
+    m_chunks = m_ranged ? threads * CHUNKS_PER_THREAD : 1;
+    m_running.store(threads);
+    for (int i = 0; i < threads; ++i)
+    {
+        //线程没有创建成功时，在当前线程中领取区间读取
+        if (pthread_create(&m_threads[m_thread_count], NULL, worker, this) != 0)
+            run();
+        else
+            ++m_thread_count;
+    }
+    return true;
+}
+
+//取id大于after的行的id范围和行数，以及整张表的最大id；没有id列时返回-1
+int user_loader::query_range(MYSQL *conn, long long after, long long *count, long long *table_max)
+{
+    char sql[256];
+    snprintf(sql, sizeof(sql),
+             "SELECT MIN(id), MAX(id), COUNT(*), (SELECT MAX(id) FROM user) FROM user WHERE id > %lld", after);
+    if (mysql_query(conn, sql))
+        return -1;
+    MYSQL_RES *result = mysql_store_result(conn);
+    if (!result)
+        return -1;
+    MYSQL_ROW row = mysql_fetch_row(result);
+    *count = 0;
+    *table_max = 0;
+    if (row && row[0] && row[1] && row[2])
+    {
+        m_min_id = atoll(row[0]);
+        m_max_id = atoll(row[1]);
+        *count = atoll(row[2]);
+    }
+    if (row && row[3])
+        *table_max = atoll(row[3]);
+    mysql_free_result(result);
+    return 0;
+}
+
+void user_loader::stop()
+{
+    m_stop.store(true, std::memory_order_relaxed);
+    for (int i = 0; i < m_thread_count; ++i)
+        pthread_join(m_threads[i], NULL);
+    m_thread_count = 0;
+
+    //退出前把运行期间注册的用户也存进快照，下次启动少读这些行
+    if (loaded() && m_ranged && !m_failed.load() && m_snapshot_path[0] &&
+        user_cache::get_instance()->size() != m_saved_users)
+        save_snapshot();
+}
+
+void user_loader::save_snapshot()
+{
+    uint64_t begin = now_us();
+    user_cache *cache = user_cache::get_instance();
+    size_t users = cache->size();
+    if (cache->save_snapshot(m_snapshot_path, m_db_name, m_high_water))
+    {
+        m_saved_users = users;
+        LOG_INFO("saved user snapshot %s: %zu users up to id %lld in %.3fs", m_snapshot_path, users, m_high_water,
+                 (now_us() - begin) / 1e6);
+    }
+    else
+    {
+        LOG_ERROR("failed to save user snapshot %s", m_snapshot_path);
+    }
+}
+
+void *user_loader::worker(void *arg)
+{
+    ((user_loader *)arg)->run();
+    return NULL;
+}
+
+void user_loader::run()
+{
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_pool);
+    if (!mysql)
+    {
+        LOG_ERROR("no MySQL connection for user loader");
+        m_failed.store(true);
+    }
+
+    int chunk;
+    while (mysql && !m_stop.load(std::memory_order_relaxed) && (chunk = m_next_chunk.fetch_add(1)) < m_chunks)
+    {
+        char sql[256];
+        if (m_ranged)
+        {
+            long long span = m_max_id - m_min_id + 1;
+            long long lo = m_min_id + span * chunk / m_chunks;
+            long long hi = m_min_id + span * (chunk + 1) / m_chunks;
+            snprintf(sql, sizeof(sql), "SELECT username,passwd FROM user WHERE id >= %lld AND id < %lld", lo, hi);
+        }
+        else
+        {
+            snprintf(sql, sizeof(sql), "SELECT username,passwd FROM user");
+        }
+
+        long n = stream_rows(mysql, sql);
+        if (n < 0)
+        {
+            LOG_ERROR("SELECT error:%s", mysql_error(mysql));
+            m_failed.store(true);
+        }
+        else
+        {
+            m_rows.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    if (m_running.fetch_sub(1) == 1)
+        finish();
+}
+
+long user_loader::stream_rows(MYSQL *conn, const char *sql)
+{
+    if (mysql_query(conn, sql))
+        return -1;
+
+    //mysql_use_result不把结果集读到客户端，每次mysql_fetch_row从连接上取一行
+    MYSQL_RES *result = mysql_use_result(conn);
+    if (!result)
+        return -1;
+
+    user_cache *cache = user_cache::get_instance();
+    long n = 0;
+    while (MYSQL_ROW row = mysql_fetch_row(result))
+    {
+        if (m_stop.load(std::memory_order_relaxed))
+            break;
+        if (row[0] && row[1])
+        {
+            cache->put(row[0], row[1]);
+            ++n;
+        }
+    }
+    //读取中途出错时mysql_fetch_row同样返回NULL，需要检查错误码
+    bool ok = 0 == mysql_errno(conn);
+    mysql_free_result(result);
+    return ok ? n : -1;
+}
+
+void user_loader::finish()
+{
+    if (m_stop.load(std::memory_order_relaxed))
+        return;
+    //有区间读取失败时缓存不完整，保持未载入状态：缓存未命中的用户继续按用户名单独查询数据库
+    if (m_failed.load())
+    {
+        LOG_ERROR("user table load incomplete: %ld users loaded, missing users are queried from MySQL", m_rows.load());
+        return;
+    }
+    m_loaded.store(true, std::memory_order_release);
+    LOG_INFO("loaded %ld users in %.3fs", m_rows.load(), (now_us() - m_start_us) / 1e6);
+
+    //各区间都读完整时，高水位推进到本次载入的最大id，写出新快照
+    if (m_ranged)
+    {
+        //重读的一段都在快照高水位之下时，高水位保持不变
+        if (m_max_id > m_high_water)
+            m_high_water = m_max_id;
+        if (m_snapshot_path[0])
+            save_snapshot();
+    }
+}
+
+bool user_loader::query_user(MYSQL *conn, const char *name, const char *password, bool *match)
+{
+    if (match)
+        *match = false;
+
+    size_t len = strlen(name);
+    char escaped[2 * 100 + 1];
+    if (len > 100)
+        return false;
+    mysql_real_escape_string(conn, escaped, name, len);
+
+    char sql[300];
+    snprintf(sql, sizeof(sql), "SELECT passwd FROM user WHERE username = '%s' LIMIT 1", escaped);
+    if (mysql_query(conn, sql))
+    {
+        LOG_ERROR("SELECT error:%s", mysql_error(conn));
+        return false;
+    }
+    MYSQL_RES *result = mysql_store_result(conn);
+    if (!result)
+        return false;
+
+    bool found = false;
+    MYSQL_ROW row = mysql_fetch_row(result);
+    if (row && row[0])
+    {
+        found = true;
+        user_cache::get_instance()->put(name, row[0]);
+        if (match && password)
+            *match = strcmp(row[0], password) == 0;
+    }
+    mysql_free_result(result);
+    return found;
+}
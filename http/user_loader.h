@@ -0,0 +1,79 @@
+#ifndef USER_LOADER_H
+#define USER_LOADER_H
+//以单例模式实现的用户表后台载入：服务器启动时不再等待整张user表读完。
+//按自增主键id把表切成若干区间，几个后台线程各自从连接池取一个连接，用mysql_use_result逐行流式读取，
+//不在客户端缓存整个结果集，读到的行直接放入user_cache。载入完成前，缓存中找不到的用户按用户名单独查询数据库。
+//user表没有id列时（旧的建表语句），退化为一个线程流式读取整张表。
+//设置了快照文件时，启动时先映射快照（见user_snapshot），只读取快照高水位之后的行，以及高水位之下的一小段：
+//自增id在事务中分配、提交顺序不定，扫描时尚未提交的小id行会在下次启动时补上。载入完成和退出时写出新快照。
+
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+#include <mysql/mysql.h>
+#include "../CGImysql/sql_connection_pool.h"
+
+class user_loader
+{
+public:
+    static const int MAX_THREADS = 4;
+    static const int CHUNKS_PER_THREAD = 4; //每个线程平均分到的区间数，先读完的线程继续领取剩下的区间
+    static const int RESCAN_WINDOW = 1000;  //从快照恢复时，在快照高水位之下重新读取的id个数
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static user_loader *get_instance()
+    {
+        static user_loader instance;
+        return &instance;
+    }
+
+    //在start之前调用：使用path处的用户快照，db_name用于确认快照属于同一个数据库
+    void set_snapshot(const char *path, const char *db_name);
+
+    //启动后台载入后立即返回；threads为0时按连接池上限的一半取，至多MAX_THREADS个
+    bool start(connection_pool *pool, int threads = 0);
+    //服务器退出时调用：让载入线程尽快结束并等待它们退出，之后才能销毁连接池和user_cache
+    void stop();
+
+    //user表是否已全部载入user_cache；有区间读取失败时一直为false
+    bool loaded() const { return m_loaded.load(std::memory_order_acquire); }
+
+    //载入完成前缓存未命中时使用：用conn按用户名查询一个用户，找到时放入user_cache。
+    //返回用户是否存在；match非NULL时返回密码是否一致
+    bool query_user(MYSQL *conn, const char *name, const char *password, bool *match);
+
+private:
+    user_loader();
+    ~user_loader() {}
+
+    static void *worker(void *arg);
+    void run();
+    //读取一条SELECT的结果，逐行放入user_cache，返回行数，出错返回-1
+    long stream_rows(MYSQL *conn, const char *sql);
+    int query_range(MYSQL *conn, long long after, long long *count, long long *table_max);
+    void finish();
+    void save_snapshot();
+
+private:
+    connection_pool *m_pool;
+    bool m_ranged;             //是否按id区间并行读取
+    long long m_min_id;
+    long long m_max_id;
+    int m_chunks;
+    std::atomic<int> m_next_chunk;
+    std::atomic<int> m_running;
+    std::atomic<long> m_rows;
+    std::atomic<bool> m_loaded;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_failed; //有区间读取失败，不推进高水位，不写快照
+    pthread_t m_threads[MAX_THREADS];
+    int m_thread_count;
+    char m_snapshot_path[256];
+    char m_db_name[64];
+    long long m_high_water; //user_cache中已完整载入的最大id
+    size_t m_saved_users;   //上次写快照时的用户数
+    uint64_t m_start_us;
+    int m_close_log;
+};
+
+#endif
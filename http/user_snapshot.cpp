@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "user_snapshot.h"
+
+static const char SNAPSHOT_MAGIC[8] = {'T', 'W', 'S', 'U', 'S', 'E', 'R', '\0'};
+
+user_snapshot::user_snapshot()
+    : m_map(NULL), m_map_size(0), m_slots(NULL), m_mask(0), m_arena(NULL), m_arena_bytes(0), m_count(0), m_max_id(0)
+{
+}
+
+user_snapshot::~user_snapshot()
+{
+    close();
+}
+
+bool user_snapshot::open(const char *path, const char *db_name)
+{
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header))
+    {
+        ::close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == map)
+        return false;
+
+    //只校验文件头和各区域的边界，不逐条读取，映射后即可使用
+    const header *h = (const header *)map;
+    uint64_t size = st.st_size;
+    bool ok = memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 && VERSION == h->version &&
+              strncmp(h->db_name, db_name, sizeof(h->db_name)) == 0 &&
+              h->slot_count > 0 && 0 == (h->slot_count & (h->slot_count - 1)) && h->count < h->slot_count &&
+              h->slots_offset >= sizeof(header) && h->slots_offset % 8 == 0 &&
+              h->slots_offset <= size && h->slot_count <= (size - h->slots_offset) / sizeof(disk_slot) &&
+              h->arena_offset >= h->slots_offset + h->slot_count * sizeof(disk_slot) &&
+              h->arena_offset <= size && h->arena_bytes <= size - h->arena_offset;
+    if (!ok)
+    {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    m_map = map;
+    m_map_size = st.st_size;
+    m_slots = (const disk_slot *)((const char *)map + h->slots_offset);
+    m_mask = h->slot_count - 1;
+    m_arena = (const char *)map + h->arena_offset;
+    m_arena_bytes = h->arena_bytes;
+    m_count = h->count;
+    m_max_id = h->max_id;
+    //查找时按哈希跳着访问，预读没有意义
+    madvise(m_map, m_map_size, MADV_RANDOM);
+    return true;
+}
+
+void user_snapshot::close()
+{
+    if (m_map)
+        munmap(m_map, m_map_size);
+    m_map = NULL;
+    m_map_size = 0;
+    m_slots = NULL;
+    m_count = 0;
+    m_max_id = 0;
+}
+
+const char *user_snapshot::find(uint32_t tag, const char *name, size_t len) const
+{
+    if (!m_map)
+        return NULL;
+    uint64_t i = tag & m_mask;
+    //损坏的文件中可能没有空槽位，最多探测一遍全部槽位
+    for (uint64_t probes = 0; probes <= m_mask; ++probes)
+    {
+        const disk_slot &s = m_slots[i];
+        if (0 == s.tag)
+            return NULL;
+        //偏移越界说明文件已损坏，当作未找到
+        if (s.tag == tag && s.name_len == len && s.offset + len + 2 <= m_arena_bytes &&
+            memcmp(m_arena + s.offset, name, len) == 0)
+            return m_arena + s.offset + len + 1;
+        i = (i + 1) & m_mask;
+    }
+    return NULL;
+}
+
+bool user_snapshot::at(uint64_t i, record *r) const
+{
+    const disk_slot &s = m_slots[i];
+    if (0 == s.tag || s.offset + s.name_len + 2 > m_arena_bytes)
+        return false;
+    r->tag = s.tag;
+    r->name = m_arena + s.offset;
+    r->name_len = s.name_len;
+    r->password = m_arena + s.offset + s.name_len + 1;
+    return true;
+}
+
+bool user_snapshot::write(const char *path, const char *db_name, long long max_id, const record *records, size_t n)
+{
+    uint64_t slot_count = 1024;
+    while (slot_count * 7 < (n + 1) * 10)
+        slot_count *= 2;
+
+    header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.version = VERSION;
+    snprintf(h.db_name, sizeof(h.db_name), "%s", db_name);
+    h.max_id = max_id;
+    h.count = n;
+    h.slot_count = slot_count;
+    h.slots_offset = (sizeof(header) + 7) & ~(uint64_t)7;
+    h.arena_offset = h.slots_offset + slot_count * sizeof(disk_slot);
+
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return false;
+
+    //字符串区边写边记录偏移，槽位数组留在内存中，最后连同文件头一起写回文件前部
+    std::vector<disk_slot> slots(slot_count);
+    memset(&slots[0], 0, slot_count * sizeof(disk_slot));
+    bool ok = fseeko(fp, h.arena_offset, SEEK_SET) == 0;
+    uint64_t offset = 0;
+    for (size_t k = 0; ok && k < n; ++k)
+    {
+        const record &r = records[k];
+        size_t pass_len = strlen(r.password);
+        ok = fwrite(r.name, 1, r.name_len + 1, fp) == r.name_len + 1 &&
+             fwrite(r.password, 1, pass_len + 1, fp) == pass_len + 1;
+
+        uint64_t i = r.tag & (slot_count - 1);
+        uint64_t probes = 0;
+        while (slots[i].tag != 0 && ++probes < slot_count)
+            i = (i + 1) & (slot_count - 1);
+        //槽位已满（记录数超过文件头中的count等异常情况），放弃写出
+        if (slots[i].tag != 0)
+        {
+            ok = false;
+            break;
+        }
+        slots[i].tag = r.tag;
+        slots[i].name_len = r.name_len;
+        slots[i].offset = offset;
+        offset += r.name_len + 1 + pass_len + 1;
+    }
+    h.arena_bytes = offset;
+
+    ok = ok && fseeko(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fp) == 1 &&
+         fseeko(fp, h.slots_offset, SEEK_SET) == 0 &&
+         fwrite(&slots[0], sizeof(disk_slot), slot_count, fp) == slot_count;
+    ok = 0 == fflush(fp) && ok && 0 == fsync(fileno(fp));
+    ok = 0 == fclose(fp) && ok;
+    if (ok && rename(tmp, path) == 0)
+        return true;
+    unlink(tmp);
+    return false;
+}
@@ -0,0 +1,77 @@
+#ifndef USER_SNAPSHOT_H
+#define USER_SNAPSHOT_H
+//用户表快照：把user_cache中的全部用户保存成一个可以直接mmap的文件，重启时映射进来即可查找，不必重新扫描数据库。
+//文件布局：文件头 + 开放寻址的槽位数组 + 字符串区。槽位记录哈希标记和用户名在字符串区中的偏移，
+//字符串区中每个用户依次存放"用户名\0密码\0"。文件头记录版本、数据库名和快照覆盖到的最大id（高水位），
+//载入后只需从数据库读取id大于高水位的行。
+
+#include <stddef.h>
+#include <stdint.h>
+
+class user_snapshot
+{
+public:
+    static const uint32_t VERSION = 1;
+
+    //快照中的一个用户，供写快照时使用
+    struct record
+    {
+        uint32_t tag;
+        const char *name;
+        uint32_t name_len;
+        const char *password;
+    };
+
+    user_snapshot();
+    ~user_snapshot();
+
+    //映射快照文件，文件不存在、版本或数据库名不符、结构损坏时返回false
+    bool open(const char *path, const char *db_name);
+    void close();
+
+    //tag为user_cache中的槽位哈希，找到时返回密码，否则返回NULL
+    const char *find(uint32_t tag, const char *name, size_t len) const;
+
+    size_t count() const { return m_count; }
+    uint64_t slot_count() const { return m_map ? m_mask + 1 : 0; }
+    //遍历用：第i个槽位非空时填好r并返回true
+    bool at(uint64_t i, record *r) const;
+    long long max_id() const { return m_max_id; }
+
+    //写入新快照：先写临时文件并fsync，再改名覆盖，写到一半退出不会损坏旧快照
+    static bool write(const char *path, const char *db_name, long long max_id, const record *records, size_t n);
+
+private:
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        char db_name[64];
+        int64_t max_id;
+        uint64_t count;
+        uint64_t slot_count; //2的幂
+        uint64_t slots_offset;
+        uint64_t arena_offset;
+        uint64_t arena_bytes;
+    };
+
+    //tag为0表示空槽
+    struct disk_slot
+    {
+        uint32_t tag;
+        uint32_t name_len;
+        uint64_t offset;
+    };
+
+    void *m_map;
+    size_t m_map_size;
+    const disk_slot *m_slots;
+    uint64_t m_mask;
+    const char *m_arena;
+    uint64_t m_arena_bytes;
+    size_t m_count;
+    long long m_max_id;
+};
+
+#endif
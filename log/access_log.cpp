@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "access_log.h"
+
+//每个线程缓存当前这一秒的时间字段，同一秒内的请求直接复用
+struct access_time_cache
+{
+    time_t sec;
+    int len;
+    char text[40];
+};
+static thread_local access_time_cache t_access_time = {-1, 0, {0}};
+
+access_log::access_log() : m_fp(NULL), m_stream(-1), m_max_size(0), m_size(0), m_enabled(false)
+{
+    m_file_name[0] = '\0';
+}
+
+access_log::~access_log()
+{
+    //先让刷盘线程写空缓冲区，再关闭文件
+    m_writer.stop();
+    if (m_fp)
+        fclose(m_fp);
+}
+
+bool access_log::init(const char *file_name, int ring_size, long max_size, bool block_on_full, int flush_interval_ms)
+{
+    if (m_enabled)
+        return true;
+    snprintf(m_file_name, sizeof(m_file_name), "%s", file_name);
+    m_max_size = max_size > 0 ? max_size : 0;
+
+    //备用文件为".AccessLog.next"，已切分的文件为"AccessLog.年月日-时分秒"
+    char dir[256], standby[300], pattern[300];
+    const char *base = strrchr(m_file_name, '/');
+    base = base ? base + 1 : m_file_name;
+    snprintf(dir, sizeof(dir), "%.*s", (int)(base - m_file_name), m_file_name);
+    snprintf(standby, sizeof(standby), ".%s.next", base);
+    snprintf(pattern, sizeof(pattern), "%s.[0-9]*", base);
+    m_stream = log_archiver::get_instance()->add_stream(dir, standby, pattern);
+
+    m_fp = log_archiver::get_instance()->open_next(m_stream, m_file_name);
+    if (!m_fp)
+        return false;
+    struct stat st;
+    m_size = fstat(fileno(m_fp), &st) == 0 ? st.st_size : 0;
+    if (!m_writer.start(ring_size, MAX_RECORD, block_on_full, flush_interval_ms, 0, prepare_batch, this))
+        return false;
+    m_enabled = true;
+    return true;
+}
+
+//当前文件改名为"文件名.年月日-时分秒"，同一秒内多次切分时再追加序号
+void access_log::rotate()
+{
+    time_t t = time(NULL);
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &my_tm);
+
+    char target[300];
+    snprintf(target, sizeof(target), "%s.%s", m_file_name, stamp);
+    for (int i = 1; access(target, F_OK) == 0 && i < 1000; ++i)
+        snprintf(target, sizeof(target), "%s.%s.%d", m_file_name, stamp, i);
+
+    //改名后旧文件描述符仍指向它，交给log_archiver关闭、压缩；再把备用文件改名为原文件名换上
+    if (rename(m_file_name, target) != 0)
+        return;
+    FILE *old = m_fp;
+    m_fp = log_archiver::get_instance()->open_next(m_stream, m_file_name);
+    log_archiver::get_instance()->retire(m_stream, old, target);
+    m_size = 0;
+    struct stat st;
+    if (m_fp && fstat(fileno(m_fp), &st) == 0)
+        m_size = st.st_size;
+}
+
+int access_log::prepare_batch(void *arg, const struct iovec *, int, size_t bytes)
+{
+    return ((access_log *)arg)->prepare(bytes);
+}
+
+//只在刷盘线程中调用，按批次判断是否需要切分，一批日志总是整体写进同一个文件
+int access_log::prepare(size_t bytes)
+{
+    if (m_max_size > 0 && m_size > 0 && m_size + (long)bytes > m_max_size)
+        rotate();
+    if (!m_fp)
+        return -1;
+    m_size += bytes;
+    return fileno(m_fp);
+}
+
+//拷贝一个引号内的字段：引号、反斜杠和控制字符转义为\xHH，空字段记为"-"，返回写入的字节数
+static size_t copy_escaped(char *dst, size_t room, const char *src)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    if (!src || !*src)
+        src = "-";
+
+    size_t n = 0;
+    for (; *src && n + 4 <= room; ++src)
+    {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\' || c < 0x20 || c == 0x7f)
+        {
+            dst[n++] = '\\';
+            dst[n++] = 'x';
+            dst[n++] = hex[c >> 4];
+            dst[n++] = hex[c & 0xf];
+        }
+        else
+        {
+            dst[n++] = c;
+        }
+    }
+    return n;
+}
+
+void access_log::write(const sockaddr_in &addr, const char *method, const char *url, const char *version,
+                       int status, size_t bytes, const char *referer, const char *agent, uint64_t duration_us,
+                       unsigned int reuse)
+{
+    if (!m_enabled)
+        return;
+
+    access_time_cache &tc = t_access_time;
+    time_t now = time(NULL);
+    if (now != tc.sec)
+    {
+        struct tm my_tm;
+        localtime_r(&now, &my_tm);
+        tc.len = strftime(tc.text, sizeof(tc.text), "[%d/%b/%Y:%H:%M:%S %z]", &my_tm);
+        tc.sec = now;
+    }
+
+    char *buf = m_writer.begin();
+    if (!buf)
+        return;
+
+    //定长部分与两个数字尾巴最多占用约150字节，其余空间留给引号内的字段
+    const size_t tail_room = 160;
+    char *p = buf;
+    char *limit = buf + MAX_RECORD - tail_room;
+
+    char ip[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)))
+        strcpy(ip, "-");
+    p += sprintf(p, "%s - - ", ip);
+    memcpy(p, tc.text, tc.len);
+    p += tc.len;
+
+    memcpy(p, " \"", 2);
+    p += 2;
+    p += copy_escaped(p, 16, method);
+    *p++ = ' ';
+    p += copy_escaped(p, (limit - p) / 3, url);
+    *p++ = ' ';
+    p += copy_escaped(p, 16, version);
+    p += sprintf(p, "\" %d %zu \"", status, bytes);
+    p += copy_escaped(p, (limit - p) / 2, referer);
+    memcpy(p, "\" \"", 3);
+    p += 3;
+    p += copy_escaped(p, limit - p, agent);
+    p += sprintf(p, "\" %llu.%06llu %u\n", (unsigned long long)(duration_us / 1000000),
+                 (unsigned long long)(duration_us % 1000000), reuse);
+
+    m_writer.commit(p - buf);
+}
@@ -0,0 +1,58 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+//以单例模式实现的访问日志：每个响应发送完毕后记录一行，与调试日志Log相互独立。
+//格式为combined格式后加两列：请求耗时（秒，精确到微秒）与该请求在长连接上的复用序号（0为连接上的第一个请求）
+//  127.0.0.1 - - [18/Jun/2023:10:00:00 +0800] "GET /judge.html HTTP/1.1" 200 612 "-" "curl/7.88.1" 0.000153 0
+//写入走log_writer：各线程格式化进自己的环形缓冲区，刷盘线程批量writev；文件超过设定大小时由刷盘线程切分，
+//切分时换上log_archiver预先创建的备用文件，旧文件由它在后台关闭、压缩。
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include "log_writer.h"
+#include "log_archiver.h"
+
+class access_log
+{
+public:
+    static const int MAX_RECORD = 4096; //单条访问日志的最大长度，超长的字段被截断
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static access_log *get_instance()
+    {
+        static access_log instance;
+        return &instance;
+    }
+
+    //file_name为当前写入的文件，超过max_size字节后改名为"file_name.年月日-时分秒"并重新打开；max_size为0表示不切分
+    bool init(const char *file_name, int ring_size, long max_size, bool block_on_full, int flush_interval_ms);
+
+    bool enabled() const { return m_enabled; }
+
+    //记录一个已发送完毕的响应；method、url、version、referer、agent可以为NULL，记为"-"
+    void write(const sockaddr_in &addr, const char *method, const char *url, const char *version, int status,
+               size_t bytes, const char *referer, const char *agent, uint64_t duration_us, unsigned int reuse);
+
+    uint64_t dropped_lines() const { return m_writer.dropped(); }
+
+private:
+    access_log();
+    ~access_log();
+
+    static int prepare_batch(void *arg, const struct iovec *, int, size_t bytes);
+    int prepare(size_t bytes);
+    void rotate();
+
+private:
+    log_writer m_writer;
+    char m_file_name[256];
+    FILE *m_fp;        //只用它的文件描述符写入，不经过FILE缓冲区
+    int m_stream;      //在log_archiver中登记的编号
+    long m_max_size;   //切分阈值
+    long m_size;       //当前文件大小
+    bool m_enabled;
+};
+
+#endif
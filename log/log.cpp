@@ -1,53 +1,131 @@
 #include <string.h>
 #include <time.h>
-#include <sys/time.h>
 #include <stdarg.h>
 #include "log.h"
 #include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
 using namespace std;
 
+//同步模式下每个线程格式化日志用的私有缓冲区，避免所有线程争用同一块m_buf
+struct line_buffer
+{
+    char *buf;
+    int size;
+    line_buffer() : buf(NULL), size(0) {}
+    ~line_buffer() { delete[] buf; }
+    char *get(int need)
+    {
+        if (size < need)
+        {
+            delete[] buf;
+            buf = new char[need];
+            size = need;
+        }
+        return buf;
+    }
+};
+static thread_local line_buffer t_line;
+
+//每个线程缓存当前这一秒格式化好的"年-月-日 时:分:秒."前缀，sec为0表示尚未缓存
+struct time_cache
+{
+    time_t sec;
+    struct tm tm;
+    char text[32];
+    int len;
+};
+static thread_local time_cache t_time;
+
+struct level_tag
+{
+    const char *text;
+    int len;
+};
+static const level_tag level_tags[] = {{"[debug]:", 8}, {"[info]:", 7}, {"[warn]:", 7}, {"[erro]:", 7}};
+
+int Log::m_min_level = 0;
+int Log::m_sample_rate = 1;
+
 Log::Log()
 {
     m_count = 0;
+    m_split_bytes = 0;
+    m_file_size = 0;
+    m_part = 0;
+    m_stream = -1;
+    m_path[0] = '\0';
     m_is_async = false;
+    m_fp = NULL;
+    m_reported_drops = 0;
+    m_flush_interval_ms = 1000;
+    m_flush_bytes = 65536;
+    m_unflushed = 0;
+    m_sync_error = false;
+    m_flush_started = false;
+    m_flush_stop = false;
+    m_binary = false;
+    m_site_count = 0;
+    m_text_site = -1;
+    m_drop_site = -1;
+    m_defined = 0;
+    m_need_magic = false;
+    m_anchor_ts = 0;
+    m_next_day = 0;
 }
 
 Log::~Log()
 {
+    //停止定时刷新线程，先让刷盘线程写完所有缓冲区，再关闭文件（fclose会刷新用户态缓冲区）
+    if (m_flush_started)
+    {
+        m_mutex.lock();
+        m_flush_stop = true;
+        m_flush_cond.signal();
+        m_mutex.unlock();
+        pthread_join(m_flush_tid, NULL);
+    }
+    m_writer.stop();
     if (m_fp != NULL)
     {
         fclose(m_fp);
     }
 }
-//写入方式通过初始化时是否设置队列大小（表示在队列中可以放几条数据）来判断，若队列大小为0，则为同步，否则为异步。
-//异步需要设置阻塞队列的长度，同步不需要设置
-bool Log::init(const char *file_name, int close_log, int log_buf_size, int split_lines, int max_queue_size)
+//写入方式通过初始化时是否设置环形缓冲区大小来判断，若为0，则为同步，否则为异步。
+//异步需要设置每个线程的环形缓冲区大小，同步不需要设置
+bool Log::init(const char *file_name, int close_log, int log_buf_size, int split_lines, int ring_size, bool block_on_full,
+               int flush_interval_ms, int flush_bytes, bool sync_error, bool binary, long split_bytes)
 {
-    //如果设置了max_queue_size,则设置为异步写日志
-    if (max_queue_size >= 1)
+    //二进制模式的文件名加.bin后缀，与文本日志区分开
+    m_binary = binary;
+    char name[256] = {0};
+    snprintf(name, 255, "%s%s", file_name, binary ? ".bin" : "");
+    file_name = name;
+    if (m_binary)
     {
-        //设置写入方式flag
-        m_is_async = true;
-
-        //创建并设置阻塞队列长度
-        m_log_queue = new block_queue<string>(max_queue_size);
-        pthread_t tid;
-        //flush_log_thread为回调函数,这里表示创建一个线程以异步的方式写日志
-        pthread_create(&tid, NULL, flush_log_thread, NULL);
+        m_site_lock.lock();
+        m_text_site = add_site("%s", 1);
+        m_drop_site = add_site("%llu log lines dropped, log buffer full", 2);
+        m_site_lock.unlock();
     }
-    
+
+    m_flush_interval_ms = flush_interval_ms > 0 ? flush_interval_ms : 1000;
+    m_flush_bytes = flush_bytes > 0 ? flush_bytes : 1;
+    m_sync_error = sync_error;
+
     //输出内容的长度
     m_close_log = close_log;
-    m_log_buf_size = log_buf_size;
-    m_buf = new char[m_log_buf_size];
-    memset(m_buf, '\0', m_log_buf_size);
+    //至少要能放下48字节的时间前缀；二进制模式下要能放下记录头和16个定长参数
+    m_log_buf_size = log_buf_size < 256 ? 256 : log_buf_size;
 
-    //日志的最大行数
+    //日志的最大行数与最大字节数
     m_split_lines = split_lines;
+    m_split_bytes = split_bytes > 0 ? split_bytes : 0;
 
     time_t t = time(NULL);
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
 
     //从后往前找到第一个/的位置
     const char *p = strrchr(file_name, '/');
@@ -58,6 +136,8 @@ bool Log::init(const char *file_name, int close_log, int log_buf_size, int split
     if (p == NULL)
     {
         //若没有指定日志输出的文件名，则log_full_name为"年_月_日_ServerLog"
+        snprintf(log_name, sizeof(log_name), "%s", file_name);
+        dir_name[0] = '\0';
         snprintf(log_full_name, 255, "%d_%02d_%02d_%s", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
     }
     else
@@ -73,12 +153,47 @@ bool Log::init(const char *file_name, int close_log, int log_buf_size, int split
     }
 
     m_today = my_tm.tm_mday;
-    
-    m_fp = fopen(log_full_name, "a");
+
+    //登记到log_archiver：备用文件名为".ServerLog.next"，已切分的文件为"年_月_日_ServerLog"和"年_月_日_ServerLog.N"
+    char standby[160], patterns[300];
+    snprintf(standby, sizeof(standby), ".%s.next", log_name);
+    snprintf(patterns, sizeof(patterns), "????_??_??_%s|????_??_??_%s.[0-9]*", log_name, log_name);
+    m_stream = log_archiver::get_instance()->add_stream(dir_name, standby, patterns);
+
+    m_fp = log_archiver::get_instance()->open_next(m_stream, log_full_name);
+    snprintf(m_path, sizeof(m_path), "%s", log_full_name);
     if (m_fp == NULL)
     {
         return false;
     }
+    reset_file_state(my_tm);
+
+    //如果设置了ring_size,则设置为异步写日志
+    if (ring_size >= 1)
+    {
+        //设置写入方式flag
+        m_is_async = true;
+
+        //启动刷盘线程，prepare_batch为刷盘线程每写一批日志前的回调
+        if (!m_writer.start(ring_size, m_log_buf_size, block_on_full, m_flush_interval_ms, m_flush_bytes, prepare_batch, this))
+            return false;
+    }
+    else
+    {
+        //flush_log_thread为回调函数,这里表示创建一个线程定时刷新同步日志
+        if (pthread_create(&m_flush_tid, NULL, flush_log_thread, this) == 0)
+            m_flush_started = true;
+    }
+
+    //段错误、abort等致命信号到来时先把日志写出去
+    struct sigaction sa;
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = crash_handler;
+    sa.sa_flags = SA_RESETHAND;
+    sigfillset(&sa.sa_mask);
+    int fatal[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); ++i)
+        sigaction(fatal[i], &sa, NULL);
 
     return true;
 }
@@ -91,110 +206,540 @@ bool Log::init(const char *file_name, int close_log, int log_buf_size, int split
         若行数超过最大行限制，在当前日志的末尾加count/max_lines为后缀创建新log。
 将系统信息格式化后输出，具体为：格式化时间 + 格式化内容。
 */
-void Log::write_log(int level, const char *format, ...)
+int Log::format_prefix(char *buf, int level, struct tm *my_tm)
 {
-    struct timeval now = {0, 0};
-    gettimeofday(&now, NULL);
-    time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
-    char s[16] = {0};
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    //同一秒内直接复用本线程缓存的日期时间，跨秒时才调用localtime_r（它要取glibc的时区锁）重新格式化
+    time_cache &cache = t_time;
+    if (now.tv_sec != cache.sec)
+    {
+        localtime_r(&now.tv_sec, &cache.tm);
+        //时间格式化，snprintf成功返回写字符的总数，其中不包括结尾的null字符
+        cache.len = snprintf(cache.text, sizeof(cache.text), "%d-%02d-%02d %02d:%02d:%02d.",
+                             cache.tm.tm_year + 1900, cache.tm.tm_mon + 1, cache.tm.tm_mday,
+                             cache.tm.tm_hour, cache.tm.tm_min, cache.tm.tm_sec);
+        cache.sec = now.tv_sec;
+    }
+    //按天切分只看日期，随缓存一起返回，不需要每条日志重新计算
+    *my_tm = cache.tm;
+
+    //写入内容格式：时间 + 内容，每条日志只需填入6位微秒
+    memcpy(buf, cache.text, cache.len);
+    char *p = buf + cache.len;
+    long usec = now.tv_nsec / 1000;
+    for (int i = 5; i >= 0; --i)
+    {
+        p[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+    p += 6;
+    *p++ = ' ';
 
     //日志分级
-    switch (level)
-    {
-    case 0:
-        strcpy(s, "[debug]:");
-        break;
-    case 1:
-        strcpy(s, "[info]:");
-        break;
-    case 2:
-        strcpy(s, "[warn]:");
-        break;
-    case 3:
-        strcpy(s, "[erro]:");
-        break;
-    default:
-        strcpy(s, "[info]:");
-        break;
-    }
-
-//因为全局只有一个Log对象，所以各线程对Log对象的成员变量进行写操作时都要进行上锁解锁的动作。
-    m_mutex.lock();
-    //先上锁，再更新现有行数
-    m_count++;
+    const level_tag &tag = level_tags[(level >= 0 && level <= 3) ? level : 1];
+    memcpy(p, tag.text, tag.len);
+    p += tag.len;
+    *p++ = ' ';
+    return p - buf;
+}
+
+int Log::format_line(char *buf, int level, struct tm *my_tm, const char *format, va_list valst)
+{
+    int n = format_prefix(buf, level, my_tm);
+
+    //内容格式化，最多写到缓冲区倒数第二个字节，最后一个字节留给'\n'；超长时vsnprintf返回的是完整长度，这里按截断后的长度计
+    int room = m_log_buf_size - n - 1;
+    int m = vsnprintf(buf + n, room, format, valst);
+    if (m < 0)
+        m = 0;
+    else if (m >= room)
+        m = room - 1;
+    //vsnprintf写入的'\0'被换行符覆盖，环形缓冲区和文件中都不需要结尾的'\0'
+    buf[n + m] = '\n';
+    return n + m + 1;
+}
+
+//日志不是今天（最近更改m_today的那一天）、写入的日志行数是最大行的倍数或文件超过最大字节数，则更新日志文件名并换上一个新文件
+//新文件由log_archiver预先创建好，这里只需改名；旧文件的关闭、压缩都在它的后台线程中进行
+void Log::rotate(const struct tm &my_tm)
+{
+    char new_log[256] = {0};
+    char tail[16] = {0};
 
-    //日志不是今天（最近更改m_today的那一天）或写入的日志行数是最大行的倍数，则更新日志文件名并打开一个新文件
-    //m_split_lines为最大行数
-    if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0) //everyday log
+    //格式化日志名中的时间部分
+    snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
+
+    //如果是时间不是今天,则创建今天的日志，更新m_today和m_count
+    if (m_today != my_tm.tm_mday)
     {
-        
-        char new_log[256] = {0};
-        fflush(m_fp);
-        fclose(m_fp);
-        char tail[16] = {0};
-       
-        //格式化日志名中的时间部分
-        snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
-        
-        //如果是时间不是今天,则创建今天的日志，更新m_today和m_count
-        if (m_today != my_tm.tm_mday)
-        {
-            snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
-            m_today = my_tm.tm_mday;
-            m_count = 0;
-        }
-        else
-        {   
-            //超过了最大行，在之前的日志名基础上加后缀, m_count/m_split_lines
-            snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
-        }
-        m_fp = fopen(new_log, "a");//打开一个新文件
+        snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
+        m_today = my_tm.tm_mday;
+        m_count = 0;
+        m_part = 0;
     }
- 
-    m_mutex.unlock();
+    else
+    {
+        //超过了最大行或最大字节数，在之前的日志名基础上加后缀, 当天第几个文件
+        snprintf(new_log, 255, "%s%s%s.%d", dir_name, tail, log_name, ++m_part);
+    }
+
+    FILE *old = m_fp;
+    m_fp = log_archiver::get_instance()->open_next(m_stream, new_log);
+    if (old)
+        log_archiver::get_instance()->retire(m_stream, old, m_path);
+    snprintf(m_path, sizeof(m_path), "%s", new_log);
+    reset_file_state(my_tm);
+}
+
+void Log::reset_file_state(const struct tm &my_tm)
+{
+    //二进制模式下每个新文件都要重新写入锚点和全部格式串定义，空文件还要先写魔数
+    m_defined = 0;
+    m_anchor_ts = 0;
+    m_need_magic = false;
+    m_file_size = 0;
+    struct stat st;
+    if (m_fp && fstat(fileno(m_fp), &st) == 0)
+    {
+        m_file_size = st.st_size;
+        m_need_magic = st.st_size == 0;
+    }
+
+    struct tm next = my_tm;
+    next.tm_mday += 1;
+    next.tm_hour = 0;
+    next.tm_min = 0;
+    next.tm_sec = 0;
+    next.tm_isdst = -1;
+    m_next_day = mktime(&next);
+}
 
+void Log::write_log(int level, const char *format, ...)
+{
     va_list valst;
     va_start(valst, format);// va_start宏初始化变量刚定义的va_list变量，使其指向第一个可变参数的地址。
+    vwrite(NULL, level, format, valst);
+    va_end(valst);// va_end宏结束可变参数的获取。
+}
+
+void Log::write_site(log_site *site, int level, const char *format, ...)
+{
+    va_list valst;
+    va_start(valst, format);
+    vwrite(site, level, format, valst);
+    va_end(valst);
+}
+
+int Log::encode(char *buf, int id, int level, struct tm *my_tm, const char *format, va_list valst)
+{
+    if (!m_binary)
+        return format_line(buf, level, my_tm, format, valst);
+    if (id > 0)
+        return format_binary(buf, id, level, valst);
+    return format_binary_text(buf, level, format, valst);
+}
+
+void Log::vwrite(log_site *site, int level, const char *format, va_list valst)
+{
+    struct tm my_tm;
+
+    //二进制模式下第一次执行到某个调用点时登记它的格式串，之后只读一次编号
+    int id = -1;
+    if (m_binary && site)
+    {
+        id = site->id.load(std::memory_order_acquire);
+        if (0 == id)
+            id = register_site(site, level, format);
+    }
+
+    //若m_is_async为true表示异步，默认为同步
+    //若异步,则直接格式化进当前线程的环形缓冲区，缓冲区满且策略为丢弃时begin返回NULL
+    if (m_is_async)
+    {
+        char *buf = m_writer.begin();
+        if (buf)
+            m_writer.commit(encode(buf, id, level, &my_tm, format, valst));
+
+        //ERROR日志等刷盘线程把本线程缓冲区写完再返回
+        if (buf && 3 == level && m_sync_error)
+            m_writer.flush(true);
+        return;
+    }
+
+    //同步则先格式化到线程私有的缓冲区，只在计数、切分和写文件时加锁
+    char *buf = t_line.get(m_log_buf_size);
+    int len = encode(buf, id, level, &my_tm, format, valst);
 
-    string log_str;
     m_mutex.lock();
+    if (m_binary)
+    {
+        //二进制模式不按行切分，过了零点或超过最大字节数才切分；新登记的格式串定义要写在使用它的记录之前
+        time_t t = time(NULL);
+        if (t >= m_next_day || over_size(len))
+        {
+            localtime_r(&t, &my_tm);
+            rotate(my_tm);
+        }
+        write_meta(monotonic_ns());
+    }
+    else
+    {
+        //先上锁，再更新现有行数
+        m_count++;
 
-    //写入内容格式：时间 + 内容
-    //时间格式化，snprintf成功返回写字符的总数，其中不包括结尾的null字符
-    int n = snprintf(m_buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
-                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
-    
-    //内容格式化，用于向字符串中打印数据、数据格式用户自定义，返回写入到字符数组str中的字符个数(不包含终止符)
-    int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
-    m_buf[n + m] = '\n';
-    m_buf[n + m + 1] = '\0';//为什么不是先有'\0'，再有'\n' ？
-    log_str = m_buf;
+        //m_split_lines为最大行数
+        if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0 || over_size(len)) //everyday log
+            rotate(my_tm);
+    }
 
+    if (m_fp)
+    {
+        fwrite(buf, 1, len, m_fp);
+        m_file_size += len;
+        //积压超过阈值或是需要立即落盘的ERROR日志时刷新，其余交给定时刷新线程
+        m_unflushed += len;
+        if (m_unflushed >= m_flush_bytes || (3 == level && m_sync_error))
+        {
+            fflush(m_fp);
+            m_unflushed = 0;
+        }
+    }
     m_mutex.unlock();
+}
 
-    //若m_is_async为true表示异步，默认为同步
-    //若异步,则将日志信息加入阻塞队列,同步则加锁向文件中写
-    if (m_is_async && !m_log_queue->full())
+uint64_t Log::monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int Log::register_site(log_site *site, int level, const char *format)
+{
+    m_site_lock.lock();
+    int id = site->id.load(std::memory_order_relaxed);
+    if (0 == id)
     {
-        m_log_queue->push(log_str);
+        id = add_site(format, level);
+        site->id.store(id, std::memory_order_release);
+    }
+    m_site_lock.unlock();
+    return id;
+}
+
+//调用者持有m_site_lock；先填好定义再发布计数，刷盘线程读到计数时定义已经完整
+int Log::add_site(const char *format, int level)
+{
+    int n = m_site_count.load(std::memory_order_relaxed);
+    if (n >= MAX_SITES || strlen(format) > (size_t)MAX_FORMAT_LEN)
+        return -1;
+
+    site_info &info = m_sites[n];
+    info.nargs = log_parse_format(format, info.types, LOG_MAX_ARGS);
+    if (info.nargs < 0)
+        return -1;
+    info.format = format;
+    info.level = level;
+    m_site_count.store(n + 1, std::memory_order_release);
+    return n + 1;
+}
+
+//按登记时解析出的参数类型从va_list中依次取出参数，原样拷贝进记录，不做任何格式化
+int Log::format_binary(char *buf, int id, int level, va_list valst)
+{
+    const site_info &info = m_sites[id - 1];
+    char *p = buf + sizeof(log_record_head);
+    char *end = buf + m_log_buf_size;
+
+    for (int i = 0; i < info.nargs; ++i)
+    {
+        switch (info.types[i])
+        {
+        case LOG_ARG_INT:
+        {
+            int v = va_arg(valst, int);
+            memcpy(p, &v, 4);
+            p += 4;
+            break;
+        }
+        case LOG_ARG_LONG:
+        {
+            long long v = va_arg(valst, long long);
+            memcpy(p, &v, 8);
+            p += 8;
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            double v = va_arg(valst, double);
+            memcpy(p, &v, 8);
+            p += 8;
+            break;
+        }
+        case LOG_ARG_PTR:
+        {
+            uint64_t v = (uint64_t)(uintptr_t)va_arg(valst, void *);
+            memcpy(p, &v, 8);
+            p += 8;
+            break;
+        }
+        case LOG_ARG_STR:
+        {
+            const char *s = va_arg(valst, const char *);
+            if (!s)
+                s = "(null)";
+            //给后面的参数每个留出最多10字节，字符串超出部分截断
+            long room = (end - p) - 2 - 10L * (info.nargs - i - 1);
+            uint16_t n = room > 0 ? strnlen(s, room) : 0;
+            memcpy(p, &n, 2);
+            memcpy(p + 2, s, n);
+            p += 2 + n;
+            break;
+        }
+        }
+    }
+
+    log_record_head head;
+    head.len = p - buf;
+    head.type = LOG_REC_EVENT;
+    head.level = level;
+    head.id = id;
+    head.ts = monotonic_ns();
+    memcpy(buf, &head, sizeof(head));
+    return head.len;
+}
+
+int Log::format_binary_args(char *buf, int id, int level, ...)
+{
+    va_list valst;
+    va_start(valst, level);
+    int len = format_binary(buf, id, level, valst);
+    va_end(valst);
+    return len;
+}
+
+int Log::format_binary_text(char *buf, int level, const char *format, va_list valst)
+{
+    char *p = buf + sizeof(log_record_head);
+    int room = m_log_buf_size - sizeof(log_record_head) - 2;
+    int m = vsnprintf(p + 2, room, format, valst);
+    if (m < 0)
+        m = 0;
+    else if (m >= room)
+        m = room - 1;
+    uint16_t n = m;
+    memcpy(p, &n, 2);
+
+    log_record_head head;
+    head.len = sizeof(head) + 2 + n;
+    head.type = LOG_REC_EVENT;
+    head.level = level;
+    head.id = m_text_site;
+    head.ts = monotonic_ns();
+    memcpy(buf, &head, sizeof(head));
+    return head.len;
+}
+
+//异步模式下由刷盘线程直接写文件描述符，同步模式下写入FILE缓冲区，与日志记录保持先后顺序
+void Log::meta_out(const void *data, size_t len)
+{
+    m_file_size += len;
+    if (m_is_async)
+    {
+        if (write(fileno(m_fp), data, len) < 0)
+            return;
     }
     else
     {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
+        fwrite(data, 1, len, m_fp);
     }
+}
 
-    va_end(valst);// va_end宏结束可变参数的获取。
+//调用者持有m_mutex（异步模式下为刷盘线程）
+void Log::write_meta(uint64_t now)
+{
+    if (!m_binary || !m_fp)
+        return;
+
+    if (m_need_magic)
+    {
+        meta_out(LOG_BINARY_MAGIC, LOG_MAGIC_LEN);
+        m_need_magic = false;
+    }
+
+    //每秒记录一次单调时钟与墙上时间的对应关系，解码时以最近的锚点换算
+    if (0 == m_anchor_ts || now - m_anchor_ts >= 1000000000ULL)
+    {
+        char rec[sizeof(log_record_head) + 8];
+        struct timespec real;
+        log_record_head head;
+        head.len = sizeof(rec);
+        head.type = LOG_REC_ANCHOR;
+        head.level = 0;
+        head.id = 0;
+        head.ts = monotonic_ns();
+        clock_gettime(CLOCK_REALTIME, &real);
+        uint64_t real_ns = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+        memcpy(rec, &head, sizeof(head));
+        memcpy(rec + sizeof(head), &real_ns, 8);
+        meta_out(rec, sizeof(rec));
+        m_anchor_ts = head.ts;
+    }
+
+    int count = m_site_count.load(std::memory_order_acquire);
+    for (; m_defined < count; ++m_defined)
+    {
+        const site_info &info = m_sites[m_defined];
+        char rec[sizeof(log_record_head) + 1 + LOG_MAX_ARGS + MAX_FORMAT_LEN + 1];
+        char *p = rec + sizeof(log_record_head);
+        *p++ = (char)info.nargs;
+        memcpy(p, info.types, info.nargs);
+        p += info.nargs;
+        size_t n = strlen(info.format) + 1;
+        memcpy(p, info.format, n);
+        p += n;
+
+        log_record_head head;
+        head.len = p - rec;
+        head.type = LOG_REC_DEFINE;
+        head.level = info.level;
+        head.id = m_defined + 1;
+        head.ts = 0;
+        memcpy(rec, &head, sizeof(head));
+        meta_out(rec, head.len);
+    }
+}
+
+int Log::prepare_batch(void *arg, const struct iovec *iov, int count, size_t bytes)
+{
+    return ((Log *)arg)->prepare_async(iov, count, bytes);
+}
+
+//异步模式下由刷盘线程按批统计行数并切分文件，写日志的线程完全不碰m_count和m_fp
+int Log::prepare_async(const struct iovec *iov, int count, size_t bytes)
+{
+    //二进制模式不按行切分，不需要数换行符
+    long long lines = 0;
+    for (int i = 0; i < count && !m_binary; ++i)
+    {
+        const char *p = (const char *)iov[i].iov_base;
+        const char *end = p + iov[i].iov_len;
+        while ((p = (const char *)memchr(p, '\n', end - p)) != NULL)
+        {
+            ++lines;
+            ++p;
+        }
+    }
+
+    time_t t = time(NULL);
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
+
+    m_mutex.lock();
+    //一批日志整体写入同一个文件，跨过最大行数的倍数或将超过最大字节数时，整批写入新文件
+    long long part = m_count / m_split_lines;
+    m_count += lines;
+    if (m_today != my_tm.tm_mday || m_count / m_split_lines != part || over_size(bytes))
+        rotate(my_tm);
+
+    int fd = m_fp ? fileno(m_fp) : -1;
+    m_file_size += bytes;
+
+    //本批记录用到的格式串在读取环形缓冲区之前已经登记，这里先把它们的定义写入文件
+    write_meta(monotonic_ns());
+
+    //缓冲区满时丢弃的日志不会出现在文件中，在这里补一行说明
+    uint64_t dropped = m_writer.dropped();
+    if (fd >= 0 && dropped > m_reported_drops)
+    {
+        char note[128];
+        int n;
+        if (m_binary)
+        {
+            n = format_binary_args(note, m_drop_site, 2, (unsigned long long)(dropped - m_reported_drops));
+        }
+        else
+        {
+            n = format_prefix(note, 2, &my_tm);
+            n += snprintf(note + n, sizeof(note) - n, "%llu log lines dropped, log buffer full\n",
+                          (unsigned long long)(dropped - m_reported_drops));
+        }
+        if (write(fd, note, n) == n)
+        {
+            m_reported_drops = dropped;
+            m_file_size += n;
+        }
+    }
+    m_mutex.unlock();
+    return fd;
 }
 
 void Log::flush(void)
 {
+    //异步模式下日志由刷盘线程直接写入文件描述符，m_fp的用户态缓冲区中没有数据，只需等刷盘线程写完
+    if (m_is_async)
+    {
+        m_writer.flush(false);
+        return;
+    }
     m_mutex.lock();
     //强制刷新写入流缓冲区
-    fflush(m_fp);
+    if (m_fp)
+        fflush(m_fp);
+    m_unflushed = 0;
+    m_mutex.unlock();
+}
+
+void *Log::flush_log_thread(void *args)
+{
+    ((Log *)args)->timed_flush();
+    return NULL;
+}
+
+void Log::timed_flush()
+{
+    m_mutex.lock();
+    while (!m_flush_stop)
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += m_flush_interval_ms / 1000;
+        t.tv_nsec += (m_flush_interval_ms % 1000) * 1000000L;
+        if (t.tv_nsec >= 1000000000L)
+        {
+            t.tv_sec += t.tv_nsec / 1000000000L;
+            t.tv_nsec %= 1000000000L;
+        }
+        //等待期间释放m_mutex，不影响写日志的线程
+        m_flush_cond.timewait(m_mutex.get(), t);
+        if (m_unflushed > 0 && m_fp)
+        {
+            fflush(m_fp);
+            m_unflushed = 0;
+        }
+    }
     m_mutex.unlock();
 }
+
+void Log::crash_handler(int sig)
+{
+    Log::get_instance()->crash_flush();
+    //SA_RESETHAND已经恢复了默认处理方式，处理函数返回后重新投递的信号按默认行为终止进程并生成core
+    raise(sig);
+}
+
+//崩溃的线程可能正持有m_mutex，这里不加锁：异步模式只用writev写出各环形缓冲区，同步模式尽力刷新FILE缓冲区
+void Log::crash_flush()
+{
+    if (!m_fp)
+        return;
+    if (m_is_async)
+    {
+        write_meta(monotonic_ns());
+        m_writer.drain_to(fileno(m_fp));
+    }
+    else
+        fflush(m_fp);
+}
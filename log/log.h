@@ -5,11 +5,30 @@
 #include <iostream>
 #include <string>
 #include <stdarg.h>
+#include <time.h>
 #include <pthread.h>
-#include "block_queue.h"
+#include <stdint.h>
+#include <sys/uio.h>
+#include <atomic>
+#include "log_writer.h"
+#include "log_format.h"
+#include "log_archiver.h"
+#include "../lock/locker.h"
 
 using namespace std;
 
+//编译期日志级别下限：0 DEBUG，1 INFO，2 WARN，3 ERROR，4 全部去掉。
+//低于该级别的日志宏展开为空语句，参数不求值、也不会调用get_instance()，编译时用 make LOG_MIN_LEVEL=2 指定
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+//日志宏的调用点：每个宏展开处有一个静态的log_site，二进制模式下第一次执行时登记格式串并分配编号，之后只比较一次编号
+struct log_site
+{
+    std::atomic<int> id; //0 未登记，-1 格式串不支持二进制记录，按文本记录
+};
+
 class Log
 {
 public:
@@ -20,42 +39,91 @@ public:
         return &instance;
     }
 
-    //异步写日志公有方法，调用私有方法async_write_log
-    static void *flush_log_thread(void *args)
-    {
-        Log::get_instance()->async_write_log();
-    }
-
-    //init函数实现日志创建、写入方式的判断。可选择的参数有日志文件、日志缓冲区大小、最大行数以及最长日志条队列
+    //init函数实现日志创建、写入方式的判断。可选择的参数有日志文件、单条日志最大长度、最大行数、每个线程的环形缓冲区大小、缓冲区满时的处理策略，
+    //以及刷新策略：每隔flush_interval_ms毫秒或积压超过flush_bytes字节时刷新一次，sync_error为true时ERROR日志写完立即刷新
     //init函数只由主线程调用，所以不用考虑多线程安全问题，而write_log函数需要考虑多线程安全问题
-    //若为异步写日志，init函数还会创建一个阻塞队列和一个线程，这个线程会一直等待阻塞队列，然后从中取出一个日志string，写入文件，然后一直如此循环
-    bool init(const char *file_name, int close_log, int log_buf_size = 8192, int split_lines = 5000000, int max_queue_size = 0);
+    //若为异步写日志，init函数还会启动一个刷盘线程，各线程把日志格式化进自己的环形缓冲区，刷盘线程定时收集后批量写入文件
+    //若为同步写日志，init函数会启动一个定时刷新线程，按间隔把FILE的用户态缓冲区刷入文件
+    //binary为true时使用二进制日志格式，文件名加.bin后缀，需用logdecode转换成文本
+    //split_bytes不为0时文件超过该大小也切分；log_archiver已启动时，切分用它预先打开的备用文件，旧文件交给它关闭、压缩
+    bool init(const char *file_name, int close_log, int log_buf_size = 8192, int split_lines = 5000000, int ring_size = 0, bool block_on_full = false,
+              int flush_interval_ms = 1000, int flush_bytes = 65536, bool sync_error = false, bool binary = false, long split_bytes = 0);
  
     //write_log函数完成写入日志文件中的具体内容，主要实现日志分级、分文件、格式化输出内容。将输出内容按照标准格式整理
     //write_log函数需要考虑多线程安全问题
-    //若为异步写日志，write_log则只是将Log对象的成员m_buf中的日志信息放入阻塞队列，然后init函数中创建的线程从阻塞队列中拿出日志消息，然后写入文件
-    //若为同步写日志，write_log则直接将日志写入文件
+    //若为异步写日志，write_log直接把日志格式化进当前线程的环形缓冲区，不加锁，由刷盘线程写入文件
+    //若为同步写日志，write_log先格式化到线程私有的缓冲区，再加锁写入文件
     void write_log(int level, const char *format, ...);
+    //日志宏使用的入口，site为调用点，二进制模式下据此取得格式串编号
+    void write_site(log_site *site, int level, const char *format, ...);
  
-    //强制刷新缓冲区
+    //强制刷新缓冲区，异步模式下等待刷盘线程把调用前提交的日志全部写入文件
     void flush(void);
 
+    //异步模式下因缓冲区满被丢弃的日志条数
+    uint64_t dropped_lines() const { return m_writer.dropped(); }
+
+    //运行时日志级别下限，低于该级别的日志在宏中直接跳过，不求值参数
+    static int m_min_level;
+    //采样宏每隔多少次记录一次，1表示全部记录
+    static int m_sample_rate;
+
+private:
+    static const int MAX_SITES = 4096; //二进制模式下最多登记的格式串个数
+    static const int MAX_FORMAT_LEN = 900; //可登记的格式串最大长度，更长的按文本记录
+
+    //登记过的格式串
+    struct site_info
+    {
+        const char *format;
+        int level;
+        int nargs;
+        char types[LOG_MAX_ARGS];
+    };
+
 private:
     Log();
     virtual ~Log();
 
-    //异步写日志方法
-    void *async_write_log()
-    {
-        string single_log;
-        //从阻塞队列中取出一个日志string，写入文件
-        while (m_log_queue->pop(single_log))
-        {
-            m_mutex.lock();
-            fputs(single_log.c_str(), m_fp);// c_str() 函数可以将 const string* 类型转化为 cons char* 类型,返回的是一个临时指针
-            m_mutex.unlock();
-        }
-    }
+    void vwrite(log_site *site, int level, const char *format, va_list valst);
+    //按当前模式把一条日志写入buf：文本模式为一整行，二进制模式为一条记录（id为-1时先渲染成文本），返回长度
+    int encode(char *buf, int id, int level, struct tm *my_tm, const char *format, va_list valst);
+
+    //二进制模式：登记调用点，返回格式串编号，不支持时返回-1
+    int register_site(log_site *site, int level, const char *format);
+    int add_site(const char *format, int level);
+    //二进制模式：把一条日志编码成LOG_REC_EVENT记录，返回记录长度
+    int format_binary(char *buf, int id, int level, va_list valst);
+    int format_binary_args(char *buf, int id, int level, ...);
+    //二进制模式：格式串不支持时，先渲染成文本再按"%s"记录
+    int format_binary_text(char *buf, int level, const char *format, va_list valst);
+    //二进制模式：在日志之前写入魔数、时间锚点以及尚未写过的格式串定义
+    void write_meta(uint64_t now);
+    void meta_out(const void *data, size_t len);
+    //打开新文件后重置二进制模式的文件状态，并计算下一个零点
+    void reset_file_state(const struct tm &my_tm);
+    static uint64_t monotonic_ns();
+
+    //格式化时间和日志级别前缀，my_tm返回本条日志的时间
+    int format_prefix(char *buf, int level, struct tm *my_tm);
+    //格式化一整行日志（前缀 + 内容 + '\n'），返回总长度，超长的内容被截断
+    int format_line(char *buf, int level, struct tm *my_tm, const char *format, va_list valst);
+    //按天、按行或按大小切分，换上新文件并把旧文件交给log_archiver，调用者持有m_mutex
+    void rotate(const struct tm &my_tm);
+    //再写入len字节是否超过切分大小
+    bool over_size(size_t len) const { return m_split_bytes > 0 && m_file_size > 0 && m_file_size + (long)len > m_split_bytes; }
+
+    //刷盘线程写入一批日志前的回调：统计行数、切分文件、报告丢弃的条数，返回要写入的文件描述符
+    static int prepare_batch(void *arg, const struct iovec *iov, int count, size_t bytes);
+    int prepare_async(const struct iovec *iov, int count, size_t bytes);
+
+    //同步模式的定时刷新线程
+    static void *flush_log_thread(void *args);
+    void timed_flush();
+
+    //进程崩溃时尽量把缓冲区中的日志写入文件，然后按默认行为重新触发信号
+    static void crash_handler(int sig);
+    void crash_flush();
     // // 删除编译器提供的默认的复制构造函数和赋值构造函数，避免单例被用户通过这两种方式构造对象
     // Log(const Log&) = delete;
 	// Log& operator=(const Log&) = delete;
@@ -64,15 +132,40 @@ private:
     char dir_name[128]; //路径名
     char log_name[128]; //log文件名
     int m_split_lines;  //日志最大行数
+    long m_split_bytes; //日志文件最大字节数，0表示不按大小切分
+    long m_file_size;   //当前文件大小
+    int m_part;         //当天第几个切分出来的文件，文件名后缀
+    int m_stream;       //在log_archiver中登记的编号，-1表示在当前线程中直接打开、关闭文件
+    char m_path[256];   //当前文件名
     int m_log_buf_size; //日志缓冲区大小
     long long m_count;  //日志行数记录
     int m_today;        //因为按天分类,记录当前时间是那一天
     FILE *m_fp;         //打开log的文件指针
-    char *m_buf;        //日志缓冲区首地址
-    block_queue<string> *m_log_queue; //阻塞队列
+    log_writer m_writer;          //异步模式下的每线程环形缓冲区与刷盘线程
+    uint64_t m_reported_drops;    //已经在日志中报告过的丢弃条数
     bool m_is_async;                  //是否异步标志位
+    int m_flush_interval_ms;      //刷新间隔
+    size_t m_flush_bytes;         //同步模式下用户态缓冲区积压超过该值时刷新
+    size_t m_unflushed;           //同步模式下尚未刷新的字节数
+    bool m_sync_error;            //ERROR日志是否立即刷新
+    pthread_t m_flush_tid;
+    bool m_flush_started;
+    bool m_flush_stop;
+    cond m_flush_cond;
     locker m_mutex;
     int m_close_log; //关闭日志
+
+    //二进制模式
+    bool m_binary;
+    site_info m_sites[MAX_SITES];    //编号为下标加1
+    std::atomic<int> m_site_count;
+    locker m_site_lock;
+    int m_text_site;                 //不支持的格式串渲染后按该编号（"%s"）记录
+    int m_drop_site;                 //报告丢弃条数用的格式串编号
+    int m_defined;                   //当前文件中已写过定义的格式串个数
+    bool m_need_magic;               //当前文件为空，需要先写魔数
+    uint64_t m_anchor_ts;            //当前文件中最近一次时间锚点的单调时钟
+    time_t m_next_day;               //下一个零点，二进制模式下用它判断按天切分
 };
 
 /*
@@ -80,9 +173,43 @@ private:
 前述四个方法对日志等级进行分类，包括DEBUG，INFO，WARN和ERROR四种级别的日志。
 */
 //这四个宏定义在其他文件中使用，主要用于不同类型的日志输出
-#define LOG_DEBUG(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(0, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_INFO(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(1, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_WARN(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(2, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_ERROR(format, ...) if(0 == m_close_log) {Log::get_instance()->write_log(3, format, ##__VA_ARGS__); Log::get_instance()->flush();}
+//宏中不再逐行刷新，刷新时机由init中设置的刷新策略决定
+//先比较编译期下限，再比较运行时下限，都满足时才调用get_instance()并求值参数
+//格式串必须是字符串字面量（"" format 在编译期检查），二进制模式按调用点登记格式串
+#define LOG_LEVEL_ON(level) (0 == m_close_log && (level) >= Log::m_min_level)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(format, ...) if(LOG_LEVEL_ON(0)) {static log_site log_call_site; Log::get_instance()->write_site(&log_call_site, 0, "" format, ##__VA_ARGS__);}
+#else
+#define LOG_DEBUG(format, ...)
+#endif
+
+#if LOG_MIN_LEVEL <= 1
+#define LOG_INFO(format, ...) if(LOG_LEVEL_ON(1)) {static log_site log_call_site; Log::get_instance()->write_site(&log_call_site, 1, "" format, ##__VA_ARGS__);}
+//请求路径上的热点日志使用采样宏：每个调用点在每个线程内单独计数，每m_sample_rate次记录一次
+#define LOG_INFO_SAMPLED(format, ...)                                                      \
+    do                                                                                     \
+    {                                                                                      \
+        static thread_local unsigned int log_sample_count = 0;                             \
+        static log_site log_call_site;                                                     \
+        if (LOG_LEVEL_ON(1) && log_sample_count++ % (unsigned int)Log::m_sample_rate == 0) \
+            Log::get_instance()->write_site(&log_call_site, 1, "" format, ##__VA_ARGS__); \
+    } while (0)
+#else
+#define LOG_INFO(format, ...)
+#define LOG_INFO_SAMPLED(format, ...)
+#endif
+
+#if LOG_MIN_LEVEL <= 2
+#define LOG_WARN(format, ...) if(LOG_LEVEL_ON(2)) {static log_site log_call_site; Log::get_instance()->write_site(&log_call_site, 2, "" format, ##__VA_ARGS__);}
+#else
+#define LOG_WARN(format, ...)
+#endif
+
+#if LOG_MIN_LEVEL <= 3
+#define LOG_ERROR(format, ...) if(LOG_LEVEL_ON(3)) {static log_site log_call_site; Log::get_instance()->write_site(&log_call_site, 3, "" format, ##__VA_ARGS__);}
+#else
+#define LOG_ERROR(format, ...)
+#endif
 
 #endif
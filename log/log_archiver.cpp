@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <vector>
+#include <algorithm>
+#include "log_archiver.h"
+
+log_archiver::log_archiver() : m_stream_count(0), m_compress(false), m_keep(0), m_started(false), m_stop(false)
+{
+}
+
+log_archiver::~log_archiver()
+{
+    stop();
+}
+
+bool log_archiver::init(bool compress, int keep)
+{
+    if (m_started)
+        return true;
+    m_compress = compress;
+    m_keep = keep > 0 ? keep : 0;
+    if (pthread_create(&m_tid, NULL, worker, this) != 0)
+        return false;
+    m_started = true;
+    return true;
+}
+
+int log_archiver::add_stream(const char *dir, const char *standby, const char *patterns)
+{
+    m_mutex.lock();
+    if (!m_started || m_stop || m_stream_count >= MAX_STREAMS)
+    {
+        m_mutex.unlock();
+        return -1;
+    }
+
+    int id = m_stream_count;
+    stream &s = m_streams[id];
+    s.dir = dir;
+    s.standby = s.dir + standby;
+    s.pattern_count = 0;
+    for (const char *p = patterns; *p && s.pattern_count < 2;)
+    {
+        const char *sep = strchr(p, '|');
+        size_t n = sep ? (size_t)(sep - p) : strlen(p);
+        s.patterns[s.pattern_count++].assign(p, n);
+        p += sep ? n + 1 : n;
+    }
+    s.ready = NULL;
+    s.want = true;
+    s.creating = false;
+    m_stream_count = id + 1;
+    m_cond.signal();
+    m_mutex.unlock();
+    return id;
+}
+
+FILE *log_archiver::open_next(int id, const char *path)
+{
+    if (id < 0 || id >= m_stream_count)
+        return fopen(path, "a");
+
+    stream &s = m_streams[id];
+    m_mutex.lock();
+    FILE *fp = s.ready;
+    s.ready = NULL;
+    m_mutex.unlock();
+
+    //改名不覆盖已有文件：重启后同名文件已存在时，按原来的方式追加写入，备用文件留到下次再用
+    if (fp && renameat2(AT_FDCWD, s.standby.c_str(), AT_FDCWD, path, RENAME_NOREPLACE) != 0)
+    {
+        m_mutex.lock();
+        s.ready = fp;
+        m_mutex.unlock();
+        fp = NULL;
+    }
+    if (!fp)
+        fp = fopen(path, "a");
+
+    m_mutex.lock();
+    s.current = path;
+    //备用文件已用掉，或者上次没能创建成功，请后台线程重新准备一个
+    if (!s.ready && !s.creating)
+    {
+        s.want = true;
+        m_cond.signal();
+    }
+    m_mutex.unlock();
+    return fp;
+}
+
+void log_archiver::retire(int id, FILE *fp, const char *path)
+{
+    m_mutex.lock();
+    if (id < 0 || id >= m_stream_count || m_stop)
+    {
+        m_mutex.unlock();
+        if (fp)
+            fclose(fp);
+        return;
+    }
+    job j;
+    j.id = id;
+    j.fp = fp;
+    j.path = path;
+    m_jobs.push_back(j);
+    m_cond.signal();
+    m_mutex.unlock();
+}
+
+void log_archiver::stop()
+{
+    m_mutex.lock();
+    if (!m_started || m_stop)
+    {
+        m_mutex.unlock();
+        return;
+    }
+    m_stop = true;
+    m_cond.signal();
+    m_mutex.unlock();
+    pthread_join(m_tid, NULL);
+
+    //备用文件从未写入过，直接删除
+    for (int i = 0; i < m_stream_count; ++i)
+    {
+        if (m_streams[i].ready)
+        {
+            fclose(m_streams[i].ready);
+            unlink(m_streams[i].standby.c_str());
+            m_streams[i].ready = NULL;
+        }
+    }
+}
+
+void *log_archiver::worker(void *arg)
+{
+    ((log_archiver *)arg)->run();
+    return NULL;
+}
+
+void log_archiver::run()
+{
+    m_mutex.lock();
+    while (true)
+    {
+        //先准备备用文件，下一次切分可能很快到来；压缩耗时较长，放在后面
+        int want = -1;
+        for (int i = 0; i < m_stream_count && want < 0; ++i)
+        {
+            if (m_streams[i].want)
+                want = i;
+        }
+        if (want >= 0 && !m_stop)
+        {
+            stream &s = m_streams[want];
+            s.want = false;
+            s.creating = true;
+            string path = s.standby;
+            m_mutex.unlock();
+            FILE *fp = fopen(path.c_str(), "w");
+            m_mutex.lock();
+            s.ready = fp;
+            s.creating = false;
+            continue;
+        }
+
+        if (!m_jobs.empty())
+        {
+            job j = m_jobs.front();
+            m_jobs.pop_front();
+            m_mutex.unlock();
+            archive(j);
+            m_mutex.lock();
+            continue;
+        }
+
+        //退出前处理完所有已切分的文件
+        if (m_stop)
+            break;
+        m_cond.wait(m_mutex.get());
+    }
+    m_mutex.unlock();
+}
+
+void log_archiver::archive(const job &j)
+{
+    //同步日志的FILE缓冲区中可能还有数据，fclose会先把它写出
+    if (j.fp)
+        fclose(j.fp);
+    if (m_compress)
+        compress_file(j.path);
+
+    if (m_keep > 0)
+    {
+        m_mutex.lock();
+        stream s = m_streams[j.id];
+        m_mutex.unlock();
+        purge(s);
+    }
+}
+
+//压缩为"原文件名.gz"后删除原文件；gz文件已存在时追加一个gzip成员，gunzip会把它们依次解压
+bool log_archiver::compress_file(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    string target = path + ".gz";
+    gzFile gz = gzopen(target.c_str(), "ab");
+    if (!gz)
+    {
+        close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        if (gzwrite(gz, buf, n) != n)
+        {
+            ok = false;
+            break;
+        }
+    }
+    if (n < 0)
+        ok = false;
+    close(fd);
+    if (gzclose(gz) != Z_OK)
+        ok = false;
+
+    if (ok)
+        unlink(path.c_str());
+    return ok;
+}
+
+struct segment
+{
+    time_t mtime;
+    string name;
+    bool operator<(const segment &other) const
+    {
+        return mtime != other.mtime ? mtime > other.mtime : name > other.name;
+    }
+};
+
+//删除同一日志最旧的已切分文件，只保留最新的m_keep个，正在写入的文件和备用文件不计入
+void log_archiver::purge(const stream &s)
+{
+    DIR *dir = opendir(s.dir.empty() ? "." : s.dir.c_str());
+    if (!dir)
+        return;
+
+    vector<segment> found;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        string name = ent->d_name;
+        string path = s.dir + name;
+        if (path == s.current || path == s.standby)
+            continue;
+
+        string base = name;
+        if (base.size() > 3 && base.compare(base.size() - 3, 3, ".gz") == 0)
+            base.erase(base.size() - 3);
+        bool match = false;
+        for (int i = 0; i < s.pattern_count && !match; ++i)
+            match = fnmatch(s.patterns[i].c_str(), base.c_str(), 0) == 0;
+        if (!match)
+            continue;
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        segment seg;
+        seg.mtime = st.st_mtime;
+        seg.name = path;
+        found.push_back(seg);
+    }
+    closedir(dir);
+
+    if ((int)found.size() <= m_keep)
+        return;
+    sort(found.begin(), found.end());
+    for (size_t i = m_keep; i < found.size(); ++i)
+        unlink(found[i].name.c_str());
+}
@@ -0,0 +1,88 @@
+#ifndef LOG_ARCHIVER_H
+#define LOG_ARCHIVER_H
+//日志文件切分的后台助手：切分时需要的打开、关闭、压缩、清理都放到一个后台线程中完成。
+//每个日志流（ServerLog、AccessLog）登记一次，后台线程为它预先创建一个空的备用文件；
+//切分时调用者只需把备用文件改名为新文件名并换上它的FILE*，旧文件交给后台线程关闭、gzip压缩，
+//再按保留个数删除同一日志最旧的已切分文件。后台线程未启动时各函数退化为在调用线程中直接打开、关闭。
+
+#include <stdio.h>
+#include <list>
+#include <string>
+#include <pthread.h>
+#include "../lock/locker.h"
+
+using namespace std;
+
+class log_archiver
+{
+public:
+    static const int MAX_STREAMS = 4;
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static log_archiver *get_instance()
+    {
+        static log_archiver instance;
+        return &instance;
+    }
+
+    //启动后台线程；compress为true时压缩已切分的文件，keep为每个日志保留的已切分文件个数，0表示全部保留
+    bool init(bool compress, int keep);
+
+    //登记一个日志流，返回流编号，后台线程未启动时返回-1。
+    //dir为日志目录（可以为空串，表示当前目录），standby为备用文件名，
+    //patterns为识别该日志已切分文件的fnmatch模式（不含".gz"后缀），以'|'分隔
+    int add_stream(const char *dir, const char *standby, const char *patterns);
+
+    //打开下一个文件：优先把备用文件改名为path（path已存在或备用文件尚未就绪时直接以追加方式打开），
+    //返回的FILE*归调用者使用，之后后台线程再准备新的备用文件
+    FILE *open_next(int id, const char *path);
+
+    //交出一个已切分的文件：后台线程负责刷新、关闭、压缩和清理，path为它在磁盘上的文件名
+    void retire(int id, FILE *fp, const char *path);
+
+    //处理完所有待办的文件后退出后台线程，并删除未用上的备用文件
+    void stop();
+
+private:
+    log_archiver();
+    ~log_archiver();
+
+    struct stream
+    {
+        string dir;          //日志目录，以'/'结尾或为空
+        string standby;      //备用文件的完整路径
+        string patterns[2];  //已切分文件名的匹配模式
+        int pattern_count;
+        string current;      //正在写入的文件，清理时跳过
+        FILE *ready;         //已打开的备用文件
+        bool want;           //需要后台线程创建备用文件
+        bool creating;       //后台线程正在创建备用文件
+    };
+
+    struct job
+    {
+        int id;
+        FILE *fp;
+        string path;
+    };
+
+    static void *worker(void *arg);
+    void run();
+    void archive(const job &j);
+    bool compress_file(const string &path);
+    void purge(const stream &s);
+
+private:
+    stream m_streams[MAX_STREAMS];
+    int m_stream_count;
+    list<job> m_jobs;
+    bool m_compress;
+    int m_keep;
+    bool m_started;
+    bool m_stop;
+    pthread_t m_tid;
+    locker m_mutex;
+    cond m_cond;
+};
+
+#endif
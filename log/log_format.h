@@ -0,0 +1,150 @@
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+//二进制日志格式：写日志的线程不做任何格式化，只记录调用点的格式串编号、单调时钟时间戳和原始参数，
+//由离线工具 logdecode 按格式串重新渲染成文本。日志程序与 logdecode 共用本文件中的记录定义和格式串解析。
+//
+//文件以8字节魔数开头，之后是一条条记录，每条记录以 log_record_head 开头，len 为整条记录的长度：
+//  LOG_REC_DEFINE  定义一个格式串：head.id 为编号，head.level 为级别，随后是1字节参数个数、各参数类型码、以'\0'结尾的格式串
+//  LOG_REC_ANCHOR  时间锚点：head.ts 为单调时钟，随后是8字节的同一时刻的墙上时间（纳秒），用于把单调时钟换算成日期时间
+//  LOG_REC_EVENT   一条日志：head.id 为格式串编号，随后按类型码依次存放参数：
+//                  整数4或8字节，浮点8字节，指针8字节，字符串为2字节长度加内容（不含'\0'）
+//每个文件开头都会写一遍锚点和全部已知的格式串定义，单个文件可以独立解码。
+//记录按本机字节序存放，解码需在同种字节序的机器上进行。
+
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#define LOG_BINARY_MAGIC "TWSBLOG1"
+static const int LOG_MAGIC_LEN = 8;
+
+enum log_record_type
+{
+    LOG_REC_DEFINE = 1,
+    LOG_REC_ANCHOR = 2,
+    LOG_REC_EVENT = 3
+};
+
+//参数类型码
+enum log_arg_type
+{
+    LOG_ARG_INT = 'i',    //int及更短的整数、字符
+    LOG_ARG_LONG = 'l',   //long、long long、size_t等8字节整数
+    LOG_ARG_DOUBLE = 'd', //浮点数
+    LOG_ARG_STR = 's',    //字符串
+    LOG_ARG_PTR = 'p'     //指针
+};
+
+static const int LOG_MAX_ARGS = 16;
+
+struct log_record_head
+{
+    uint16_t len;   //整条记录的长度，含记录头
+    uint8_t type;   //log_record_type
+    uint8_t level;  //日志级别
+    uint32_t id;    //格式串编号
+    uint64_t ts;    //CLOCK_MONOTONIC，纳秒
+};
+
+//解析 p 处（指向'%'）的一个转换说明，返回转换说明之后的位置；
+//type 返回参数类型码，"%%"不消耗参数时为0；star 返回宽度、精度中'*'的个数（每个'*'额外消耗一个int参数）；
+//遇到不支持的转换（%n、宽字符串、long double等）返回NULL
+inline const char *log_next_spec(const char *p, char *type, int *star)
+{
+    ++p;
+    *star = 0;
+    if (*p == '%')
+    {
+        *type = 0;
+        return p + 1;
+    }
+
+    //标志、宽度、精度
+    while (*p && strchr("-+ #0'", *p))
+        ++p;
+    if (*p == '*')
+    {
+        ++*star;
+        ++p;
+    }
+    while (isdigit((unsigned char)*p))
+        ++p;
+    if (*p == '.')
+    {
+        ++p;
+        if (*p == '*')
+        {
+            ++*star;
+            ++p;
+        }
+        while (isdigit((unsigned char)*p))
+            ++p;
+    }
+
+    //长度修饰，l、ll、z、j、t都按8字节整数处理
+    bool wide = false;
+    while (*p && strchr("hlqjzt", *p))
+    {
+        if (*p != 'h')
+            wide = true;
+        ++p;
+    }
+
+    switch (*p)
+    {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+        *type = wide ? LOG_ARG_LONG : LOG_ARG_INT;
+        break;
+    case 'c':
+        *type = LOG_ARG_INT;
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        *type = LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        if (wide)
+            return NULL;
+        *type = LOG_ARG_STR;
+        break;
+    case 'p':
+        *type = LOG_ARG_PTR;
+        break;
+    default:
+        return NULL;
+    }
+    return p + 1;
+}
+
+//解析整个格式串，按参数出现的顺序填写类型码，返回参数个数；含不支持的转换或参数过多时返回-1
+inline int log_parse_format(const char *format, char *types, int max_args)
+{
+    int n = 0;
+    const char *p = format;
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        char type;
+        int star;
+        p = log_next_spec(p, &type, &star);
+        if (!p || n + star + (type ? 1 : 0) > max_args)
+            return -1;
+        while (star-- > 0)
+            types[n++] = LOG_ARG_INT;
+        if (type)
+            types[n++] = type;
+    }
+    return n;
+}
+
+#endif
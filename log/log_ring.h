@@ -0,0 +1,127 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+//单生产者/单消费者的字节环形缓冲区：每个写日志的线程独占一个，生产者（写日志的线程）只推进 m_tail，
+//消费者（刷盘线程）只推进 m_head。两个游标都是单调递增的计数，取下标时与 m_mask 相与，所以容量必须是2的幂。
+//缓冲区中只保存日志正文，不加任何记录头，刷盘线程可以把可读区间直接交给 writev。
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <atomic>
+
+class log_ring
+{
+public:
+    explicit log_ring(size_t capacity)
+        : m_buf(new char[capacity]), m_capacity(capacity), m_mask(capacity - 1), m_dropped(0), m_owned(true), m_head(0), m_tail(0)
+    {
+    }
+    ~log_ring() { delete[] m_buf; }
+
+    size_t capacity() const { return m_capacity; }
+
+    //生产者：剩余可写字节数
+    size_t free_space() const
+    {
+        return m_capacity - (m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire));
+    }
+
+    //生产者：写游标处的地址，room 返回从该地址到缓冲区末尾的连续空间
+    char *write_ptr(size_t *room) const
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed) & m_mask;
+        *room = m_capacity - pos;
+        return m_buf + pos;
+    }
+
+    //生产者：提交已直接写到 write_ptr 处的 len 字节
+    void produce(size_t len)
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+
+    //生产者：拷贝写入 len 字节，跨过缓冲区末尾时分两段拷贝，调用者保证剩余空间足够
+    void push(const char *data, size_t len)
+    {
+        size_t room;
+        char *dst = write_ptr(&room);
+        if (len <= room)
+        {
+            memcpy(dst, data, len);
+        }
+        else
+        {
+            memcpy(dst, data, room);
+            memcpy(m_buf, data + room, len - room);
+        }
+        produce(len);
+    }
+
+    //生产者：记录一条因空间不足被丢弃的日志
+    void drop() { m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    //消费者：已提交、尚未取走的字节数
+    size_t size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_relaxed);
+    }
+
+    //消费者：把可读数据描述成至多两个 iovec，返回 iovec 个数，len 返回总字节数
+    int peek(struct iovec *iov, size_t *len) const
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t n = m_tail.load(std::memory_order_acquire) - head;
+        *len = n;
+        if (n == 0)
+            return 0;
+
+        size_t pos = head & m_mask;
+        size_t first = m_capacity - pos;
+        iov[0].iov_base = m_buf + pos;
+        if (n <= first)
+        {
+            iov[0].iov_len = n;
+            return 1;
+        }
+        iov[0].iov_len = first;
+        iov[1].iov_base = m_buf;
+        iov[1].iov_len = n - first;
+        return 2;
+    }
+
+    //生产者线程退出时释放缓冲区，新线程登记时认领；缓冲区中剩余的数据仍由消费者照常写出，
+    //新的生产者接着旧的写游标写入，同一时刻仍只有一个生产者
+    void release() { m_owned.store(false, std::memory_order_release); }
+    bool claim()
+    {
+        bool owned = false;
+        return m_owned.compare_exchange_strong(owned, true, std::memory_order_acquire);
+    }
+
+    //已提交的累计字节数与已取走的累计字节数，用于等待某个位置之前的数据写完
+    size_t written() const { return m_tail.load(std::memory_order_acquire); }
+    size_t consumed() const { return m_head.load(std::memory_order_acquire); }
+
+    //消费者：释放前 len 字节
+    void consume(size_t len)
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+
+private:
+    char *m_buf;
+    size_t m_capacity;
+    size_t m_mask;
+    std::atomic<uint64_t> m_dropped; //因空间不足被丢弃的日志条数，只由生产者修改
+    std::atomic<bool> m_owned;       //是否有线程正在使用
+    //两个游标分别由不同线程修改，各占一个缓存行，避免伪共享
+    char m_pad0[64];
+    std::atomic<size_t> m_head;
+    char m_pad1[64];
+    std::atomic<size_t> m_tail;
+    char m_pad2[64];
+};
+
+#endif
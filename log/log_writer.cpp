@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "log_writer.h"
+
+thread_local log_writer::local_slot log_writer::t_slots[log_writer::MAX_WRITERS];
+std::atomic<int> log_writer::s_next_id(0);
+
+log_writer::log_writer()
+    : m_id(-1), m_ring_size(0), m_max_record(0), m_wake_bytes(0), m_interval_ms(1000), m_block(false), m_prepare(NULL), m_arg(NULL),
+      m_ring_count(0), m_lost(0), m_started(false), m_stop(false), m_wakeup(false)
+{
+    for (int i = 0; i < MAX_RINGS; ++i)
+        m_rings[i] = NULL;
+}
+
+log_writer::~log_writer()
+{
+    stop();
+    int count = m_ring_count.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i)
+        delete m_rings[i];
+}
+
+bool log_writer::start(size_t ring_size, size_t max_record, bool block_on_full, int interval_ms, size_t wake_bytes,
+                       prepare_fn prepare, void *arg)
+{
+    if (m_started || !prepare)
+        return false;
+
+    m_id = s_next_id.fetch_add(1);
+    if (m_id >= MAX_WRITERS)
+        return false;
+
+    //容量取2的幂，并保证至少能放下两条最长的记录
+    size_t size = 4096;
+    while (size < ring_size || size < max_record * 2)
+        size <<= 1;
+    m_ring_size = size;
+    m_max_record = max_record;
+    m_wake_bytes = (wake_bytes > 0 && wake_bytes < size / 2) ? wake_bytes : size / 2;
+    m_interval_ms = interval_ms > 0 ? interval_ms : 1000;
+    m_block = block_on_full;
+    m_prepare = prepare;
+    m_arg = arg;
+
+    if (pthread_create(&m_tid, NULL, worker, this) != 0)
+        return false;
+    m_started = true;
+    return true;
+}
+
+void log_writer::stop()
+{
+    if (!m_started)
+        return;
+    m_stop.store(true);
+    wake();
+    pthread_join(m_tid, NULL);
+    m_started = false;
+}
+
+//当前线程第一次写入时登记一个环形缓冲区，只有这里需要加锁；先认领已退出线程释放的缓冲区
+log_ring *log_writer::register_ring()
+{
+    log_ring *ring = NULL;
+    m_register_lock.lock();
+    int count = m_ring_count.load(std::memory_order_relaxed);
+    for (int i = 0; i < count && !ring; ++i)
+    {
+        if (m_rings[i]->claim())
+            ring = m_rings[i];
+    }
+    if (!ring && count < MAX_RINGS)
+    {
+        ring = new log_ring(m_ring_size);
+        m_rings[count] = ring;
+        m_ring_count.store(count + 1, std::memory_order_release);
+    }
+    m_register_lock.unlock();
+
+    t_slots[m_id].ring = ring;
+    return ring;
+}
+
+char *log_writer::begin()
+{
+    local_slot &slot = t_slots[m_id];
+    log_ring *ring = slot.ring ? slot.ring : register_ring();
+    if (!ring)
+    {
+        m_lost.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    //按最长记录预留空间，空间不足时按策略等待或丢弃
+    while (ring->free_space() < m_max_record)
+    {
+        wake();
+        if (!m_block || m_stop.load(std::memory_order_relaxed))
+        {
+            ring->drop();
+            return NULL;
+        }
+        usleep(BLOCK_WAIT_US);
+    }
+
+    size_t room;
+    char *dst = ring->write_ptr(&room);
+    if (room >= m_max_record)
+    {
+        slot.in_scratch = false;
+        return dst;
+    }
+
+    //写游标离缓冲区末尾太近，先写到线程私有的临时区
+    if (!slot.scratch)
+        slot.scratch = new char[m_max_record];
+    slot.in_scratch = true;
+    return slot.scratch;
+}
+
+void log_writer::commit(size_t len)
+{
+    local_slot &slot = t_slots[m_id];
+    if (slot.in_scratch)
+        slot.ring->push(slot.scratch, len);
+    else
+        slot.ring->produce(len);
+
+    if (slot.ring->size() >= m_wake_bytes)
+        wake();
+}
+
+//多个生产者同时发现积压时只有第一个去加锁通知
+void log_writer::wake()
+{
+    if (m_wakeup.exchange(true))
+        return;
+    m_mutex.lock();
+    m_cond.signal();
+    m_mutex.unlock();
+}
+
+void log_writer::flush(bool current_only)
+{
+    if (!m_started)
+        return;
+
+    //记下各缓冲区此刻的写游标，刷盘线程的读游标越过它们即表示这之前的数据都已写入
+    log_ring *rings[MAX_RINGS];
+    size_t targets[MAX_RINGS];
+    int count = 0;
+    if (current_only)
+    {
+        log_ring *ring = t_slots[m_id].ring;
+        if (!ring)
+            return;
+        rings[0] = ring;
+        targets[0] = ring->written();
+        count = 1;
+    }
+    else
+    {
+        count = m_ring_count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; ++i)
+        {
+            rings[i] = m_rings[i];
+            targets[i] = rings[i]->written();
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        while ((ptrdiff_t)(rings[i]->consumed() - targets[i]) < 0)
+        {
+            if (m_stop.load(std::memory_order_relaxed))
+                return;
+            wake();
+            usleep(BLOCK_WAIT_US);
+        }
+    }
+}
+
+void log_writer::drain_to(int fd)
+{
+    int count = m_ring_count.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i)
+    {
+        struct iovec iov[2];
+        size_t len;
+        int n = m_rings[i]->peek(iov, &len);
+        if (n == 0)
+            continue;
+        write_all(fd, iov, n);
+        m_rings[i]->consume(len);
+    }
+}
+
+uint64_t log_writer::dropped() const
+{
+    uint64_t total = m_lost.load(std::memory_order_relaxed);
+    int count = m_ring_count.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i)
+        total += m_rings[i]->dropped();
+    return total;
+}
+
+void *log_writer::worker(void *arg)
+{
+    ((log_writer *)arg)->run();
+    return NULL;
+}
+
+void log_writer::run()
+{
+    while (true)
+    {
+        m_mutex.lock();
+        if (!m_wakeup.load() && !m_stop.load())
+        {
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec += m_interval_ms / 1000;
+            t.tv_nsec += (m_interval_ms % 1000) * 1000000L;
+            if (t.tv_nsec >= 1000000000L)
+            {
+                t.tv_sec += t.tv_nsec / 1000000000L;
+                t.tv_nsec %= 1000000000L;
+            }
+            m_cond.timewait(m_mutex.get(), t);
+        }
+        m_mutex.unlock();
+        m_wakeup.store(false);
+
+        //退出前把所有缓冲区写空
+        if (m_stop.load())
+        {
+            while (drain() > 0)
+                ;
+            break;
+        }
+        drain();
+    }
+}
+
+//收集所有缓冲区的可读区间，一次 writev 写入，返回本批字节数
+size_t log_writer::drain()
+{
+    struct iovec iov[MAX_RINGS * 2];
+    size_t lens[MAX_RINGS];
+    int count = m_ring_count.load(std::memory_order_acquire);
+    int n = 0;
+    size_t total = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        n += m_rings[i]->peek(iov + n, &lens[i]);
+        total += lens[i];
+    }
+    if (total == 0)
+        return 0;
+
+    int fd = m_prepare(m_arg, iov, n, total);
+    if (fd >= 0)
+        write_all(fd, iov, n);
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (lens[i])
+            m_rings[i]->consume(lens[i]);
+    }
+    return total;
+}
+
+//writev 可能只写入一部分，跳过已写完的 iovec 后继续写，出错则放弃这批数据
+void log_writer::write_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t ret = writev(fd, iov, count);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        size_t left = ret;
+        while (count > 0 && left >= iov->iov_len)
+        {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+//多生产者/单消费者的异步日志写入器：每个写日志的线程第一次写入时登记一个自己独占的 log_ring，
+//之后直接把日志格式化进自己的环形缓冲区，不加锁、不拷贝；刷盘线程定时或被唤醒后把所有环形缓冲区的
+//可读区间收集成一组 iovec，调用一次 writev 写入文件。
+//只有登记环形缓冲区和唤醒刷盘线程时才需要加锁，前者每个线程只发生一次，后者只在缓冲区积压过半时发生。
+//线程退出时释放它的环形缓冲区，之后登记的线程优先认领已释放的，短命线程不会耗尽MAX_RINGS个位置。
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <atomic>
+#include "log_ring.h"
+#include "../lock/locker.h"
+
+class log_writer
+{
+public:
+    static const int MAX_WRITERS = 4;    //进程内写入器个数上限，线程局部状态按写入器编号分槽保存
+    static const int MAX_RINGS = 256;    //每个写入器最多同时登记的线程数
+    static const int BLOCK_WAIT_US = 50; //阻塞策略下，生产者等待空间时每次休眠的时长
+
+    //刷盘线程写入一批数据之前调用，返回这批数据应写入的文件描述符，返回-1则丢弃这批数据；
+    //调用者可以在这里统计行数、完成按天或按行切分文件
+    typedef int (*prepare_fn)(void *arg, const struct iovec *iov, int count, size_t bytes);
+
+public:
+    log_writer();
+    ~log_writer();
+
+    //ring_size 为每个线程的环形缓冲区大小（向上取整为2的幂），max_record 为单条记录的最大长度，
+    //block_on_full 为 true 时缓冲区满则等待刷盘线程腾出空间，否则丢弃该条日志并计数；
+    //刷盘线程每隔 interval_ms 写一批，单个缓冲区积压超过 wake_bytes（不超过容量的一半）时提前唤醒
+    bool start(size_t ring_size, size_t max_record, bool block_on_full, int interval_ms, size_t wake_bytes,
+               prepare_fn prepare, void *arg);
+    //唤醒刷盘线程写完所有缓冲区中的数据后退出
+    void stop();
+
+    //生产者：申请一块至少 max_record 字节的连续空间，丢弃时返回NULL
+    char *begin();
+    //生产者：提交 begin 返回的空间中实际写入的 len 字节
+    void commit(size_t len);
+
+    //唤醒刷盘线程
+    void wake();
+
+    //唤醒刷盘线程并等待调用时已提交的数据全部写入文件；current_only 为 true 时只等待当前线程的缓冲区
+    void flush(bool current_only);
+
+    //崩溃时由信号处理函数调用：不经过刷盘线程，直接把所有缓冲区的剩余数据写入 fd，只使用 writev
+    void drain_to(int fd);
+
+    //因缓冲区满或线程数超过上限而丢弃的日志条数
+    uint64_t dropped() const;
+
+private:
+    static void *worker(void *arg);
+    void run();
+    log_ring *register_ring();
+    size_t drain();
+    static void write_all(int fd, struct iovec *iov, int count);
+
+    //每个线程在每个写入器上的私有状态
+    struct local_slot
+    {
+        log_ring *ring;
+        char *scratch;   //环形缓冲区末尾的连续空间不足一条记录时，先格式化到这里，提交时分两段拷贝
+        bool in_scratch;
+        local_slot() : ring(NULL), scratch(NULL), in_scratch(false) {}
+        //线程退出：释放环形缓冲区供以后的线程认领
+        ~local_slot()
+        {
+            if (ring)
+                ring->release();
+            ring = NULL;
+            delete[] scratch;
+            scratch = NULL;
+        }
+    };
+    static thread_local local_slot t_slots[MAX_WRITERS];
+    static std::atomic<int> s_next_id;
+
+private:
+    int m_id;
+    size_t m_ring_size;
+    size_t m_max_record;
+    size_t m_wake_bytes;         //单个缓冲区积压超过该值时唤醒刷盘线程
+    int m_interval_ms;           //刷盘线程没有被唤醒时的最长等待时间
+    bool m_block;
+    prepare_fn m_prepare;
+    void *m_arg;
+
+    log_ring *m_rings[MAX_RINGS];
+    std::atomic<int> m_ring_count;
+    std::atomic<uint64_t> m_lost; //线程数超过上限、没能登记缓冲区而丢弃的条数
+    locker m_register_lock;
+
+    pthread_t m_tid;
+    bool m_started;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_wakeup;
+    locker m_mutex;
+    cond m_cond;
+};
+
+#endif
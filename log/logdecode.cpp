@@ -0,0 +1,241 @@
+//二进制日志解码工具：把 -f 1 模式写出的 .bin 日志按格式串定义重新渲染成与文本日志相同格式的行，输出到标准输出。
+//用法：./logdecode 2023_06_18_ServerLog.bin [更多文件...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "log_format.h"
+
+using namespace std;
+
+struct format_def
+{
+    int level;
+    string types;
+    string format;
+};
+
+static const char *level_name(int level)
+{
+    switch (level)
+    {
+    case 0:
+        return "[debug]:";
+    case 2:
+        return "[warn]:";
+    case 3:
+        return "[erro]:";
+    default:
+        return "[info]:";
+    }
+}
+
+//按转换说明中'*'的个数把宽度、精度参数一并传给snprintf
+template <typename T>
+static void print_spec(string &out, const string &spec, int nstar, const int *stars, T value)
+{
+    char buf[8192];
+    int n;
+    if (0 == nstar)
+        n = snprintf(buf, sizeof(buf), spec.c_str(), value);
+    else if (1 == nstar)
+        n = snprintf(buf, sizeof(buf), spec.c_str(), stars[0], value);
+    else
+        n = snprintf(buf, sizeof(buf), spec.c_str(), stars[0], stars[1], value);
+    if (n > 0)
+        out.append(buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+//按格式串逐个转换说明取出参数渲染，参数不足或记录损坏时返回false
+static bool render(const format_def &def, const char *p, const char *end, string &out)
+{
+    const char *f = def.format.c_str();
+    while (*f)
+    {
+        const char *pct = strchr(f, '%');
+        if (!pct)
+        {
+            out.append(f);
+            break;
+        }
+        out.append(f, pct - f);
+
+        char type;
+        int nstar;
+        const char *next = log_next_spec(pct, &type, &nstar);
+        if (!next)
+            return false;
+        if (0 == type)
+        {
+            out.push_back('%');
+            f = next;
+            continue;
+        }
+
+        int stars[2] = {0, 0};
+        for (int i = 0; i < nstar; ++i)
+        {
+            if (end - p < 4)
+                return false;
+            memcpy(&stars[i], p, 4);
+            p += 4;
+        }
+
+        string spec(pct, next - pct);
+        switch (type)
+        {
+        case LOG_ARG_INT:
+        {
+            int v;
+            if (end - p < 4)
+                return false;
+            memcpy(&v, p, 4);
+            p += 4;
+            print_spec(out, spec, nstar, stars, v);
+            break;
+        }
+        case LOG_ARG_LONG:
+        {
+            long long v;
+            if (end - p < 8)
+                return false;
+            memcpy(&v, p, 8);
+            p += 8;
+            print_spec(out, spec, nstar, stars, v);
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            double v;
+            if (end - p < 8)
+                return false;
+            memcpy(&v, p, 8);
+            p += 8;
+            print_spec(out, spec, nstar, stars, v);
+            break;
+        }
+        case LOG_ARG_PTR:
+        {
+            uint64_t v;
+            if (end - p < 8)
+                return false;
+            memcpy(&v, p, 8);
+            p += 8;
+            print_spec(out, spec, nstar, stars, (void *)(uintptr_t)v);
+            break;
+        }
+        case LOG_ARG_STR:
+        {
+            uint16_t n;
+            if (end - p < 2)
+                return false;
+            memcpy(&n, p, 2);
+            p += 2;
+            if (end - p < n)
+                return false;
+            string s(p, n);
+            p += n;
+            print_spec(out, spec, nstar, stars, s.c_str());
+            break;
+        }
+        }
+        f = next;
+    }
+    return true;
+}
+
+static int decode(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "logdecode: cannot open %s\n", path);
+        return 1;
+    }
+    vector<char> data;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    fclose(fp);
+
+    if (data.size() < (size_t)LOG_MAGIC_LEN || memcmp(&data[0], LOG_BINARY_MAGIC, LOG_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "logdecode: %s is not a binary log\n", path);
+        return 1;
+    }
+
+    //同一编号可能被重新定义（服务器重启后追加写同一个文件），总是以最近一次定义为准
+    map<uint32_t, format_def> defs;
+    uint64_t anchor_mono = 0, anchor_real = 0;
+    const char *p = &data[0] + LOG_MAGIC_LEN;
+    const char *end = &data[0] + data.size();
+    string line;
+
+    while (end - p >= (long)sizeof(log_record_head))
+    {
+        log_record_head head;
+        memcpy(&head, p, sizeof(head));
+        //崩溃时最后一条记录可能不完整
+        if (head.len < sizeof(head) || end - p < head.len)
+        {
+            fprintf(stderr, "logdecode: %s: truncated record at offset %ld\n", path, (long)(p - &data[0]));
+            return 1;
+        }
+        const char *body = p + sizeof(head);
+        const char *rec_end = p + head.len;
+        p = rec_end;
+
+        if (LOG_REC_DEFINE == head.type)
+        {
+            int nargs = (unsigned char)body[0];
+            format_def def;
+            def.level = head.level;
+            def.types.assign(body + 1, nargs);
+            def.format.assign(body + 1 + nargs, strnlen(body + 1 + nargs, rec_end - body - 1 - nargs));
+            defs[head.id] = def;
+        }
+        else if (LOG_REC_ANCHOR == head.type)
+        {
+            anchor_mono = head.ts;
+            memcpy(&anchor_real, body, 8);
+        }
+        else if (LOG_REC_EVENT == head.type)
+        {
+            uint64_t real = anchor_real + (int64_t)(head.ts - anchor_mono);
+            time_t sec = real / 1000000000ULL;
+            struct tm my_tm;
+            localtime_r(&sec, &my_tm);
+            char prefix[64];
+            snprintf(prefix, sizeof(prefix), "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
+                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, (long)(real % 1000000000ULL / 1000), level_name(head.level));
+
+            line = prefix;
+            map<uint32_t, format_def>::iterator it = defs.find(head.id);
+            if (it == defs.end())
+                line += "<undefined format id>";
+            else if (!render(it->second, body, rec_end, line))
+                line += "<corrupted record>";
+            line.push_back('\n');
+            fwrite(line.data(), 1, line.size(), stdout);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s file.bin [file.bin ...]\n", argv[0]);
+        return 2;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; ++i)
+        ret |= decode(argv[i]);
+    return ret;
+}
@@ -17,7 +17,12 @@ int main(int argc, char *argv[])
     //初始化
     server.init(config.PORT, user, passwd, databasename, config.LOGWrite, 
                 config.OPT_LINGER, config.TRIGMode,  config.sql_num,  config.thread_num, 
-                config.close_log, config.actor_model);
+                config.close_log, config.actor_model, config.evict_fd_pct, config.evict_mem_mb,
+                config.log_block, config.log_flush_ms, config.log_flush_kb, config.log_sync_error,
+                config.log_level, config.log_sample, config.log_format,
+                config.access_log, config.log_rotate_mb, config.log_gzip, config.log_keep,
+                config.user_snapshot, config.user_store, config.session_ttl, config.metrics_path,
+                config.trace_sample, config.watchdog_ms);
     
 
     //日志:通过单例模式获取唯一的日志类，调用init方法，初始化生成日志文件，服务器启动按当前时刻创建日志，
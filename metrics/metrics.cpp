@@ -0,0 +1,242 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "metrics.h"
+#include "watchdog.h"
+#include "../log/log.h"
+#include "../log/access_log.h"
+
+thread_local metrics::thread_stats *metrics::t_stats = NULL;
+
+static const char *route_names[] = {"other", "static", "login", "register", "metrics"};
+static const char *status_names[] = {"200", "403", "404", "500", "503", "other"};
+
+metrics::metrics() : m_enabled(false), m_count(0)
+{
+    m_path[0] = '\0';
+    memset(m_stats, 0, sizeof(m_stats));
+
+    //1、2、3、4、6、8、12、16……微秒，每个2的幂区间再分两半，最后一个上界为2^26微秒
+    m_bounds[0] = 1;
+    m_bounds[1] = 2;
+    uint64_t p = 2;
+    for (int i = 2; i < BUCKET_COUNT; i += 2, p <<= 1)
+    {
+        m_bounds[i] = p + p / 2;
+        m_bounds[i + 1] = p * 2;
+    }
+}
+
+void metrics::init(const char *path)
+{
+    if (!path || !path[0] || path[0] != '/' || strlen(path) >= (size_t)MAX_PATH)
+    {
+        m_enabled = false;
+        return;
+    }
+    strcpy(m_path, path);
+    m_enabled = true;
+}
+
+int metrics::bucket_of(uint64_t us) const
+{
+    return std::lower_bound(m_bounds, m_bounds + BUCKET_COUNT, us) - m_bounds;
+}
+
+int metrics::status_index(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return STATUS_200;
+    case 403:
+        return STATUS_403;
+    case 404:
+        return STATUS_404;
+    case 500:
+        return STATUS_500;
+    case 503:
+        return STATUS_503;
+    default:
+        return STATUS_OTHER;
+    }
+}
+
+//每个线程只在第一次记录时加锁登记一次
+metrics::thread_stats *metrics::register_thread()
+{
+    m_register_lock.lock();
+    int n = m_count.load(std::memory_order_relaxed);
+    thread_stats *s = NULL;
+    if (n < MAX_THREADS)
+    {
+        void *mem = NULL;
+        if (0 == posix_memalign(&mem, 64, sizeof(thread_stats)))
+        {
+            memset(mem, 0, sizeof(thread_stats));
+            s = (thread_stats *)mem;
+            m_stats[n] = s;
+            m_count.store(n + 1, std::memory_order_release);
+        }
+    }
+    //超过上限或分配失败时共用最后登记的一块
+    if (!s)
+        s = m_stats[n > 0 ? n - 1 : 0];
+    m_register_lock.unlock();
+    if (!s)
+    {
+        //第一块都分配失败，只能放弃记录；用一个不会被抓取的块吸收写入
+        static thread_stats sink;
+        s = &sink;
+    }
+    t_stats = s;
+    return s;
+}
+
+static void append_format(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void append_format(std::string &out, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0)
+        out.append(line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+}
+
+static void append_header(std::string &out, const char *name, const char *type, const char *help)
+{
+    append_format(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics::render_histogram(std::string &out, const char *name, const char *labels, const uint64_t *buckets,
+                               uint64_t sum)
+{
+    //labels为空串或"key=\"value\","形式，桶的le标签接在后面
+    uint64_t cumulative = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i)
+    {
+        cumulative += buckets[i];
+        append_format(out, "%s_bucket{%sle=\"%g\"} %llu\n", name, labels, m_bounds[i] / 1e6,
+                      (unsigned long long)cumulative);
+    }
+    cumulative += buckets[BUCKET_COUNT];
+    append_format(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+
+    //_sum、_count的标签去掉末尾的逗号
+    std::string plain(labels);
+    if (!plain.empty())
+        plain.erase(plain.size() - 1);
+    const char *open = plain.empty() ? "" : "{";
+    const char *close = plain.empty() ? "" : "}";
+    append_format(out, "%s_sum%s%s%s %.6f\n", name, open, plain.c_str(), close, sum / 1e6);
+    append_format(out, "%s_count%s%s%s %llu\n", name, open, plain.c_str(), close, (unsigned long long)cumulative);
+}
+
+void metrics::render(std::string &out, int open_connections)
+{
+    //把各线程的块相加；写入方不加锁，同一时刻的桶计数与总和可能有一两次记录的出入
+    uint64_t counters[COUNTER_COUNT] = {0};
+    uint64_t requests[ROUTE_COUNT][STATUS_COUNT] = {{0}};
+    uint64_t buckets[HIST_COUNT][BUCKET_COUNT + 1] = {{0}};
+    uint64_t sums[HIST_COUNT] = {0};
+    int n = m_count.load(std::memory_order_acquire);
+    for (int t = 0; t < n; ++t)
+    {
+        thread_stats *s = m_stats[t];
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+            counters[i] += s->counters[i].load(std::memory_order_relaxed);
+        for (int r = 0; r < ROUTE_COUNT; ++r)
+            for (int c = 0; c < STATUS_COUNT; ++c)
+                requests[r][c] += s->requests[r][c].load(std::memory_order_relaxed);
+        for (int h = 0; h < HIST_COUNT; ++h)
+        {
+            for (int b = 0; b <= BUCKET_COUNT; ++b)
+                buckets[h][b] += s->hist[h].buckets[b].load(std::memory_order_relaxed);
+            sums[h] += s->hist[h].sum.load(std::memory_order_relaxed);
+        }
+    }
+
+    //处理中的连接数由转入、转出次数相减得到；连接在处理中被关闭时，到该槽位被下一个连接复用才计回来
+    long long busy = (long long)(counters[CONN_BUSY] - counters[CONN_IDLE]);
+    if (busy < 0)
+        busy = 0;
+    if (busy > open_connections)
+        busy = open_connections;
+    long long depth = (long long)(counters[QUEUE_PUSH] - counters[QUEUE_POP]);
+    if (depth < 0)
+        depth = 0;
+
+    append_header(out, "tws_accepts_total", "counter", "Accepted client connections.");
+    append_format(out, "tws_accepts_total %llu\n", (unsigned long long)counters[ACCEPTS]);
+    append_header(out, "tws_connections", "gauge", "Open client connections by state.");
+    append_format(out, "tws_connections{state=\"active\"} %lld\n", busy);
+    append_format(out, "tws_connections{state=\"idle\"} %lld\n", (long long)open_connections - busy);
+    append_header(out, "tws_timer_expirations_total", "counter", "Connections closed by the inactivity timer.");
+    append_format(out, "tws_timer_expirations_total %llu\n", (unsigned long long)counters[TIMER_EXPIRED]);
+    append_header(out, "tws_evictions_total", "counter", "Idle connections evicted under fd or memory pressure.");
+    append_format(out, "tws_evictions_total %llu\n", (unsigned long long)counters[EVICTED]);
+
+    append_header(out, "tws_requests_total", "counter", "Completed requests by route and status code.");
+    for (int r = 0; r < ROUTE_COUNT; ++r)
+        for (int c = 0; c < STATUS_COUNT; ++c)
+            if (requests[r][c])
+                append_format(out, "tws_requests_total{route=\"%s\",code=\"%s\"} %llu\n", route_names[r],
+                              status_names[c], (unsigned long long)requests[r][c]);
+    append_header(out, "tws_response_bytes_total", "counter", "Response bytes written to sockets.");
+    append_format(out, "tws_response_bytes_total %llu\n", (unsigned long long)counters[BYTES_SENT]);
+
+    //请求耗时只输出有请求的路由，控制报文大小
+    append_header(out, "tws_request_duration_seconds", "histogram",
+                  "Time from the first request byte to the last response byte.");
+    for (int r = 0; r < ROUTE_COUNT; ++r)
+    {
+        uint64_t total = 0;
+        for (int b = 0; b <= BUCKET_COUNT; ++b)
+            total += buckets[r][b];
+        if (0 == total)
+            continue;
+        char labels[32];
+        snprintf(labels, sizeof(labels), "route=\"%s\",", route_names[r]);
+        render_histogram(out, "tws_request_duration_seconds", labels, buckets[r], sums[r]);
+    }
+
+    append_header(out, "tws_threadpool_queue_depth", "gauge", "Tasks waiting in the thread pool queue.");
+    append_format(out, "tws_threadpool_queue_depth %lld\n", depth);
+    append_header(out, "tws_threadpool_queue_wait_seconds", "histogram",
+                  "Time a task waits in the thread pool queue.");
+    render_histogram(out, "tws_threadpool_queue_wait_seconds", "", buckets[HIST_QUEUE_WAIT], sums[HIST_QUEUE_WAIT]);
+    append_header(out, "tws_db_pool_wait_seconds", "histogram", "Time spent acquiring a database connection.");
+    render_histogram(out, "tws_db_pool_wait_seconds", "", buckets[HIST_DB_WAIT], sums[HIST_DB_WAIT]);
+
+    //看门狗：事件循环每轮耗时、卡住次数和当前最长的一轮循环或任务
+    watchdog *dog = watchdog::get_instance();
+    if (dog->enabled())
+    {
+        uint64_t stalls[watchdog::ROLE_COUNT], busy[watchdog::ROLE_COUNT];
+        dog->snapshot(stalls, busy);
+        append_header(out, "tws_event_loop_iteration_seconds", "histogram",
+                      "Time the main thread spends handling one batch of epoll events.");
+        render_histogram(out, "tws_event_loop_iteration_seconds", "", buckets[HIST_LOOP_LAG], sums[HIST_LOOP_LAG]);
+        append_header(out, "tws_watchdog_stalls_total", "counter",
+                      "Loop iterations or worker tasks that ran past the watchdog threshold.");
+        append_format(out, "tws_watchdog_stalls_total{thread=\"main\"} %llu\n",
+                      (unsigned long long)stalls[watchdog::ROLE_MAIN]);
+        append_format(out, "tws_watchdog_stalls_total{thread=\"worker\"} %llu\n",
+                      (unsigned long long)stalls[watchdog::ROLE_WORKER]);
+        append_header(out, "tws_watchdog_busy_seconds", "gauge",
+                      "Age of the longest loop iteration or worker task still in progress.");
+        append_format(out, "tws_watchdog_busy_seconds{thread=\"main\"} %.6f\n", busy[watchdog::ROLE_MAIN] / 1e9);
+        append_format(out, "tws_watchdog_busy_seconds{thread=\"worker\"} %.6f\n",
+                      busy[watchdog::ROLE_WORKER] / 1e9);
+    }
+
+    append_header(out, "tws_log_dropped_lines_total", "counter", "Log lines dropped because a buffer was full.");
+    append_format(out, "tws_log_dropped_lines_total{log=\"server\"} %llu\n",
+                  (unsigned long long)Log::get_instance()->dropped_lines());
+    append_format(out, "tws_log_dropped_lines_total{log=\"access\"} %llu\n",
+                  (unsigned long long)access_log::get_instance()->dropped_lines());
+}
@@ -0,0 +1,165 @@
+#ifndef METRICS_H
+#define METRICS_H
+//以单例模式实现的运行指标：计数器与延迟直方图按线程分块存放，每个线程第一次记录时登记一块按缓存行对齐的私有数据，
+//之后只写自己的块（单写者，原子变量的relaxed读加写，不加锁、不与其他线程争用缓存行）；
+//抓取时把所有线程的块相加，连同连接数、日志丢弃条数等当前值一起输出为Prometheus文本格式。
+//延迟直方图按对数分桶（每个2的幂区间再分两半），从1微秒到约67秒，相对误差不超过50%，记录一次只需一次二分查找。
+//未配置指标路径时不启用，各记录函数只检查一个标志位。
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include "../lock/locker.h"
+
+class metrics
+{
+public:
+    static const int MAX_THREADS = 256;  //登记私有块的线程数上限，超过的线程共用最后一块
+    static const int BUCKET_COUNT = 52;  //直方图上界的个数，另有一个+Inf桶
+    static const int MAX_PATH = 64;
+
+    //计数器
+    enum counter
+    {
+        ACCEPTS,         //接受的连接数
+        BYTES_SENT,      //发送的响应字节数
+        TIMER_EXPIRED,   //定时器到期关闭的连接数
+        EVICTED,         //因资源紧张淘汰的空闲连接数
+        CONN_BUSY,       //连接由空闲转为处理中的次数
+        CONN_IDLE,       //连接由处理中回到空闲的次数
+        QUEUE_PUSH,      //放入线程池请求队列的任务数
+        QUEUE_POP,       //工作线程取出的任务数
+        COUNTER_COUNT
+    };
+
+    //请求按路由分类
+    enum route
+    {
+        ROUTE_OTHER,     //没有走到生成响应这一步的请求，例如报文有语法错误
+        ROUTE_STATIC,    //静态页面和文件
+        ROUTE_LOGIN,
+        ROUTE_REGISTER,
+        ROUTE_METRICS,
+        ROUTE_COUNT
+    };
+
+    //请求按状态码分类
+    enum status
+    {
+        STATUS_200,
+        STATUS_403,
+        STATUS_404,
+        STATUS_500,
+        STATUS_503,
+        STATUS_OTHER,
+        STATUS_COUNT
+    };
+
+    //延迟直方图，请求耗时按路由各一个
+    enum histogram_id
+    {
+        HIST_QUEUE_WAIT = ROUTE_COUNT, //任务在线程池请求队列中等待的时间
+        HIST_DB_WAIT,                  //从连接池取数据库连接的等待时间
+        HIST_LOOP_LAG,                 //主线程一轮事件循环的耗时，启用看门狗时记录
+        HIST_COUNT
+    };
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static metrics *get_instance()
+    {
+        static metrics instance;
+        return &instance;
+    }
+
+    //path为输出指标的URL，为NULL或空串时不启用；须在工作线程创建之前调用
+    void init(const char *path);
+    bool enabled() const { return m_enabled; }
+    const char *path() const { return m_path; }
+
+    void inc(counter c, uint64_t n = 1)
+    {
+        if (m_enabled)
+            bump(local()->counters[c], n);
+    }
+    //记录一个完成的请求及其耗时（微秒）
+    void request(int route, int status, uint64_t us)
+    {
+        if (!m_enabled)
+            return;
+        thread_stats *s = local();
+        bump(s->requests[route][status_index(status)], 1);
+        observe(s->hist[route], us);
+    }
+    //向直方图记录一次耗时（微秒）
+    void observe(histogram_id id, uint64_t us)
+    {
+        if (m_enabled)
+            observe(local()->hist[id], us);
+    }
+
+    //汇总所有线程的数据，连同当前打开的连接数等一起按Prometheus文本格式追加到out
+    void render(std::string &out, int open_connections);
+
+    //单调时钟，微秒
+    static uint64_t now_us()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+private:
+    metrics();
+    ~metrics() {}
+
+    struct histogram
+    {
+        std::atomic<uint64_t> buckets[BUCKET_COUNT + 1];
+        std::atomic<uint64_t> sum; //微秒
+    };
+
+    //一个线程的私有块，按缓存行对齐，相邻线程的块不会落在同一缓存行上
+    struct alignas(64) thread_stats
+    {
+        std::atomic<uint64_t> counters[COUNTER_COUNT];
+        std::atomic<uint64_t> requests[ROUTE_COUNT][STATUS_COUNT];
+        histogram hist[HIST_COUNT];
+    };
+
+    //单写者，不需要原子的读-改-写；超过上限后共用的块可能少计
+    static void bump(std::atomic<uint64_t> &v, uint64_t n)
+    {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void observe(histogram &h, uint64_t us)
+    {
+        bump(h.buckets[bucket_of(us)], 1);
+        bump(h.sum, us);
+    }
+    int bucket_of(uint64_t us) const;
+    static int status_index(int status);
+
+    thread_stats *local()
+    {
+        thread_stats *s = t_stats;
+        return s ? s : register_thread();
+    }
+    thread_stats *register_thread();
+
+    void render_histogram(std::string &out, const char *name, const char *labels, const uint64_t *buckets,
+                          uint64_t sum);
+
+    static thread_local thread_stats *t_stats;
+
+private:
+    bool m_enabled;
+    char m_path[MAX_PATH];
+    uint64_t m_bounds[BUCKET_COUNT]; //各桶的上界（微秒，含）
+    thread_stats *m_stats[MAX_THREADS];
+    std::atomic<int> m_count;
+    locker m_register_lock;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "watchdog.h"
+#include "../trace/request_tracer.h"
+#include "../log/log.h"
+
+thread_local watchdog::slot *watchdog::t_slot = NULL;
+
+static const char *role_names[] = {"main", "worker"};
+
+watchdog::watchdog() : m_threshold_ns(0), m_close_log(0), m_count(0), m_started(false)
+{
+    memset(m_slots, 0, sizeof(m_slots));
+    for (int i = 0; i < ROLE_COUNT; ++i)
+        m_stalls[i].store(0);
+}
+
+void watchdog::init(int threshold_ms, int close_log)
+{
+    m_threshold_ns = threshold_ms > 0 ? (uint64_t)threshold_ms * 1000000 : 0;
+    m_close_log = close_log;
+}
+
+bool watchdog::start()
+{
+    if (!enabled() || m_started)
+        return true;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker, this) != 0)
+        return false;
+    pthread_detach(tid);
+    m_started = true;
+    return true;
+}
+
+void watchdog::attach(int role)
+{
+    if (!enabled() || t_slot)
+        return;
+    m_register_lock.lock();
+    int n = m_count.load(std::memory_order_relaxed);
+    if (n < MAX_THREADS)
+    {
+        void *mem = NULL;
+        if (0 == posix_memalign(&mem, 64, sizeof(slot)))
+        {
+            slot *s = (slot *)mem;
+            s->busy_since.store(0);
+            s->stage.store(-1);
+            s->fd.store(-1);
+            s->gen.store(0);
+            s->seq.store(0);
+            s->role = role;
+            s->tid = (pid_t)syscall(SYS_gettid);
+            s->reported = 0;
+            m_slots[n] = s;
+            m_count.store(n + 1, std::memory_order_release);
+            t_slot = s;
+        }
+    }
+    m_register_lock.unlock();
+}
+
+void *watchdog::worker(void *arg)
+{
+    watchdog *dog = (watchdog *)arg;
+    dog->run();
+    return dog;
+}
+
+void watchdog::run()
+{
+    //每隔阈值的四分之一检查一次，卡住的线程最迟在1.25倍阈值时被发现
+    useconds_t interval = (useconds_t)(m_threshold_ns / 4000);
+    if (interval < 1000)
+        interval = 1000;
+    while (true)
+    {
+        usleep(interval);
+        check();
+    }
+}
+
+void watchdog::check()
+{
+    uint64_t now = now_ns();
+    int n = m_count.load(std::memory_order_acquire);
+    for (int i = 0; i < n; ++i)
+    {
+        slot *s = m_slots[i];
+        uint64_t since = s->busy_since.load(std::memory_order_acquire);
+        if (0 == since || now < since || now - since < m_threshold_ns || s->reported == since)
+            continue;
+        //同一轮循环或同一个任务只报告一次
+        s->reported = since;
+        m_stalls[s->role].fetch_add(1, std::memory_order_relaxed);
+
+        //阶段和请求由被监视线程随时改写，这里读到的是检查时刻的近似值
+        int stage = s->stage.load(std::memory_order_relaxed);
+        if (stage >= 0)
+        {
+            LOG_WARN("watchdog: %s thread %d busy for %llu ms, stage %s, request fd %d gen %u seq %u",
+                     role_names[s->role], (int)s->tid, (unsigned long long)((now - since) / 1000000),
+                     request_tracer::stage_name(stage), s->fd.load(std::memory_order_relaxed),
+                     s->gen.load(std::memory_order_relaxed), s->seq.load(std::memory_order_relaxed));
+        }
+        else
+        {
+            LOG_WARN("watchdog: %s thread %d busy for %llu ms, not in a request stage", role_names[s->role],
+                     (int)s->tid, (unsigned long long)((now - since) / 1000000));
+        }
+    }
+}
+
+void watchdog::snapshot(uint64_t *stalls, uint64_t *busy_ns)
+{
+    uint64_t now = now_ns();
+    for (int r = 0; r < ROLE_COUNT; ++r)
+    {
+        stalls[r] = m_stalls[r].load(std::memory_order_relaxed);
+        busy_ns[r] = 0;
+    }
+    int n = m_count.load(std::memory_order_acquire);
+    for (int i = 0; i < n; ++i)
+    {
+        slot *s = m_slots[i];
+        uint64_t since = s->busy_since.load(std::memory_order_acquire);
+        if (since && now > since && now - since > busy_ns[s->role])
+            busy_ns[s->role] = now - since;
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+//以单例模式实现的看门狗：主线程每轮事件循环、工作线程每个任务开始时记下开始时间（心跳），结束时清零；
+//处理请求的各阶段（trace_scope）把当前阶段和请求写入本线程的槽位。
+//看门狗线程定期检查各槽位，某个线程的一轮循环或一个任务超过阈值仍未结束时，记录它卡在哪个请求的哪个阶段并计数，
+//每次卡住只报告一次。主循环每轮的耗时（即新到事件最多要等多久才被处理）记入运行指标的直方图。
+//各槽位按缓存行对齐，只由所属线程写入，记录心跳只是一次时钟读取和几次relaxed写入。
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <atomic>
+#include "../lock/locker.h"
+
+class watchdog
+{
+public:
+    static const int MAX_THREADS = 256; //登记槽位的线程数上限，超过的线程不受监视
+
+    //被监视线程的角色
+    enum role
+    {
+        ROLE_MAIN,   //主线程的事件循环
+        ROLE_WORKER, //线程池的工作线程
+        ROLE_COUNT
+    };
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static watchdog *get_instance()
+    {
+        static watchdog instance;
+        return &instance;
+    }
+
+    //threshold_ms为判定卡住的阈值，为0时不启用；须在工作线程创建之前调用
+    void init(int threshold_ms, int close_log);
+    bool enabled() const { return m_threshold_ns > 0; }
+    //启动看门狗线程
+    bool start();
+
+    //被监视的线程开始运行时调用一次，登记自己的槽位
+    void attach(int role);
+    //开始一轮循环或一个任务
+    void busy()
+    {
+        slot *s = t_slot;
+        if (s)
+            s->busy_since.store(now_ns(), std::memory_order_release);
+    }
+    //结束本轮循环或本个任务，返回经过的纳秒数，没有登记时返回0
+    uint64_t idle()
+    {
+        slot *s = t_slot;
+        if (!s)
+            return 0;
+        uint64_t since = s->busy_since.load(std::memory_order_relaxed);
+        s->busy_since.store(0, std::memory_order_relaxed);
+        s->stage.store(-1, std::memory_order_relaxed);
+        return since ? now_ns() - since : 0;
+    }
+    //进入请求的一个阶段，返回之前所处的阶段，离开时用leave恢复
+    static int enter(int stage, int fd, unsigned int gen, unsigned int seq)
+    {
+        slot *s = t_slot;
+        if (!s)
+            return -1;
+        int prev = s->stage.load(std::memory_order_relaxed);
+        s->fd.store(fd, std::memory_order_relaxed);
+        s->gen.store(gen, std::memory_order_relaxed);
+        s->seq.store(seq, std::memory_order_relaxed);
+        s->stage.store(stage, std::memory_order_relaxed);
+        return prev;
+    }
+    static void leave(int prev)
+    {
+        slot *s = t_slot;
+        if (s)
+            s->stage.store(prev, std::memory_order_relaxed);
+    }
+
+    //各角色累计卡住的次数，以及当前正在进行的循环或任务中最长的已耗时（纳秒）
+    void snapshot(uint64_t *stalls, uint64_t *busy_ns);
+
+    static uint64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+private:
+    watchdog();
+    ~watchdog() {}
+
+    struct alignas(64) slot
+    {
+        std::atomic<uint64_t> busy_since; //本轮循环或本个任务的开始时间，0表示空闲
+        std::atomic<int> stage;           //当前阶段（request_tracer::stage），-1表示不在处理请求
+        std::atomic<int> fd;              //当前或最近处理的请求
+        std::atomic<unsigned int> gen;
+        std::atomic<unsigned int> seq;
+        int role;
+        pid_t tid;
+        uint64_t reported; //已报告过的busy_since，只由看门狗线程读写
+    };
+
+    static void *worker(void *arg);
+    void run();
+    void check();
+
+    static thread_local slot *t_slot;
+
+private:
+    uint64_t m_threshold_ns;
+    int m_close_log;
+    slot *m_slots[MAX_THREADS];
+    std::atomic<int> m_count;
+    locker m_register_lock;
+    std::atomic<uint64_t> m_stalls[ROLE_COUNT];
+    bool m_started;
+};
+
+#endif
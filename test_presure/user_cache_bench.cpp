@@ -0,0 +1,230 @@
+//用户缓存压力测试：分别载入N个用户，比较原来的 map<string,string> 与分片哈希表 user_cache 的
+//载入耗时、内存占用、多线程登录校验的吞吐，以及并发注册（占名、提交）的吞吐。
+//用法：./user_cache_bench [-t 线程数] [-n 每线程查找次数] [-m 0|1 是否测试map] 用户数 [用户数...]
+//例如：./user_cache_bench 1000000 10000000
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include "../http/user_cache.h"
+
+using namespace std;
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//当前进程的常驻内存，MB
+static double rss_mb()
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    long pages = 0, resident = 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static void make_name(char *buf, long i) { sprintf(buf, "user%ld", i); }
+static void make_pass(char *buf, long i) { sprintf(buf, "pw%ld", i * 7919 % 1000003); }
+
+//伪随机数，各线程独立
+static inline unsigned long next_rand(unsigned long *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+struct lookup_arg
+{
+    long users;
+    long lookups;
+    int id;
+    bool use_map;
+    map<string, string> *users_map;
+    long hits;
+};
+
+static void *lookup_worker(void *p)
+{
+    lookup_arg *a = (lookup_arg *)p;
+    unsigned long seed = 88172645463325252UL + a->id;
+    char name[32], pass[32];
+    long hits = 0;
+    user_cache *cache = user_cache::get_instance();
+    for (long i = 0; i < a->lookups; ++i)
+    {
+        //十分之一查找不存在的用户
+        long k = next_rand(&seed) % (a->users + a->users / 10);
+        make_name(name, k);
+        make_pass(pass, k);
+        if (a->use_map)
+        {
+            map<string, string>::iterator it = a->users_map->find(name);
+            hits += (it != a->users_map->end() && it->second == pass);
+        }
+        else
+        {
+            hits += cache->check(name, pass);
+        }
+    }
+    a->hits = hits;
+    return NULL;
+}
+
+static double run_lookups(int threads, long users, long lookups, bool use_map, map<string, string> *m, long *hits)
+{
+    pthread_t tid[64];
+    lookup_arg args[64];
+    double t0 = now_sec();
+    for (int i = 0; i < threads; ++i)
+    {
+        args[i].users = users;
+        args[i].lookups = lookups;
+        args[i].id = i;
+        args[i].use_map = use_map;
+        args[i].users_map = m;
+        pthread_create(&tid[i], NULL, lookup_worker, &args[i]);
+    }
+    *hits = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(tid[i], NULL);
+        *hits += args[i].hits;
+    }
+    return threads * lookups / (now_sec() - t0);
+}
+
+struct register_arg
+{
+    long base;
+    long count;
+    int id;
+    long ok;
+};
+
+//每个线程注册一批新用户，其中一半的名字与相邻线程冲突，验证同名只有一个能占住
+static void *register_worker(void *p)
+{
+    register_arg *a = (register_arg *)p;
+    char name[32], pass[32];
+    long ok = 0;
+    user_cache *cache = user_cache::get_instance();
+    for (long i = 0; i < a->count; ++i)
+    {
+        long k = a->base + (i % 2 ? a->id * a->count + i : i);
+        make_name(name, k);
+        if (cache->reserve(name))
+        {
+            make_pass(pass, k);
+            cache->commit(name, pass);
+            ++ok;
+        }
+    }
+    a->ok = ok;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 4;
+    long lookups = 1000000;
+    int test_map = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            lookups = atol(optarg);
+            break;
+        case 'm':
+            test_map = atoi(optarg);
+            break;
+        }
+    }
+    if (threads < 1 || threads > 64 || optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-t threads] [-n lookups_per_thread] [-m 0|1] users [users...]\n", argv[0]);
+        return 2;
+    }
+
+    //user_cache是单例，各规模依次累加载入：第二轮只载入新增的部分
+    long loaded = 0;
+    for (int idx = optind; idx < argc; ++idx)
+    {
+        long users = atol(argv[idx]);
+        char name[32], pass[32];
+        long hits;
+        printf("== %ld users, %d threads, %ld lookups/thread\n", users, threads, lookups);
+
+        if (test_map)
+        {
+            map<string, string> *m = new map<string, string>;
+            double rss0 = rss_mb();
+            double t0 = now_sec();
+            for (long i = 0; i < users; ++i)
+            {
+                make_name(name, i);
+                make_pass(pass, i);
+                (*m)[name] = pass;
+            }
+            double load = now_sec() - t0;
+            double mem = rss_mb() - rss0;
+            double rate = run_lookups(threads, users, lookups, true, m, &hits);
+            printf("map        load %.2fs  mem %.0fMB  check %.2fM/s  hits %ld\n", load, mem, rate / 1e6, hits);
+            delete m;
+        }
+
+        user_cache *cache = user_cache::get_instance();
+        double t0 = now_sec();
+        for (long i = loaded; i < users; ++i)
+        {
+            make_name(name, i);
+            make_pass(pass, i);
+            cache->put(name, pass);
+        }
+        double load = now_sec() - t0;
+        loaded = users > loaded ? users : loaded;
+        double rate = run_lookups(threads, users, lookups, false, NULL, &hits);
+        printf("user_cache load %.2fs  mem %.0fMB  check %.2fM/s  hits %ld  size %zu\n", load,
+               cache->memory_bytes() / 1048576.0, rate / 1e6, hits, cache->size());
+
+        //并发注册：名字从已载入的用户之后开始，注册完的用户计入下一轮
+        pthread_t tid[64];
+        register_arg args[64];
+        long per = lookups / 4;
+        t0 = now_sec();
+        for (int i = 0; i < threads; ++i)
+        {
+            args[i].base = loaded;
+            args[i].count = per;
+            args[i].id = i;
+            pthread_create(&tid[i], NULL, register_worker, &args[i]);
+        }
+        long ok = 0;
+        for (int i = 0; i < threads; ++i)
+        {
+            pthread_join(tid[i], NULL);
+            ok += args[i].ok;
+        }
+        double reg = now_sec() - t0;
+        printf("register   %.2fM/s  registered %ld of %ld attempts\n", threads * per / reg / 1e6, ok, threads * per);
+        printf("rss %.0fMB\n", rss_mb());
+    }
+    return 0;
+}
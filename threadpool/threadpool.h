@@ -7,6 +7,9 @@
 #include <pthread.h>
 #include "../lock/locker.h"
 #include "../CGImysql/sql_connection_pool.h"
+#include "../metrics/metrics.h"
+#include "../trace/request_tracer.h"
+#include "../metrics/watchdog.h"
 
 template <typename T>
 class threadpool
@@ -23,11 +26,24 @@ private:
     static void *worker(void *arg);
     void run();
 
+    //队列中的任务，启用指标或追踪时记下入队时间（纳秒），用于统计排队等待的时间
+    struct work
+    {
+        T *request;
+        uint64_t enqueued_ns;
+    };
+    static uint64_t enqueue_time()
+    {
+        if (metrics::get_instance()->enabled() || request_tracer::get_instance()->enabled())
+            return request_tracer::now_ns();
+        return 0;
+    }
+
 private:
     int m_thread_number;        //线程池中的线程数
     int m_max_requests;         //请求队列中允许的最大请求数
     pthread_t *m_threads;       //保存线程池中线程id的数组，其大小为m_thread_number。注意：此处只申请了数组的首地址，未按数组大小申请内存，在使用数组的时候需要判断数组是否溢出
-    std::list<T *> m_workqueue; //请求队列
+    std::list<work> m_workqueue; //请求队列
     locker m_queuelocker;       //互斥锁，保护请求队列的互斥锁
     sem m_queuestat;            //信号量，是否有任务需要处理
     connection_pool *m_connPool;  //数据库连接池
@@ -63,6 +79,7 @@ threadpool<T>::~threadpool()
 template <typename T>
 bool threadpool<T>::append(T *request, int state)
 {
+    work item = {request, enqueue_time()};
     m_queuelocker.lock();
     if (m_workqueue.size() >= m_max_requests)
     {
@@ -70,22 +87,27 @@ bool threadpool<T>::append(T *request, int state)
         return false;
     }
     request->m_state = state;
-    m_workqueue.push_back(request);
+    request->hold();
+    m_workqueue.push_back(item);
     m_queuelocker.unlock();
+    metrics::get_instance()->inc(metrics::QUEUE_PUSH);
     m_queuestat.post();
     return true;
 }
 template <typename T>
 bool threadpool<T>::append_p(T *request)
 {
+    work item = {request, enqueue_time()};
     m_queuelocker.lock();
     if (m_workqueue.size() >= m_max_requests)
     {
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back(request);
+    request->hold();
+    m_workqueue.push_back(item);
     m_queuelocker.unlock();
+    metrics::get_instance()->inc(metrics::QUEUE_PUSH);
 
     //信号量提醒有任务要处理：信号量加一
     m_queuestat.post();
@@ -102,6 +124,13 @@ void *threadpool<T>::worker(void *arg)
 template <typename T>
 void threadpool<T>::run()
 {
+    //工作线程用过的数据库连接留在线程自己手里，下次取连接不经过连接池的锁
+    if (m_connPool)
+        m_connPool->BindThread();
+    metrics *stats = metrics::get_instance();
+    //每个任务开始、结束时更新心跳，处理时间超过阈值由看门狗报告
+    watchdog *dog = watchdog::get_instance();
+    dog->attach(watchdog::ROLE_WORKER);
     while (true)
     {
         m_queuestat.wait();// 信号量减一
@@ -113,12 +142,23 @@ void threadpool<T>::run()
             m_queuelocker.unlock();
             continue;
         }
-        T *request = m_workqueue.front();
+        work item = m_workqueue.front();
         m_workqueue.pop_front();
         m_queuelocker.unlock();
+        T *request = item.request;
+        if (item.enqueued_ns)
+        {
+            uint64_t now = request_tracer::now_ns();
+            stats->inc(metrics::QUEUE_POP);
+            stats->observe(metrics::HIST_QUEUE_WAIT, (now - item.enqueued_ns) / 1000);
+            if (request && request->traced())
+                request_tracer::get_instance()->record(request_tracer::STAGE_QUEUE, request->trace_key(),
+                                                       item.enqueued_ns, now);
+        }
 
         if (!request)
             continue;
+        dog->busy();
         // Reactor 模式
         if (1 == m_actor_model)
         {
@@ -126,9 +166,9 @@ void threadpool<T>::run()
             {
                 if (request->read_once())
                 {
-                    request->improv = 1;
-                    connectionRAII mysqlcon(&request->mysql, m_connPool);
                     request->process();
+                    //process内部可能已直接发送完响应并重置了对象（包括improv），所以处理完成后再通知主线程
+                    request->improv = 1;
                 }
                 else
                 {
@@ -150,22 +190,14 @@ void threadpool<T>::run()
             }
         }
         // Proactor 模式：工作线程只需处理业务逻辑
+        //不再为每个请求预先取一个数据库连接，需要访问数据库的请求自己取连接（优先取本线程留下的连接）或交给sql_async
         else
         {
-            connectionRAII mysqlcon(&request->mysql, m_connPool);
-            request->process();
-            /*若没有定义connectionRAII，则此处代码如下：
-
-            //从连接池中取出一个数据库连接
-            request->mysql = m_connPool->GetConnection();
-
-            //process(模板类中的方法,这里是http类)进行处理
             request->process();
-
-            //将数据库连接放回连接池
-            m_connPool->ReleaseConnection(request->mysql);
-            */
         }
+        //此后不再访问该连接
+        request->unhold();
+        dog->idle();
     }
 }
 #endif
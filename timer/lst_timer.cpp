@@ -1,5 +1,6 @@
 #include "lst_timer.h"
 #include "../http/http_conn.h"
+#include "../metrics/metrics.h"
 
 sort_timer_lst::sort_timer_lst()
 {
@@ -103,21 +104,43 @@ void sort_timer_lst::tick()
     
     time_t cur = time(NULL);
     util_timer *tmp = head;
+    util_timer *deferred = NULL;
     while (tmp)
     {
         if (cur < tmp->expire)
         {
             break;
         }
-        tmp->cb_func(tmp->user_data);
         head = tmp->next;
         if (head)
         {
             head->prev = NULL;
         }
-        delete tmp;
+        else
+        {
+            tail = NULL;
+        }
+        //工作线程仍在处理该连接，关闭会让它继续使用已归还的内存，推迟到下一次tick
+        if (tmp->user_data->conn->held())
+        {
+            tmp->next = deferred;
+            deferred = tmp;
+        }
+        else
+        {
+            tmp->cb_func(tmp->user_data);
+            metrics::get_instance()->inc(metrics::TIMER_EXPIRED);
+            delete tmp;
+        }
         tmp = head;
     }
+    while (deferred)
+    {
+        tmp = deferred;
+        deferred = deferred->next;
+        tmp->prev = tmp->next = NULL;
+        add_timer(tmp);
+    }
 }
 
 void sort_timer_lst::add_timer(util_timer *timer, util_timer *lst_head)
@@ -164,7 +187,8 @@ int Utils::setnonblocking(int fd)
 void Utils::addfd(int epollfd, int fd, bool one_shot, int TRIGMode)
 {
     epoll_event event;
-    event.data.fd = fd;
+    //与连接的事件标识保持一致：低32位为fd，高32位（代数）为0
+    event.data.u64 = (uint32_t)fd;
 
     if (1 == TRIGMode)
         event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
@@ -234,8 +258,9 @@ void cb_func(client_data *user_data)
     epoll_ctl(Utils::u_epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
 
-    //关闭文件描述符
+    //关闭文件描述符；等待数据库回调的连接此后不再使用这个fd
     close(user_data->sockfd);
+    user_data->conn->on_closed();
 
     //减少连接数
     http_conn::m_user_count--;
@@ -25,12 +25,14 @@
 #include "../log/log.h"
 
 class util_timer;
+class http_conn;
 
 struct client_data
 {
     sockaddr_in address;
     int sockfd;
     util_timer *timer;
+    http_conn *conn; //定时器关闭fd时通知连接对象，异步回调据此不再操作已关闭的fd
 };
 
 class util_timer
@@ -57,6 +59,8 @@ public:
     void adjust_timer(util_timer *timer);
     void del_timer(util_timer *timer);
     void tick(); // tick:打勾，（钟表）发出滴答声，滴答地走时
+    //链表按超时时间升序排列，超时时间=最近一次活动时间+3*TIMESLOT，所以表头就是最久没有活动的连接
+    util_timer *front() { return head; }
 
 private:
     void add_timer(util_timer *timer, util_timer *lst_head);
@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <map>
+#include <utility>
+#include <vector>
+#include "request_tracer.h"
+#include "../log/log.h"
+
+thread_local request_tracer::ring *request_tracer::t_ring = NULL;
+thread_local unsigned int request_tracer::t_counter = 0;
+
+request_tracer::ring *const request_tracer::NO_RING = (request_tracer::ring *)-1;
+
+//与stage枚举顺序一致
+static const char *stage_names[] = {"accept", "request", "read", "queue", "parse", "handle", "respond", "write"};
+
+const char *request_tracer::stage_name(int stage)
+{
+    return stage >= 0 && stage < STAGE_COUNT ? stage_names[stage] : "unknown";
+}
+
+request_tracer::request_tracer() : m_sample(0), m_close_log(0), m_count(0), m_dumping(false)
+{
+    memset(m_rings, 0, sizeof(m_rings));
+    m_dump_path[0] = '\0';
+}
+
+void request_tracer::init(int sample, int close_log)
+{
+    m_sample = sample > 0 ? sample : 0;
+    m_close_log = close_log;
+}
+
+//每个线程只在第一次记录时加锁登记一次，超过上限或分配失败的线程不记录
+request_tracer::ring *request_tracer::register_thread()
+{
+    ring *r = NULL;
+    m_register_lock.lock();
+    int n = m_count.load(std::memory_order_relaxed);
+    if (n < MAX_THREADS)
+    {
+        r = (ring *)calloc(1, sizeof(ring));
+        if (r)
+        {
+            r->tid = (pid_t)syscall(SYS_gettid);
+            m_rings[n] = r;
+            m_count.store(n + 1, std::memory_order_release);
+        }
+    }
+    m_register_lock.unlock();
+    t_ring = r ? r : NO_RING;
+    return r;
+}
+
+void request_tracer::record(int stage, const key &k, uint64_t begin, uint64_t end)
+{
+    ring *r = t_ring;
+    if (!r)
+        r = register_thread();
+    if (!r || NO_RING == r)
+        return;
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    event &e = r->events[h & (RING_SIZE - 1)];
+    e.begin = begin;
+    e.end = end;
+    e.k = k;
+    e.stage = stage;
+    r->head.store(h + 1, std::memory_order_release);
+}
+
+bool request_tracer::dump(const char *path)
+{
+    if (!enabled() || m_dumping.exchange(true))
+        return false;
+    if (path)
+    {
+        snprintf(m_dump_path, sizeof(m_dump_path), "%s", path);
+    }
+    else
+    {
+        time_t t = time(NULL);
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(m_dump_path, sizeof(m_dump_path), "./Trace_%Y%m%d_%H%M%S.json", &tm);
+    }
+
+    //写文件可能需要几十毫秒，不在主线程中进行
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dump_worker, this) != 0)
+    {
+        m_dumping.store(false);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+void *request_tracer::dump_worker(void *arg)
+{
+    request_tracer *tracer = (request_tracer *)arg;
+    tracer->write_file(tracer->m_dump_path);
+    tracer->m_dumping.store(false);
+    return NULL;
+}
+
+void request_tracer::write_file(const char *path)
+{
+    //先拷贝出各环形缓冲区的内容，再按拷贝后的head丢弃拷贝期间已被覆盖的记录
+    std::vector<std::pair<pid_t, event> > events;
+    int n = m_count.load(std::memory_order_acquire);
+    for (int i = 0; i < n; ++i)
+    {
+        ring *r = m_rings[i];
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t start = head > (uint64_t)RING_SIZE ? head - RING_SIZE : 0;
+        std::vector<event> copy(head - start);
+        for (uint64_t j = start; j < head; ++j)
+            copy[j - start] = r->events[j & (RING_SIZE - 1)];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = r->head.load(std::memory_order_relaxed);
+        //写入方正在填写的是序号为now的记录，它覆盖的是序号now - RING_SIZE
+        uint64_t valid = now >= (uint64_t)RING_SIZE ? now - RING_SIZE + 1 : 0;
+        for (uint64_t j = start > valid ? start : valid; j < head; ++j)
+            events.push_back(std::make_pair(r->tid, copy[j - start]));
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        LOG_ERROR("trace dump: open %s failed, errno is %d", path, errno);
+        return;
+    }
+
+    //同一请求的各阶段使用同一个异步事件编号，Perfetto据此把它们放在同一条轨道上
+    std::map<std::pair<uint64_t, unsigned int>, unsigned int> ids;
+    int pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        pid_t tid = events[i].first;
+        const event &e = events[i].second;
+        if (e.stage < 0 || e.stage >= STAGE_COUNT)
+            continue;
+        std::pair<uint64_t, unsigned int> req(((uint64_t)e.k.gen << 32) | (uint32_t)e.k.fd, e.k.seq);
+        std::map<std::pair<uint64_t, unsigned int>, unsigned int>::iterator it = ids.find(req);
+        unsigned int id;
+        if (it != ids.end())
+            id = it->second;
+        else
+        {
+            id = ids.size() + 1;
+            ids[req] = id;
+        }
+
+        const char *name = stage_names[e.stage];
+        if (e.begin == e.end)
+        {
+            fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"n\",\"id\":%u,\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%llu.%03u,\"args\":{\"fd\":%d,\"seq\":%u}}",
+                    first ? "" : ",\n", name, id, pid, (int)tid, (unsigned long long)(e.begin / 1000),
+                    (unsigned int)(e.begin % 1000), e.k.fd, e.k.seq);
+        }
+        else
+        {
+            fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"b\",\"id\":%u,\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%llu.%03u,\"args\":{\"fd\":%d,\"seq\":%u}},\n",
+                    first ? "" : ",\n", name, id, pid, (int)tid, (unsigned long long)(e.begin / 1000),
+                    (unsigned int)(e.begin % 1000), e.k.fd, e.k.seq);
+            fprintf(fp, "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"e\",\"id\":%u,\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%llu.%03u}",
+                    name, id, pid, (int)tid, (unsigned long long)(e.end / 1000), (unsigned int)(e.end % 1000));
+        }
+        first = false;
+    }
+    fprintf(fp, "\n]}\n");
+    bool ok = 0 == ferror(fp);
+    if (0 != fclose(fp))
+        ok = false;
+    if (ok)
+    {
+        LOG_INFO("trace dump: %d events of %d requests written to %s", (int)events.size(), (int)ids.size(), path);
+    }
+    else
+    {
+        LOG_ERROR("trace dump: write %s failed", path);
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef REQUEST_TRACER_H
+#define REQUEST_TRACER_H
+//以单例模式实现的请求阶段追踪：每N个请求采样一个，在读取、排队、解析、生成响应、发送等阶段的边界读取单调时钟，
+//把阶段的起止时间写入当前线程独占的环形缓冲区（单写者，写满后覆盖最旧的记录，不加锁）。
+//收到SIGUSR1时由后台线程拷贝出所有环形缓冲区中的记录，导出为Chrome trace-event格式的JSON文件，
+//可以直接载入Perfetto或chrome://tracing：同一请求的各阶段按异步事件归在一条轨道上，跨线程也能看清每一段等待。
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <atomic>
+#include "../lock/locker.h"
+#include "../metrics/watchdog.h"
+
+class request_tracer
+{
+public:
+    static const int MAX_THREADS = 256;   //登记环形缓冲区的线程数上限，超过的线程不记录
+    static const int RING_SIZE = 8192;    //每个线程保留的最近阶段记录条数，必须为2的幂
+
+    //请求经过的阶段
+    enum stage
+    {
+        STAGE_ACCEPT,  //接受连接（瞬时事件），只出现在连接上的第一个请求中
+        STAGE_REQUEST, //第一个字节到达到最后一个字节发出，包含以下各阶段
+        STAGE_READ,    //一次read_once
+        STAGE_QUEUE,   //在线程池请求队列中等待
+        STAGE_PARSE,   //process_read，包含do_request
+        STAGE_HANDLE,  //do_request：查找文件、mmap、访问数据库
+        STAGE_RESPOND, //process_write
+        STAGE_WRITE,   //一次write
+        STAGE_COUNT
+    };
+
+    //一个请求的标识：连接的fd、代数和该连接上的请求序号
+    struct key
+    {
+        int fd;
+        unsigned int gen;
+        unsigned int seq;
+    };
+
+    //C++11以后,使用局部静态变量懒汉不用加锁
+    static request_tracer *get_instance()
+    {
+        static request_tracer instance;
+        return &instance;
+    }
+
+    //每sample个请求追踪一个，为0时不启用；须在工作线程创建之前调用
+    void init(int sample, int close_log);
+    bool enabled() const { return m_sample > 0; }
+
+    //开始一个新请求时调用，返回是否追踪该请求；各线程分别计数
+    bool sample()
+    {
+        if (m_sample <= 0)
+            return false;
+        return 0 == t_counter++ % m_sample;
+    }
+
+    //记录一个阶段，时间为now_ns的返回值；begin等于end时为瞬时事件
+    void record(int stage, const key &k, uint64_t begin, uint64_t end);
+
+    //在后台线程中把所有环形缓冲区导出到path（NULL时按当前时间命名），上一次导出尚未完成时返回false
+    bool dump(const char *path);
+
+    //阶段的名字，用于导出和看门狗日志
+    static const char *stage_name(int stage);
+
+    //单调时钟，纳秒
+    static uint64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+private:
+    request_tracer();
+    ~request_tracer() {}
+
+    struct event
+    {
+        uint64_t begin;
+        uint64_t end;
+        key k;
+        int stage;
+    };
+
+    //一个线程的环形缓冲区：写入方填好记录后再推进head，导出时按head判断哪些记录在拷贝期间被覆盖
+    struct ring
+    {
+        std::atomic<uint64_t> head;
+        pid_t tid;
+        event events[RING_SIZE];
+    };
+
+    ring *register_thread();
+
+    static void *dump_worker(void *arg);
+    void write_file(const char *path);
+
+    static thread_local ring *t_ring;
+    static ring *const NO_RING; //登记失败的线程记为NO_RING，之后不再尝试登记
+    static thread_local unsigned int t_counter;
+
+private:
+    int m_sample;
+    int m_close_log;
+    ring *m_rings[MAX_THREADS];
+    std::atomic<int> m_count;
+    locker m_register_lock;
+    std::atomic<bool> m_dumping;
+    char m_dump_path[256];
+};
+
+//在作用域结束时记录一个阶段；只有被采样的请求才读时钟。请求的标识在开始时取出，
+//阶段结束前请求可能已由其他线程完成（例如注册交给sql_async之后），结束时不再访问连接对象。
+//不论是否采样，都把当前阶段告诉看门狗，线程卡住时可以知道卡在哪个请求的哪个阶段
+class trace_scope
+{
+public:
+    trace_scope(bool traced, const request_tracer::key &k, int stage)
+        : m_traced(traced), m_key(k), m_stage(stage), m_begin(traced ? request_tracer::now_ns() : 0)
+    {
+        m_prev_stage = watchdog::enter(stage, k.fd, k.gen, k.seq);
+    }
+    ~trace_scope()
+    {
+        if (m_traced)
+            request_tracer::get_instance()->record(m_stage, m_key, m_begin, request_tracer::now_ns());
+        watchdog::leave(m_prev_stage);
+    }
+    //提前以end结束该阶段，之后析构时不再记录
+    void finish(uint64_t end)
+    {
+        if (m_traced)
+            request_tracer::get_instance()->record(m_stage, m_key, m_begin, end);
+        m_traced = false;
+    }
+
+private:
+    bool m_traced;
+    request_tracer::key m_key;
+    int m_stage;
+    uint64_t m_begin;
+    int m_prev_stage;
+};
+
+#endif
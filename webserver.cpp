@@ -1,9 +1,27 @@
 #include "webserver.h"
+#include "./http/user_loader.h"
+#include "./CGImysql/sql_async.h"
+#include "./CGImysql/mysql_user_store.h"
+#include "./CGImysql/sqlite_user_store.h"
+#include "./http/session_store.h"
+#include "./trace/request_tracer.h"
+#include "./metrics/watchdog.h"
 
 WebServer::WebServer()
 {
-    //http_conn类对象
-    users = new http_conn[MAX_FD];
+    //把打开文件数的软限制提升到硬限制，连接表的容量随之确定
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    m_max_fd = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (rlim_t)MAX_FD_LIMIT) ? MAX_FD_LIMIT : (int)rl.rlim_cur;
+
+    //http_conn类对象，按fd分段，段在第一次用到时才分配
+    users.init(m_max_fd);
 
     //root文件夹路径
     char server_path[200];
@@ -14,7 +32,9 @@ WebServer::WebServer()
     strcat(m_root, root);// 将源字符串复制到目标字符串的后面，源字符串的第一个字符会覆盖目标字符串的'\0'字符
 
     //定时器
-    users_timer = new client_data[MAX_FD];
+    users_timer.init(m_max_fd);
+
+    m_store = NULL;
 }
 
 WebServer::~WebServer()
@@ -23,13 +43,20 @@ WebServer::~WebServer()
     close(m_listenfd);
     close(m_pipefd[1]);
     close(m_pipefd[0]);
-    delete[] users;
-    delete[] users_timer;
     delete m_pool;
+    //工作线程是分离的，可能仍持有存储的指针，只停止不释放
+    if (m_store)
+        m_store->stop();
 }
 
 void WebServer::init(int port, string user, string passWord, string databaseName, int log_write, 
-                     int opt_linger, int trigmode, int sql_num, int thread_num, int close_log, int actor_model)
+                     int opt_linger, int trigmode, int sql_num, int thread_num, int close_log, int actor_model,
+                     int evict_fd_pct, int evict_mem_mb, int log_block,
+                     int log_flush_ms, int log_flush_kb, int log_sync_error,
+                     int log_level, int log_sample, int log_format,
+                     int access_log, int log_rotate_mb, int log_gzip, int log_keep,
+                     int user_snapshot, int user_store, int session_ttl, string metrics_path,
+                     int trace_sample, int watchdog_ms)
 {
     m_port = port;
     m_user = user;
@@ -38,10 +65,40 @@ void WebServer::init(int port, string user, string passWord, string databaseName
     m_sql_num = sql_num;
     m_thread_num = thread_num;
     m_log_write = log_write;
+    m_log_block = log_block;
+    m_log_flush_ms = log_flush_ms;
+    m_log_flush_kb = log_flush_kb;
+    m_log_sync_error = log_sync_error;
+    m_log_level = log_level;
+    m_log_sample = log_sample;
+    m_log_format = log_format;
+    m_access_log = access_log;
+    m_log_rotate_mb = log_rotate_mb;
+    m_log_gzip = log_gzip;
+    m_log_keep = log_keep;
+    m_user_snapshot = user_snapshot;
+    m_user_store = user_store;
+    m_session_ttl = session_ttl;
+    m_metrics_path = metrics_path;
+    m_trace_sample = trace_sample;
+    m_watchdog_ms = watchdog_ms;
     m_OPT_LINGER = opt_linger;
     m_TRIGMode = trigmode;
     m_close_log = close_log;
     m_actormodel = actor_model;
+
+    //连接数达到高水位后淘汰最久未活动的空闲连接，直到低于低水位（高水位再减去5%的容量）
+    m_evict_fd_pct = evict_fd_pct;
+    m_evict_fd_high = (long long)m_max_fd * evict_fd_pct / 100;
+    m_evict_fd_low = m_evict_fd_high - m_max_fd / 20;
+    if (m_evict_fd_low < 0)
+        m_evict_fd_low = 0;
+    m_evict_mem = (long)evict_mem_mb * 1024 * 1024;
+
+    //运行指标：各线程读取启用标志时不加锁，须在创建工作线程之前设置
+    metrics::get_instance()->init(m_metrics_path.c_str());
+    request_tracer::get_instance()->init(m_trace_sample, m_close_log);
+    watchdog::get_instance()->init(m_watchdog_ms, m_close_log);
 }
 
 //触发组合模式: listenfd 触发模式 + connfd 触发模式
@@ -74,29 +131,71 @@ void WebServer::trig_mode()
 }
 /*
 log_write()只是初始化用单例模式实现的Log对象，并打开一个文件（文件描述符存储在Log对象的成员变量m_fp中），
-若为异步写日志，则还会创建一个阻塞队列和一个从阻塞队列中取日志信息的线程（该线程将取到的日志信息写入到m_fp中），该线程会一直运行;
+若为异步写日志，则还会启动一个刷盘线程，各线程把日志写入自己的环形缓冲区（每个线程256K），刷盘线程批量取出后写入文件，该线程会一直运行;
 若为同步写日志，则只是打开一个文件。
+访问日志与是否关闭调试日志无关，开启时总是异步写入。
+两种日志都按天（访问日志除外）、按大小切分，切分出的旧文件由log_archiver的后台线程关闭、压缩并按保留个数清理。
 */
 void WebServer::log_write()
 {
+    //先于两种日志启动，它们初始化时向log_archiver登记
+    if (0 == m_close_log || 1 == m_access_log)
+        log_archiver::get_instance()->init(1 == m_log_gzip, m_log_keep);
+
+    long rotate_bytes = (long)m_log_rotate_mb * 1024 * 1024;
     if (0 == m_close_log)
     {
+        //日志级别与采样间隔在日志宏中直接读取，初始化前先设置好
+        Log::m_min_level = m_log_level;
+        Log::m_sample_rate = m_log_sample > 1 ? m_log_sample : 1;
+
         //初始化日志
         if (1 == m_log_write)// 1表示异步写日志
-            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 800);
+            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 256 * 1024, 1 == m_log_block,
+                                      m_log_flush_ms, m_log_flush_kb * 1024, 1 == m_log_sync_error, 1 == m_log_format, rotate_bytes);
         else
-            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 0);
+            Log::get_instance()->init("./ServerLog", m_close_log, 2000, 800000, 0, false,
+                                      m_log_flush_ms, m_log_flush_kb * 1024, 1 == m_log_sync_error, 1 == m_log_format, rotate_bytes);
+    }
+
+    if (1 == m_access_log)
+    {
+        if (!access_log::get_instance()->init("./AccessLog", 256 * 1024, rotate_bytes,
+                                              1 == m_log_block, m_log_flush_ms))
+            LOG_ERROR("%s", "access log init failure");
     }
 }
 
 void WebServer::sql_pool()
 {
-    //初始化数据库连接池
+    //登录会话：密钥在启动时随机生成，取不到随机数时不启用
+    if (!session_store::get_instance()->init(m_session_ttl))
+        LOG_ERROR("%s", "session store init failure");
+
+    //连接池在SQLite模式下不建立连接，工作线程仍向它登记
     m_connPool = connection_pool::GetInstance();
-    m_connPool->init("localhost", m_user, m_passWord, m_databaseName, 3306, m_sql_num, m_close_log);
+    if (1 == m_user_store)
+    {
+        //嵌入式SQLite：不需要MySQL服务器，用户表存放在本地文件中
+        m_store = new sqlite_user_store("./UserStore.db", m_close_log);
+        users[0].initmysql_result(m_store);
+        return;
+    }
+
+    //一半连接交给非阻塞执行器处理注册，其余留在连接池中，供载入用户表和载入完成前的单独查询使用；
+    //客户端库不支持非阻塞接口时全部留在连接池
+    int async_num = m_sql_num / 2;
+    if (!sql_async::get_instance()->init("localhost", m_user, m_passWord, m_databaseName, 3306, async_num, m_close_log))
+        async_num = 0;
+
+    //初始化数据库连接池
+    m_connPool->init("localhost", m_user, m_passWord, m_databaseName, 3306, m_sql_num - async_num, m_close_log);
 
-    //初始化数据库读取表
-    users->initmysql_result(m_connPool);
+    //在后台载入用户表，不等待载入完成；使用快照时只补读快照之后新增的行
+    if (1 == m_user_snapshot)
+        user_loader::get_instance()->set_snapshot("./UserSnapshot", m_databaseName.c_str());
+    m_store = new mysql_user_store(m_connPool);
+    users[0].initmysql_result(m_store);
 }
 
 void WebServer::thread_pool()
@@ -151,10 +250,12 @@ void WebServer::eventListen()
     assert(ret != -1);
     utils.setnonblocking(m_pipefd[1]);//从管道的 m_pipefd[1] 写入，m_pipefd[0] 读出
     utils.addfd(m_epollfd, m_pipefd[0], false, 0);
+    sql_async::get_instance()->attach(m_epollfd);
 
     utils.addsig(SIGPIPE, SIG_IGN);
     utils.addsig(SIGALRM, utils.sig_handler, false);
     utils.addsig(SIGTERM, utils.sig_handler, false);
+    utils.addsig(SIGUSR1, utils.sig_handler, false);
 
     alarm(TIMESLOT);
 
@@ -165,12 +266,14 @@ void WebServer::eventListen()
 
 void WebServer::timer(int connfd, struct sockaddr_in client_address)
 {
-    users[connfd].init(connfd, client_address, m_root, m_CONNTrigmode, m_close_log, m_user, m_passWord, m_databaseName);
+    users[connfd].init(connfd, client_address, m_root, m_CONNTrigmode, m_close_log);
+    metrics::get_instance()->inc(metrics::ACCEPTS);
 
     //初始化client_data数据
     //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
     users_timer[connfd].address = client_address;
     users_timer[connfd].sockfd = connfd;
+    users_timer[connfd].conn = &users[connfd];
     util_timer *timer = new util_timer;
     timer->user_data = &users_timer[connfd];
     timer->cb_func = cb_func;
@@ -188,11 +291,12 @@ void WebServer::adjust_timer(util_timer *timer)
     timer->expire = cur + 3 * TIMESLOT;
     utils.m_timer_lst.adjust_timer(timer);
 
-    LOG_INFO("%s", "adjust timer once");
+    LOG_INFO_SAMPLED("%s", "adjust timer once");
 }
 
 void WebServer::deal_timer(util_timer *timer, int sockfd)
 {
+    //走到这里时没有工作线程持有该连接，cb_func关闭fd并归还它借用的内存
     timer->cb_func(&users_timer[sockfd]);
     if (timer)
     {
@@ -214,13 +318,15 @@ bool WebServer::dealclinetdata()
             LOG_ERROR("%s:errno is:%d", "accept error", errno);
             return false;
         }
-        if (http_conn::m_user_count >= MAX_FD)
+        //连接已满，先尝试淘汰一个空闲连接，仍然没有空位才拒绝
+        if (http_conn::m_user_count >= m_max_fd && evict_idle(1) == 0)
         {
             utils.show_error(connfd, "Internal server busy");
             LOG_ERROR("%s", "Internal server busy");
             return false;
         }
         timer(connfd, client_address);
+        check_pressure(false);
     }
 
     else // listenfd为 ET 模式
@@ -233,13 +339,14 @@ bool WebServer::dealclinetdata()
                 LOG_ERROR("%s:errno is:%d", "accept error", errno);
                 break;
             }
-            if (http_conn::m_user_count >= MAX_FD)
+            if (http_conn::m_user_count >= m_max_fd && evict_idle(1) == 0)
             {
                 utils.show_error(connfd, "Internal server busy");
                 LOG_ERROR("%s", "Internal server busy");
                 break;
             }
             timer(connfd, client_address);
+            check_pressure(false);
         }
         return false;
     }
@@ -276,6 +383,19 @@ bool WebServer::dealwithsignal(bool &timeout, bool &stop_server)
                 stop_server = true;
                 break;
             }
+            //导出请求追踪，写文件在后台线程中进行
+            case SIGUSR1:
+            {
+                if (request_tracer::get_instance()->dump(NULL))
+                {
+                    LOG_INFO("%s", "trace dump started");
+                }
+                else
+                {
+                    LOG_WARN("%s", "trace dump skipped: tracing disabled or previous dump in progress");
+                }
+                break;
+            }
             }
         }
     }
@@ -287,6 +407,9 @@ void WebServer::dealwithread(int sockfd)
     //创建定时器临时变量，将该连接对应的定时器取出来
     util_timer *timer = users_timer[sockfd].timer;
 
+    //连接上有数据到达，不再是空闲连接，不能被淘汰
+    users[sockfd].set_busy();
+
     //reactor
     if (1 == m_actormodel)
     {
@@ -317,7 +440,8 @@ void WebServer::dealwithread(int sockfd)
         //proactor
         if (users[sockfd].read_once())
         {
-            LOG_INFO("deal with the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
+            char ip[INET_ADDRSTRLEN];
+            LOG_INFO_SAMPLED("deal with the client(%s)", inet_ntop(AF_INET, &users[sockfd].get_address()->sin_addr, ip, sizeof(ip)));
 
             //若监测到读事件，将该事件放入请求队列
             m_pool->append_p(users + sockfd);
@@ -337,6 +461,7 @@ void WebServer::dealwithread(int sockfd)
 void WebServer::dealwithwrite(int sockfd)
 {
     util_timer *timer = users_timer[sockfd].timer;
+    users[sockfd].set_busy();
     //reactor
     if (1 == m_actormodel)
     {
@@ -366,7 +491,8 @@ void WebServer::dealwithwrite(int sockfd)
         //proactor
         if (users[sockfd].write())
         {
-            LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
+            char ip[INET_ADDRSTRLEN];
+            LOG_INFO_SAMPLED("send data to the client(%s)", inet_ntop(AF_INET, &users[sockfd].get_address()->sin_addr, ip, sizeof(ip)));
 
             if (timer)
             {
@@ -380,15 +506,101 @@ void WebServer::dealwithwrite(int sockfd)
     }
 }
 
+/*
+资源紧张时淘汰空闲连接。定时器链表按最近一次活动时间升序排列，相当于一条LRU链表，
+从表头开始找空闲连接（处于读状态且没有未处理完的请求数据），找到后按超时连接的流程关闭。
+正在被工作线程处理或有半个请求的连接不会被淘汰。
+*/
+int WebServer::evict_idle(int count)
+{
+    int evicted = 0;
+    int scanned = 0;
+    util_timer *tmp = utils.m_timer_lst.front();
+    while (tmp && evicted < count && scanned < count * EVICT_SCAN_FACTOR)
+    {
+        util_timer *next = tmp->next;
+        int sockfd = tmp->user_data->sockfd;
+        if (users[sockfd].try_evict())
+        {
+            deal_timer(tmp, sockfd);
+            ++evicted;
+        }
+        ++scanned;
+        tmp = next;
+    }
+
+    if (evicted > 0)
+    {
+        metrics::get_instance()->inc(metrics::EVICTED, evicted);
+        LOG_WARN("evict %d idle connections, %d connections left", evicted, http_conn::m_user_count);
+    }
+    return evicted;
+}
+
+//读取内核TCP套接字占用的内存，/proc/net/sockstat中TCP一行的mem字段，单位为页
+static long tcp_socket_memory()
+{
+    FILE *fp = fopen("/proc/net/sockstat", "r");
+    if (!fp)
+        return 0;
+
+    char line[256];
+    long pages = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        const char *mem = strstr(line, " mem ");
+        if (strncmp(line, "TCP:", 4) == 0 && mem)
+        {
+            pages = atol(mem + 5);
+            break;
+        }
+    }
+    fclose(fp);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+//检查连接数和内存是否超过高水位：
+//连接数在每次accept后检查，内存在每个时隙检查一次。空闲连接不持有缓冲池的内存，主要占用内核的套接字缓冲区，
+//所以只统计后者；缓冲池借出的内存属于处理中的请求，淘汰空闲连接也无法回收
+void WebServer::check_pressure(bool check_mem)
+{
+    if (m_evict_fd_pct > 0 && http_conn::m_user_count >= m_evict_fd_high)
+    {
+        evict_idle(http_conn::m_user_count - m_evict_fd_low);
+    }
+
+    if (check_mem && m_evict_mem > 0)
+    {
+        long used = tcp_socket_memory();
+        if (used >= m_evict_mem)
+        {
+            int batch = http_conn::m_user_count / 100;
+            evict_idle(batch > EVICT_MIN_BATCH ? batch : EVICT_MIN_BATCH);
+        }
+    }
+}
+
 void WebServer::eventLoop()
 {
     bool timeout = false;
     bool stop_server = false;
 
+    //看门狗监视主线程每一轮事件处理的耗时
+    watchdog *dog = watchdog::get_instance();
+    dog->attach(watchdog::ROLE_MAIN);
+    if (!dog->start())
+        LOG_ERROR("%s", "watchdog start failure");
+
     while (!stop_server)
     {
+        //上一轮处理完毕，记录其耗时，即这一轮期间到达的事件最多等待了多久
+        uint64_t lag = dog->idle();
+        if (lag)
+            metrics::get_instance()->observe(metrics::HIST_LOOP_LAG, lag / 1000);
+
         //等待所监控文件描述符上有事件的产生
         int number = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, -1);
+        dog->busy();
         if (number < 0 && errno != EINTR)
         {
             LOG_ERROR("%s", "epoll failure");
@@ -397,7 +609,24 @@ void WebServer::eventLoop()
 
         for (int i = 0; i < number; i++)
         {
-            int sockfd = events[i].data.fd;
+            //事件标识的低32位为fd，高32位为连接的代数
+            uint64_t token = events[i].data.u64;
+            int sockfd = (int)(uint32_t)token;
+            unsigned int gen = (unsigned int)(token >> 32);
+
+            //数据库连接上的事件：继续执行挂起的语句
+            if (sql_async::get_instance()->owns(sockfd))
+            {
+                sql_async::get_instance()->on_event(sockfd, events[i].events);
+                continue;
+            }
+
+            //fd已被关闭并分配给了新连接，这是旧连接残留的事件，直接丢弃
+            if (sockfd != m_listenfd && sockfd != m_pipefd[0] && users[sockfd].get_gen() != gen)
+            {
+                LOG_INFO("drop stale event on fd %d", sockfd);
+                continue;
+            }
 
             //处理新到的客户连接
             if (sockfd == m_listenfd)
@@ -434,6 +663,12 @@ void WebServer::eventLoop()
         if (timeout)
         {
             utils.timer_handler();
+            check_pressure(true);
+            sql_async::get_instance()->check_timeouts();
+            //关闭空闲过久的数据库连接，连接数回落到常驻数量
+            m_connPool->Maintain();
+            //清理过期的登录会话
+            session_store::get_instance()->expire();
 
             LOG_INFO("%s", "timer tick");
 
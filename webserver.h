@@ -11,13 +11,17 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 
 #include "./threadpool/threadpool.h"
 #include "./http/http_conn.h"
+#include "./log/access_log.h"
 
-const int MAX_FD = 65536;           //最大文件描述符
+const int MAX_FD_LIMIT = 1 << 24;   //RLIMIT_NOFILE为无穷大时，连接表容量的上限
 const int MAX_EVENT_NUMBER = 10000; //最大事件数
 const int TIMESLOT = 5;             //最小超时单位
+const int EVICT_SCAN_FACTOR = 8;    //淘汰空闲连接时，最多扫描待淘汰数量8倍的定时器
+const int EVICT_MIN_BATCH = 16;     //内存超过高水位时，每个时隙至少淘汰的连接数
 
 class WebServer
 {
@@ -27,7 +31,13 @@ public:
 
     void init(int port , string user, string passWord, string databaseName,
               int log_write , int opt_linger, int trigmode, int sql_num,
-              int thread_num, int close_log, int actor_model);
+              int thread_num, int close_log, int actor_model,
+              int evict_fd_pct, int evict_mem_mb, int log_block,
+              int log_flush_ms, int log_flush_kb, int log_sync_error,
+              int log_level, int log_sample, int log_format,
+              int access_log, int log_rotate_mb, int log_gzip, int log_keep,
+              int user_snapshot, int user_store, int session_ttl, string metrics_path,
+              int trace_sample, int watchdog_ms);
 
     void thread_pool();
     void sql_pool();
@@ -42,21 +52,42 @@ public:
     bool dealwithsignal(bool& timeout, bool& stop_server);
     void dealwithread(int sockfd);
     void dealwithwrite(int sockfd);
+    int evict_idle(int count);
+    void check_pressure(bool check_mem);
 
 public:
     //基础配置
     int m_port;//端口号,默认9006
     char *m_root; //网站根目录，文件夹内存放请求的资源和跳转的html文件
     int m_log_write;//日志写入方式，默认同步
+    int m_log_block;//异步日志缓冲区满时是否阻塞等待，默认丢弃
+    int m_log_flush_ms;//日志刷新间隔
+    int m_log_flush_kb;//日志积压多少KB后刷新
+    int m_log_sync_error;//ERROR日志是否立即刷新
+    int m_log_level;//运行时日志级别下限
+    int m_log_sample;//热点日志每隔多少次记录一次
+    int m_log_format;//日志格式，0文本，1二进制
+    int m_access_log;//是否记录访问日志
+    int m_log_rotate_mb;//日志文件切分大小
+    int m_log_gzip;//是否压缩已切分的日志文件
+    int m_log_keep;//每个日志保留的已切分文件个数
+    int m_user_snapshot;//是否使用用户表快照
+    int m_user_store;//用户存储后端，0为MySQL，1为SQLite
+    int m_session_ttl;//登录会话有效期（秒），0为不启用
+    string m_metrics_path;//输出运行指标的URL，为空时不启用
+    int m_trace_sample;//每N个请求追踪一个，0为不追踪
+    int m_watchdog_ms;//看门狗判定线程卡住的阈值（毫秒），0为不启用
     int m_close_log;//关闭日志,默认不关闭
     int m_actormodel;//并发模型,默认是proactor
 
     int m_pipefd[2];
     int m_epollfd;
-    http_conn *users;
+    int m_max_fd;            //最大文件描述符，由RLIMIT_NOFILE决定
+    conn_table<http_conn> users;
 
     //数据库相关
     connection_pool *m_connPool;
+    user_store *m_store;   //登录、注册使用的用户存储
     string m_user;         //登陆数据库用户名
     string m_passWord;     //登陆数据库密码
     string m_databaseName; //使用数据库名
@@ -76,7 +107,13 @@ public:
     int m_CONNTrigmode;
 
     //定时器相关
-    client_data *users_timer;
+    conn_table<client_data> users_timer;
+
+    //空闲连接淘汰相关
+    int m_evict_fd_pct;   //fd占用率高水位（百分比），0表示不淘汰
+    int m_evict_fd_high;  //连接数高水位，达到后淘汰空闲连接
+    int m_evict_fd_low;   //连接数低水位，淘汰到此为止
+    long m_evict_mem;     //内存高水位（字节），0表示不检测
     Utils utils;
 };
 #endif